@@ -0,0 +1,80 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Common definitions for benchmarks.
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define UNUSED(x)  (void)(x)
+
+#define mpb_printf(...)  fprintf(stderr, __VA_ARGS__)
+
+/*-----------------------------------------------------------------
+  High resolution timer in nano-seconds
+-----------------------------------------------------------------*/
+typedef int64_t mpb_nsecs_t;
+
+mpb_nsecs_t mpb_nsecs_now(void);   // monotonic
+
+// The `p`-th percentile (0 <= p <= 100) of `count` samples (sorts the samples in place)
+mpb_nsecs_t mpb_percentile(mpb_nsecs_t* samples, size_t count, double p);
+
+
+/*-----------------------------------------------------------------
+  Hardware cache counters (Linux `perf_event_open` only)
+  When counters are not available (other platforms, containers, or 
+  `perf_event_paranoid` settings), `mpb_counters_read` returns false.
+-----------------------------------------------------------------*/
+typedef struct mpb_counters_s {
+  int64_t l1d_misses;     // L1 data cache read misses
+  int64_t cache_misses;   // last level cache misses
+} mpb_counters_t;
+
+bool mpb_counters_start(void);                    // (re)start counting; returns false if not available
+bool mpb_counters_read(mpb_counters_t* counters); // read counts since the start
+void mpb_counters_done(void);
+
+// Format a count per operation into `buf` (or "n/a" if not available)
+const char* mpb_per_op(char* buf, size_t bufsize, bool available, int64_t count, int64_t ops);
+
+
+/*-----------------------------------------------------------------
+  Latency histogram with log-linear buckets (as in HDR histograms):
+  32 sub-buckets per power of 2 so values are kept within about 3%.
+-----------------------------------------------------------------*/
+#define MPB_HIST_SUB      (32)
+#define MPB_HIST_BUCKETS  (64 * MPB_HIST_SUB)
+
+typedef struct mpb_histogram_s {
+  int64_t      count;
+  mpb_nsecs_t  max;
+  double       total;
+  int64_t      counts[MPB_HIST_BUCKETS];
+} mpb_histogram_t;
+
+void        mpb_histogram_clear(mpb_histogram_t* h);
+void        mpb_histogram_add(mpb_histogram_t* h, mpb_nsecs_t value);
+mpb_nsecs_t mpb_histogram_percentile(const mpb_histogram_t* h, double p);   // the highest value in the bucket of the `p`-th percentile
+
+
+/*-----------------------------------------------------------------
+  Memory use of the process (or 0 if not available)
+-----------------------------------------------------------------*/
+size_t mpb_rss_current(void);                  // resident set size in bytes
+size_t mpb_proc_status(const char* field);     // a size field of /proc/self/status in bytes (like "VmHWM")
+size_t mpb_vma_count(void);                    // number of memory mappings
+
+
+/*-----------------------------------------------------------------
+  Stack use: write about `kib` KiB of stack (so it is committed and
+  counts in the RSS) and call `fun(arg)` at the bottom (if not NULL)
+-----------------------------------------------------------------*/
+void* mpb_stack_at_depth(size_t kib, void* (*fun)(void*), void* arg);
@@ -0,0 +1,86 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Channel throughput: a pipeline of a producer, a number of stages, and a
+  consumer connected by channels of various capacities. Reports messages
+  per second through the pipeline and the time per hand-off.
+
+  usage: bench_mp_chan [workers]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mpsched.h>
+#include "bench.h"
+
+#define MSGS     (1000000)
+#define STAGES   (4)
+
+static mp_chan_t* chans[STAGES + 1];
+static intptr_t   total;
+
+static void producer(void* arg) {
+  UNUSED(arg);
+  for (intptr_t i = 1; i <= MSGS; i++) {
+    mp_chan_send(chans[0], (void*)i);
+  }
+  mp_chan_close(chans[0]);
+}
+
+static void stage(void* arg) {
+  intptr_t n = (intptr_t)arg;
+  void* value;
+  while (mp_chan_recv(chans[n], &value)) {
+    mp_chan_send(chans[n + 1], value);
+  }
+  mp_chan_close(chans[n + 1]);
+}
+
+static void consumer(void* arg) {
+  UNUSED(arg);
+  void* value;
+  intptr_t sum = 0;
+  while (mp_chan_recv(chans[STAGES], &value)) {
+    sum += (intptr_t)value;
+  }
+  total = sum;
+}
+
+static void bench_pipeline(const char* name, size_t workers, size_t capacity) {
+  for (size_t i = 0; i <= STAGES; i++) { chans[i] = mp_chan_create(capacity); }
+  mp_sched_t* s = mp_sched_create(workers);
+  mp_sched_spawn(s, &consumer, NULL);
+  for (intptr_t i = STAGES - 1; i >= 0; i--) { mp_sched_spawn(s, &stage, (void*)i); }
+  mp_sched_spawn(s, &producer, NULL);
+  mpb_nsecs_t start = mpb_nsecs_now();
+  mp_sched_run(s);
+  mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+  mp_sched_free(s);
+  for (size_t i = 0; i <= STAGES; i++) { mp_chan_free(chans[i]); }
+  if (total != (intptr_t)MSGS * (MSGS + 1) / 2) {
+    mpb_printf("error: wrong total\n");
+    exit(1);
+  }
+  const double handoffs = (double)MSGS * (STAGES + 1);
+  mpb_printf("%-10s: %10.0f msgs/s, %7.1f ns per hand-off\n", name,
+             (double)MSGS / ((double)elapsed / 1e9), (double)elapsed / handoffs);
+}
+
+int main(int argc, char** argv) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = (ncpu <= 0 ? 1 : (size_t)ncpu);
+  if (argc > 1) { workers = (size_t)atol(argv[1]); }
+  if (workers == 0) workers = 1;
+  mp_init(NULL);
+  mpb_printf("channel pipeline: %zu workers, %d messages, %d stages\n", workers, MSGS, STAGES);
+  bench_pipeline("unbuffered", workers, 0);
+  bench_pipeline("bounded 1", workers, 1);
+  bench_pipeline("bounded 64", workers, 64);
+  bench_pipeline("unbounded", workers, MP_CHAN_UNBOUNDED);
+  return 0;
+}
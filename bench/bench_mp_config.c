@@ -0,0 +1,217 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Memory footprint of the gstack settings: runs a fixed prompt workload
+  under every combination of `gpool_enable`, `stack_grow_fast`,
+  `stack_use_overcommit`, `stack_reset_decommits`, `stack_cache_count`
+  and `stack_initial_commit`, and prints a table with the throughput,
+  peak RSS, the RSS after all prompts are done, the committed (writable
+  private) memory and mapping count at the peak, and the minor page faults.
+
+  As `mp_init` can be called only once per process, every configuration
+  runs in a forked child that sends its measurements back over a pipe.
+  With `stack_use_overcommit` the gpools and fast growing are disabled,
+  so only one such combination is run per other setting. (Conversely,
+  without gpools and fast growing, overcommit is used whenever the OS
+  allows it.)
+
+  The workload keeps `N` prompts alive that each use a varying amount of
+  stack (mostly 4-32 KiB, sometimes up to 512 KiB) and suspend in between,
+  interleaved with short-lived prompts that return right away.
+
+  usage: bench_mp_config [live-prompts] [rounds]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <mprompt.h>
+#include "bench.h"
+
+#define KIB        (1024)
+#define MIB        (1024.0*1024.0)
+#define SHORT_LIVED_PER_ROUND  (1000)
+
+
+/*-----------------------------------------------------------------
+  Workload
+-----------------------------------------------------------------*/
+
+static uint64_t rnd_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rnd(void) {
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return rnd_state * 0x2545F4914F6CDD1DULL;
+}
+
+// stack use in KiB: mostly small, with a tail of deep requests
+static int64_t rnd_stack_kib(void) {
+  const uint64_t x = rnd() % 100;
+  if (x < 90) return 4 + (int64_t)(rnd() % 28);
+  if (x < 99) return 32 + (int64_t)(rnd() % 96);
+  return 128 + (int64_t)(rnd() % 384);
+}
+
+// Use (and write) about `kib` KiB of stack; only written pages count in the RSS
+static void stack_use(int64_t kib) {
+  mpb_stack_at_depth((size_t)kib, NULL, NULL);
+}
+
+static void* yield_park(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;
+}
+
+static void* fun_live(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  for (;;) {
+    stack_use(rnd_stack_kib());
+    if (mp_yield(p, &yield_park, NULL) == NULL) break;
+  }
+  return NULL;
+}
+
+static void* fun_short(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  stack_use(rnd_stack_kib());
+  return NULL;
+}
+
+
+/*-----------------------------------------------------------------
+  Measure one configuration (in a child process)
+-----------------------------------------------------------------*/
+
+typedef struct result_s {
+  bool    ok;
+  double  ops_per_sec;   // resumes and short-lived prompts
+  size_t  peak_rss;
+  size_t  done_rss;      // after all prompts are done
+  size_t  committed;     // writable private memory at the peak
+  size_t  vmas;          // number of mappings at the peak
+  long    minor_faults;
+} result_t;
+
+static long minor_faults(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_minflt;
+}
+
+static void run_config(const mp_config_t* config, size_t live, size_t rounds, result_t* res) {
+  mp_init(config);
+  mp_resume_t** rs = (mp_resume_t**)calloc(live, sizeof(mp_resume_t*));
+  if (rs == NULL) return;
+  const long faults = minor_faults();
+  const mpb_nsecs_t start = mpb_nsecs_now();
+  int64_t ops = 0;
+  for (size_t i = 0; i < live; i++) {
+    rs[i] = (mp_resume_t*)mp_prompt(&fun_live, NULL);
+    ops++;
+  }
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < live; i++) {
+      rs[i] = (mp_resume_t*)mp_resume(rs[i], rs[i]);
+      ops++;
+    }
+    for (size_t i = 0; i < SHORT_LIVED_PER_ROUND; i++) {
+      mp_prompt(&fun_short, NULL);
+      ops++;
+    }
+  }
+  res->committed = mpb_proc_status("VmData");
+  res->vmas = mpb_vma_count();
+  for (size_t i = 0; i < live; i++) {
+    mp_resume(rs[i], NULL);
+  }
+  const mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+  res->minor_faults = minor_faults() - faults;
+  res->ops_per_sec = (double)ops * 1e9 / (double)(elapsed > 0 ? elapsed : 1);
+  res->peak_rss = mpb_proc_status("VmHWM");
+  res->done_rss = mpb_rss_current();
+  res->ok = true;
+  free(rs);
+}
+
+static bool run_child(const mp_config_t* config, size_t live, size_t rounds, result_t* res) {
+  memset(res, 0, sizeof(*res));
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(stderr);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]); close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    run_config(config, live, rounds, res);
+    const bool written = (write(fds[1], res, sizeof(*res)) == (ssize_t)sizeof(*res));
+    close(fds[1]);
+    _exit(written ? 0 : 1);
+  }
+  close(fds[1]);
+  const bool received = (read(fds[0], res, sizeof(*res)) == (ssize_t)sizeof(*res));
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return (received && res->ok && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+
+/*-----------------------------------------------------------------
+  Main
+-----------------------------------------------------------------*/
+
+int main(int argc, char** argv) {
+  size_t live = 1000;
+  size_t rounds = 20;
+  if (argc > 1) { live = (size_t)atol(argv[1]); }
+  if (argc > 2) { rounds = (size_t)atol(argv[2]); }
+  if (live == 0) live = 1;
+
+  static const ptrdiff_t cache_counts[] = { 0, 4, 32 };
+  static const ptrdiff_t initial_commits[] = { 4*KIB, 64*KIB };
+  const mp_config_t defaults = mp_config_default();
+
+  mpb_printf("configuration matrix: %zu live prompts, %zu rounds (default: gpool %d, grow_fast %d, cache %td)\n\n",
+             live, rounds, defaults.gpool_enable, defaults.stack_grow_fast, defaults.stack_cache_count);
+  mpb_printf("%5s %9s %10s %13s %5s %7s | %10s %10s %10s %10s %7s %10s\n",
+             "gpool", "grow_fast", "overcommit", "reset_decomm", "cache", "initial",
+             "kops/s", "peak MiB", "done MiB", "commit MiB", "vmas", "minflt");
+  for (int bits = 0; bits < 16; bits++) {
+    mp_config_t config = defaults;
+    config.gpool_enable = ((bits & 1) != 0);
+    config.stack_grow_fast = ((bits & 2) != 0);
+    config.stack_use_overcommit = ((bits & 4) != 0);
+    config.stack_reset_decommits = ((bits & 8) != 0);
+    if (config.stack_use_overcommit && (config.gpool_enable || config.stack_grow_fast)) continue;   // same as without these
+    for (size_t c = 0; c < sizeof(cache_counts)/sizeof(cache_counts[0]); c++) {
+      for (size_t i = 0; i < sizeof(initial_commits)/sizeof(initial_commits[0]); i++) {
+        config.stack_cache_count = cache_counts[c];
+        config.stack_initial_commit = initial_commits[i];
+        mpb_printf("%5d %9d %10d %13d %5td %4td KiB | ",
+                   config.gpool_enable, config.stack_grow_fast, config.stack_use_overcommit, config.stack_reset_decommits,
+                   config.stack_cache_count, config.stack_initial_commit / KIB);
+        result_t res;
+        if (!run_child(&config, live, rounds, &res)) {
+          mpb_printf("failed\n");
+          continue;
+        }
+        mpb_printf("%10.1f %10.1f %10.1f %10.1f %7zu %10ld\n",
+                   res.ops_per_sec / 1000.0, (double)res.peak_rss / MIB, (double)res.done_rss / MIB,
+                   (double)res.committed / MIB, res.vmas, res.minor_faults);
+      }
+    }
+  }
+  return 0;
+}
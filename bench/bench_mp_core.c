@@ -0,0 +1,312 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Micro-benchmarks of the core primitives with the mean, median and 99th
+  percentile per operation. Cheap operations are timed in batches (and a
+  sample is the mean of a batch) as reading the clock costs about as much
+  as the operation itself; expensive ones are timed one by one. The results
+  are printed as a table and optionally written as JSON to diff releases
+  (the `mp_bench` target writes `mp_bench.json` in the build directory).
+
+  usage: bench_mp_core [json-file]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <mprompt.h>
+#include "bench.h"
+
+#define SAMPLES    (10000)
+#define WARMUP     (1000)     // iterations before sampling
+#define BATCH      (64)
+#define KIB        (1024)
+
+static mpb_nsecs_t samples[SAMPLES];
+static size_t      sample_count;
+
+
+/*-----------------------------------------------------------------
+  Results
+-----------------------------------------------------------------*/
+
+typedef struct result_s {
+  const char*  name;
+  size_t       samples;
+  size_t       batch;
+  double       mean;
+  mpb_nsecs_t  p50;
+  mpb_nsecs_t  p99;
+} result_t;
+
+#define MAX_RESULTS  (32)
+static result_t results[MAX_RESULTS];
+static size_t   result_count;
+
+static size_t      warmup;   // samples left to skip
+
+static void sample_add(mpb_nsecs_t elapsed, size_t batch) {
+  if (warmup > 0) { warmup--; return; }
+  if (sample_count < SAMPLES) { samples[sample_count++] = elapsed / (mpb_nsecs_t)batch; }
+}
+
+static void result_add(const char* name, size_t batch) {
+  if (result_count >= MAX_RESULTS) return;
+  result_t* r = &results[result_count++];
+  double total = 0;
+  for (size_t i = 0; i < sample_count; i++) { total += (double)samples[i]; }
+  r->name = name;
+  r->samples = sample_count;
+  r->batch = batch;
+  r->mean = (sample_count == 0 ? 0.0 : total / (double)sample_count);
+  r->p50 = mpb_percentile(samples, sample_count, 50.0);
+  r->p99 = mpb_percentile(samples, sample_count, 99.0);
+  mpb_printf("%-28s %8zu %6zu %10.1f %10lld %10lld\n", r->name, r->samples, r->batch, r->mean, (long long)r->p50, (long long)r->p99);
+  sample_count = 0;
+}
+
+static void results_write_json(FILE* f) {
+  fprintf(f, "{\n  \"unit\": \"ns\",\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < result_count; i++) {
+    const result_t* r = &results[i];
+    fprintf(f, "    { \"name\": \"%s\", \"samples\": %zu, \"batch\": %zu, \"mean\": %.1f, \"p50\": %lld, \"p99\": %lld }%s\n",
+            r->name, r->samples, r->batch, r->mean, (long long)r->p50, (long long)r->p99, (i + 1 < result_count ? "," : ""));
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+
+/*-----------------------------------------------------------------
+  Prompts
+-----------------------------------------------------------------*/
+
+static void* fun_return(mp_prompt_t* p, void* arg) {
+  UNUSED(p);
+  return arg;
+}
+
+static void bench_prompt_return(void) {
+  warmup = WARMUP;
+  for (size_t i = 0; i < SAMPLES + WARMUP; i++) {
+    mpb_nsecs_t start = mpb_nsecs_now();
+    for (size_t j = 0; j < BATCH; j++) {
+      mp_prompt(&fun_return, NULL);
+    }
+    sample_add(mpb_nsecs_now() - start, BATCH);
+  }
+  result_add("prompt_create_return", BATCH);
+}
+
+
+static void* yield_return(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;
+}
+
+static void* fun_yield(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  while (mp_yield(p, &yield_return, NULL) != NULL) { }
+  return NULL;
+}
+
+// a yield and resume round trip
+static void bench_yield_resume(void) {
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&fun_yield, NULL);
+  warmup = WARMUP;
+  for (size_t i = 0; i < SAMPLES + WARMUP; i++) {
+    mpb_nsecs_t start = mpb_nsecs_now();
+    for (size_t j = 0; j < BATCH; j++) {
+      r = (mp_resume_t*)mp_resume(r, r);
+    }
+    sample_add(mpb_nsecs_now() - start, BATCH);
+  }
+  mp_resume(r, NULL);
+  result_add("yield_resume", BATCH);
+}
+
+
+static void* yield_resume_tail(mp_resume_t* r, void* arg) {
+  return mp_resume_tail(r, arg);
+}
+
+// a yield that is resumed in tail position by the yield function (as in an effect handler)
+static void* fun_yield_tail(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  warmup = WARMUP;
+  for (size_t i = 0; i < SAMPLES + WARMUP; i++) {
+    mpb_nsecs_t start = mpb_nsecs_now();
+    for (size_t j = 0; j < BATCH; j++) {
+      mp_yield(p, &yield_resume_tail, NULL);
+    }
+    sample_add(mpb_nsecs_now() - start, BATCH);
+  }
+  return NULL;
+}
+
+static void bench_resume_tail(void) {
+  mp_prompt(&fun_yield_tail, NULL);
+  result_add("yield_resume_tail", BATCH);
+}
+
+
+/*-----------------------------------------------------------------
+  Multi-shot resumptions: every resume restores the captured stack
+-----------------------------------------------------------------*/
+
+#define MULTI_RESUMES  (2000)
+
+static void* yield_multi(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  r = mp_resume_multi(r);
+  warmup = 1;   // the first resume does not copy the stack yet
+  for (size_t i = 0; i < MULTI_RESUMES + 1; i++) {
+    mpb_nsecs_t start = mpb_nsecs_now();
+    mp_resume(mp_resume_dup(r), NULL);
+    sample_add(mpb_nsecs_now() - start, 1);
+  }
+  return mp_resume(r, NULL);
+}
+
+static void* multi_yield_at_bottom(void* arg) {
+  return mp_yield((mp_prompt_t*)arg, &yield_multi, NULL);
+}
+
+static void* fun_multi(mp_prompt_t* p, void* arg) {
+  return mpb_stack_at_depth((size_t)(uintptr_t)arg, &multi_yield_at_bottom, p);
+}
+
+static void bench_resume_multi(size_t kb, const char* name) {
+  mp_prompt(&fun_multi, (void*)(uintptr_t)kb);
+  result_add(name, 1);
+}
+
+
+/*-----------------------------------------------------------------
+  Gstack allocation: the thread-local cache or a fresh stack
+-----------------------------------------------------------------*/
+
+#define MISS_COUNT  (256)
+
+static void bench_gstack_hit(void) {
+  warmup = WARMUP;
+  for (size_t i = 0; i < SAMPLES + WARMUP; i++) {
+    mpb_nsecs_t start = mpb_nsecs_now();
+    for (size_t j = 0; j < BATCH; j++) {
+      mp_prompt_release(mp_prompt_create());
+    }
+    sample_add(mpb_nsecs_now() - start, BATCH);
+  }
+  result_add("gstack_alloc_cache_hit", BATCH);
+}
+
+static void bench_gstack_miss(ptrdiff_t cache_count) {
+  // hold on to enough prompts to empty the cache so every allocation is fresh
+  mp_prompt_t* held[MISS_COUNT];
+  for (size_t round = 0; round < SAMPLES / MISS_COUNT; round++) {
+    for (ptrdiff_t i = 0; i < cache_count; i++) { held[i] = mp_prompt_create(); }
+    for (size_t i = (size_t)cache_count; i < MISS_COUNT; i++) {
+      mpb_nsecs_t start = mpb_nsecs_now();
+      held[i] = mp_prompt_create();
+      sample_add(mpb_nsecs_now() - start, 1);
+    }
+    for (size_t i = 0; i < MISS_COUNT; i++) { mp_prompt_release(held[i]); }
+  }
+  result_add("gstack_alloc_cache_miss", 1);
+}
+
+
+/*-----------------------------------------------------------------
+  Commit-on-demand: time the stack accesses that page fault
+  on fresh stacks (a fault may commit more than one page)
+-----------------------------------------------------------------*/
+
+#define FAULT_STACK_KIB  (256)
+
+static long minor_faults(void) {
+  struct rusage ru;
+  #if defined(RUSAGE_THREAD)
+  getrusage(RUSAGE_THREAD, &ru);
+  #else
+  getrusage(RUSAGE_SELF, &ru);
+  #endif
+  return ru.ru_minflt;
+}
+
+#if defined(__GNUC__)
+#define bench_noinline  __attribute__((noinline))
+#else
+#define bench_noinline
+#endif
+
+static bench_noinline uint8_t* stack_address(volatile uint8_t* p) {
+  return (uint8_t*)p;
+}
+
+static void* fun_touch(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  volatile uint8_t top = 0;
+  uint8_t* sp = stack_address(&top);
+  for (size_t ofs = 4*KIB; ofs < FAULT_STACK_KIB*KIB; ofs += 4*KIB) {
+    volatile uint8_t* q = sp - ofs;   // below our frame (as in `test_mp_async.c`)
+    long faults = minor_faults();
+    mpb_nsecs_t start = mpb_nsecs_now();
+    volatile uint8_t b = *q;
+    mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+    UNUSED(b);
+    if (minor_faults() != faults) { sample_add(elapsed, 1); }
+  }
+  return NULL;
+}
+
+static void bench_commit_fault(ptrdiff_t cache_count) {
+  mp_prompt_t* held[MISS_COUNT];
+  for (size_t round = 0; round < 64 && sample_count < SAMPLES; round++) {
+    // fresh stacks only
+    for (ptrdiff_t i = 0; i < cache_count; i++) { held[i] = mp_prompt_create(); }
+    mp_prompt(&fun_touch, NULL);
+    for (ptrdiff_t i = 0; i < cache_count; i++) { mp_prompt_release(held[i]); }
+  }
+  result_add("commit_on_demand_fault", 1);
+}
+
+
+/*-----------------------------------------------------------------
+  Main
+-----------------------------------------------------------------*/
+
+int main(int argc, char** argv) {
+  const char* json = (argc > 1 ? argv[1] : NULL);
+  mp_config_t config = mp_config_default();
+  config.stack_no_profile = true;   // otherwise fresh stacks are committed up front
+  mp_init(&config);
+  ptrdiff_t cache_count = config.stack_cache_count;
+  if (cache_count < 0) cache_count = 0;
+  if (cache_count > MISS_COUNT / 2) cache_count = MISS_COUNT / 2;
+
+  mpb_printf("%-28s %8s %6s %10s %10s %10s\n", "benchmark (ns/op)", "samples", "batch", "mean", "p50", "p99");
+  bench_prompt_return();
+  bench_yield_resume();
+  bench_resume_tail();
+  bench_resume_multi(1, "resume_multi_1kb");
+  bench_resume_multi(16, "resume_multi_16kb");
+  bench_resume_multi(128, "resume_multi_128kb");
+  bench_gstack_hit();
+  bench_gstack_miss(cache_count);
+  bench_commit_fault(cache_count);
+
+  if (json != NULL) {
+    FILE* f = (strcmp(json, "-") == 0 ? stdout : fopen(json, "w"));
+    if (f == NULL) {
+      mpb_printf("unable to write %s\n", json);
+      return 1;
+    }
+    results_write_json(f);
+    if (f != stdout) { fclose(f); }
+  }
+  return 0;
+}
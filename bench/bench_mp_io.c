@@ -0,0 +1,167 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Echo benchmark for the epoll based I/O of the scheduler:
+  client tasks send a small request and wait for the echo of a server task,
+  over a unix socket pair or a TCP loopback connection. Reports requests per
+  second and the median and 99th percentile round-trip latency.
+
+  usage: bench_mp_io [workers] [connections]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <mpsched.h>
+#include "bench.h"
+
+#define REQUESTS      (2000)   // per connection
+#define MSG_SIZE      (64)
+
+static size_t              conn_count = 64;
+static mpb_nsecs_t*        latencies;      // REQUESTS per connection
+static struct sockaddr_in  tcp_addr;
+
+static void echo_server(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[MSG_SIZE];
+  ssize_t n;
+  while ((n = mp_io_read(fd, buf, sizeof(buf))) > 0) {
+    if (mp_io_write(fd, buf, (size_t)n) != n) break;
+  }
+  mp_io_close(fd);
+}
+
+static bool echo_request(int fd, char* buf) {
+  if (mp_io_write(fd, buf, MSG_SIZE) != MSG_SIZE) return false;
+  size_t got = 0;
+  while (got < MSG_SIZE) {
+    ssize_t n = mp_io_read(fd, buf + got, MSG_SIZE - got);
+    if (n <= 0) return false;
+    got += (size_t)n;
+  }
+  return true;
+}
+
+static void echo_client_run(int fd, size_t conn) {
+  char buf[MSG_SIZE];
+  memset(buf, 'x', sizeof(buf));
+  for (size_t i = 0; i < REQUESTS; i++) {
+    mpb_nsecs_t start = mpb_nsecs_now();
+    if (!echo_request(fd, buf)) {
+      mpb_printf("echo request failed\n");
+      exit(1);
+    }
+    latencies[conn*REQUESTS + i] = mpb_nsecs_now() - start;
+  }
+  mp_io_close(fd);
+}
+
+
+// unix socket pairs
+static void pair_client(void* arg) {
+  size_t conn = (size_t)arg;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    mpb_printf("unable to create a socket pair\n");
+    exit(1);
+  }
+  mp_io_nonblock(fds[0]);
+  mp_io_nonblock(fds[1]);
+  mp_task_spawn(&echo_server, (void*)(intptr_t)fds[1]);
+  echo_client_run(fds[0], conn);
+}
+
+// TCP loopback
+static void tcp_listener(void* arg) {
+  int lfd = (int)(intptr_t)arg;
+  for (size_t i = 0; i < conn_count; i++) {
+    int cfd = mp_io_accept(lfd, NULL, NULL);
+    if (cfd < 0) break;
+    int one = 1;
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    mp_task_spawn(&echo_server, (void*)(intptr_t)cfd);
+  }
+  mp_io_close(lfd);
+}
+
+static void tcp_client(void* arg) {
+  size_t conn = (size_t)arg;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  mp_io_nonblock(fd);
+  if (mp_io_connect(fd, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) != 0) {
+    mpb_printf("unable to connect\n");
+    exit(1);
+  }
+  echo_client_run(fd, conn);
+}
+
+static int tcp_listen(void) {
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lfd < 0) return -1;
+  memset(&tcp_addr, 0, sizeof(tcp_addr));
+  tcp_addr.sin_family = AF_INET;
+  tcp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(tcp_addr);
+  if (bind(lfd, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) != 0 ||
+      getsockname(lfd, (struct sockaddr*)&tcp_addr, &len) != 0 ||
+      listen(lfd, (int)conn_count) != 0) {
+    close(lfd);
+    return -1;
+  }
+  mp_io_nonblock(lfd);
+  return lfd;
+}
+
+static void bench_echo(const char* name, size_t workers, bool tcp) {
+  mp_sched_t* s = mp_sched_create(workers);
+  if (tcp) {
+    int lfd = tcp_listen();
+    if (lfd < 0) {
+      mpb_printf("%-5s: skipped (no loopback networking)\n", name);
+      mp_sched_free(s);
+      return;
+    }
+    mp_sched_spawn(s, &tcp_listener, (void*)(intptr_t)lfd);
+  }
+  for (size_t i = 0; i < conn_count; i++) {
+    mp_sched_spawn(s, (tcp ? &tcp_client : &pair_client), (void*)i);
+  }
+  mpb_nsecs_t start = mpb_nsecs_now();
+  mp_sched_run(s);
+  mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+  mp_sched_free(s);
+  const size_t total = conn_count * REQUESTS;
+  const double rps = (double)total / ((double)elapsed / 1e9);
+  const mpb_nsecs_t p50 = mpb_percentile(latencies, total, 50);
+  const mpb_nsecs_t p99 = mpb_percentile(latencies, total, 99);
+  mpb_printf("%-5s: %9.0f requests/s, latency p50: %7.1f us, p99: %7.1f us\n",
+             name, rps, (double)p50 / 1e3, (double)p99 / 1e3);
+}
+
+int main(int argc, char** argv) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = (ncpu <= 0 ? 1 : (size_t)ncpu);
+  if (argc > 1) { workers = (size_t)atol(argv[1]); }
+  if (argc > 2) { conn_count = (size_t)atol(argv[2]); }
+  if (workers == 0) workers = 1;
+  if (conn_count == 0) conn_count = 1;
+  mp_init(NULL);
+  latencies = (mpb_nsecs_t*)calloc(conn_count * REQUESTS, sizeof(mpb_nsecs_t));
+  mpb_printf("echo: %zu workers, %zu connections x %d requests of %d bytes\n", workers, conn_count, REQUESTS, MSG_SIZE);
+  bench_echo("pair", workers, false);
+  bench_echo("tcp", workers, true);
+  free(latencies);
+  return 0;
+}
@@ -0,0 +1,107 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Tail latency of latency-critical requests under a bulk load: a client
+  thread submits a burst of bulk requests (each some CPU work) and one
+  critical request every millisecond (at about 30% load of the worker, as
+  the client thread needs some CPU as well). We measure the time from
+  submission until the critical request runs, once with all requests in the
+  default (FIFO) class, and once with the critical requests at a higher
+  priority with a deadline.
+
+  usage: bench_mp_prio [workers]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <mpsched.h>
+#include "bench.h"
+
+#define ROUNDS          (1000)
+#define ROUND_NSECS     (1000000)   // 1ms
+#define BULK_PER_ROUND  (6)
+#define BULK_WORK       (50000)     // nsecs of work per bulk request
+#define CRIT_DEADLINE   (500000)    // 0.5ms
+
+static mp_sched_t*   sched;
+static bool          use_prio;
+static volatile bool client_done;
+static mpb_nsecs_t   submitted[ROUNDS];
+static mpb_nsecs_t   samples[ROUNDS];
+
+static void bulk_request(void* arg) {
+  UNUSED(arg);
+  volatile uint64_t x = 0;
+  mpb_nsecs_t start = mpb_nsecs_now();
+  while (mpb_nsecs_now() - start < BULK_WORK) { x = x + 1; }
+}
+
+static void crit_request(void* arg) {
+  size_t i = (size_t)(intptr_t)arg;
+  samples[i] = mpb_nsecs_now() - submitted[i];
+}
+
+// keep the scheduler running until the client is done
+static void keeper(void* arg) {
+  UNUSED(arg);
+  while (!client_done) { mp_sleep(ROUND_NSECS); }
+}
+
+static void* client(void* arg) {
+  UNUSED(arg);
+  mpb_nsecs_t next = mpb_nsecs_now();
+  for (size_t i = 0; i < ROUNDS; i++) {
+    for (size_t j = 0; j < BULK_PER_ROUND; j++) {
+      mp_sched_spawn(sched, &bulk_request, NULL);
+    }
+    submitted[i] = mpb_nsecs_now();
+    if (use_prio) {
+      mp_sched_spawn_prio(sched, &crit_request, (void*)(intptr_t)i, 1, CRIT_DEADLINE);
+    }
+    else {
+      mp_sched_spawn(sched, &crit_request, (void*)(intptr_t)i);
+    }
+    next += ROUND_NSECS;
+    mpb_nsecs_t now = mpb_nsecs_now();
+    if (next > now) { usleep((useconds_t)((next - now) / 1000)); }
+  }
+  client_done = true;
+  return NULL;
+}
+
+static void bench_run(size_t workers, bool prio) {
+  use_prio = prio;
+  client_done = false;
+  sched = mp_sched_create(workers);
+  mp_sched_spawn(sched, &keeper, NULL);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &client, NULL) != 0) {
+    mpb_printf("unable to create the client thread\n");
+    exit(1);
+  }
+  mp_sched_run(sched);
+  pthread_join(thread, NULL);
+  mp_sched_free(sched);
+  mpb_printf("%-8s: critical latency p50: %8.1fus, p99: %8.1fus, max: %8.1fus\n", (prio ? "priority" : "fifo"),
+             (double)mpb_percentile(samples, ROUNDS, 50) / 1e3,
+             (double)mpb_percentile(samples, ROUNDS, 99) / 1e3,
+             (double)mpb_percentile(samples, ROUNDS, 100) / 1e3);
+}
+
+int main(int argc, char** argv) {
+  size_t workers = 1;
+  if (argc > 1) { workers = (size_t)atol(argv[1]); }
+  if (workers == 0) workers = 1;
+  mp_init(NULL);
+  mpb_printf("mixed load: %zu workers, every %dus: %d bulk requests of %dus and one critical request\n",
+             workers, ROUND_NSECS / 1000, BULK_PER_ROUND, BULK_WORK / 1000);
+  bench_run(workers, false);
+  bench_run(workers, true);
+  return 0;
+}
@@ -0,0 +1,87 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Scaling of the M:N scheduler from 1 to N workers:
+  - yield: many tasks that alternate a bit of work with `mp_task_yield`.
+  - tree : a binary tree of spawned tasks (load balancing by work stealing).
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mpsched.h>
+#include "bench.h"
+
+#define YIELD_TASKS   (1000)
+#define YIELD_COUNT   (1000)
+#define WORK          (1000)   // iterations of busy work between yields
+#define TREE_DEPTH    (16)
+
+static intptr_t do_work(intptr_t n) {
+  volatile intptr_t acc = 0;
+  for (intptr_t i = 0; i < n; i++) { acc += i; }
+  return acc;
+}
+
+static void yield_task(void* arg) {
+  UNUSED(arg);
+  for (int i = 0; i < YIELD_COUNT; i++) {
+    do_work(WORK);
+    mp_task_yield();
+  }
+}
+
+static void tree_task(void* arg) {
+  intptr_t depth = (intptr_t)arg;
+  do_work(WORK);
+  if (depth > 0) {
+    mp_task_spawn(&tree_task, (void*)(depth - 1));
+    mp_task_spawn(&tree_task, (void*)(depth - 1));
+  }
+}
+
+static double bench_yield(size_t workers) {
+  mp_sched_t* s = mp_sched_create(workers);
+  for (int i = 0; i < YIELD_TASKS; i++) {
+    mp_sched_spawn(s, &yield_task, NULL);
+  }
+  mpb_nsecs_t start = mpb_nsecs_now();
+  mp_sched_run(s);
+  mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+  mp_sched_free(s);
+  return (double)elapsed / 1e6;
+}
+
+static double bench_tree(size_t workers) {
+  mp_sched_t* s = mp_sched_create(workers);
+  mp_sched_spawn(s, &tree_task, (void*)TREE_DEPTH);
+  mpb_nsecs_t start = mpb_nsecs_now();
+  mp_sched_run(s);
+  mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+  mp_sched_free(s);
+  return (double)elapsed / 1e6;
+}
+
+int main(int argc, char** argv) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_workers = (ncpu <= 0 ? 1 : (size_t)ncpu);
+  if (argc > 1) { max_workers = (size_t)atol(argv[1]); }
+  if (max_workers == 0) max_workers = 1;
+  mp_init(NULL);
+  mpb_printf("scheduler scaling (%zu processors)\n", (size_t)(ncpu <= 0 ? 1 : ncpu));
+  mpb_printf("yield: %d tasks x %d yields, tree: depth %d (%d tasks)\n", YIELD_TASKS, YIELD_COUNT, TREE_DEPTH, (1 << (TREE_DEPTH+1)) - 1);
+  double yield1 = 0;
+  double tree1 = 0;
+  for (size_t n = 1; n <= max_workers; n = (n*2 > max_workers && n < max_workers ? max_workers : n*2)) {
+    double y = bench_yield(n);
+    double t = bench_tree(n);
+    if (n == 1) { yield1 = y; tree1 = t; }
+    mpb_printf("workers: %3zu, yield: %9.2f ms (speedup %5.2fx), tree: %9.2f ms (speedup %5.2fx)\n",
+               n, y, yield1 / y, t, tree1 / t);
+  }
+  return 0;
+}
@@ -0,0 +1,279 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Simulation of an asynchronous server on a single thread: requests arrive
+  open-loop (with exponential inter-arrival times at a fixed rate, whether
+  or not earlier requests are done) on `N` connections that each run in
+  their own prompt. Most requests are short (little stack and one short
+  wait); some are deep (up to 256 KiB of stack and several longer waits).
+  A wait suspends the prompt in a timer queue (a binary heap) that the
+  event loop resumes when it expires.
+
+  The latency of a request is measured from its scheduled arrival (so
+  queueing behind a busy connection or a slow event loop counts as well)
+  and reported as percentiles of a log-linear histogram, together with the
+  throughput and the resident set size over time.
+
+  usage: bench_mp_server [connections] [requests/sec] [seconds]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <mprompt.h>
+#include "bench.h"
+
+#define PENDING_MAX       (256)          // queued requests per connection
+#define DEEP_PERCENT      (10)           // percentage of deep requests
+#define SHORT_WAIT_MAX    (1000000)      // up to 1ms
+#define DEEP_WAIT_MAX     (5000000)      // up to 5ms per wait
+#define RSS_INTERVAL      (500000000)    // report the RSS every 0.5s
+
+
+/*-----------------------------------------------------------------
+  Random numbers (xorshift64*)
+-----------------------------------------------------------------*/
+
+static uint64_t rnd_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rnd(void) {
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return rnd_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int64_t rnd_below(int64_t n) {
+  return (int64_t)(rnd() % (uint64_t)n);
+}
+
+// exponentially distributed with the given mean
+static int64_t rnd_exp(double mean) {
+  const double u = ((double)(rnd() >> 11) + 0.5) / 9007199254740992.0;   // (0,1)
+  return (int64_t)(-log(u) * mean);
+}
+
+
+/*-----------------------------------------------------------------
+  Timer queue
+-----------------------------------------------------------------*/
+
+typedef struct timer_entry_s {
+  mpb_nsecs_t   due;
+  mp_resume_t*  resume;
+} timer_entry_t;
+
+static timer_entry_t* timers;
+static size_t         timer_count;
+static size_t         timer_capacity;
+
+static void timer_push(mpb_nsecs_t due, mp_resume_t* r) {
+  if (timer_count >= timer_capacity) {
+    timer_capacity = (timer_capacity == 0 ? 1024 : 2*timer_capacity);
+    timers = (timer_entry_t*)realloc(timers, timer_capacity * sizeof(timer_entry_t));
+    if (timers == NULL) { mpb_printf("out of memory\n"); exit(1); }
+  }
+  size_t i = timer_count++;
+  while (i > 0 && timers[(i-1)/2].due > due) {
+    timers[i] = timers[(i-1)/2];
+    i = (i-1)/2;
+  }
+  timers[i].due = due;
+  timers[i].resume = r;
+}
+
+static mp_resume_t* timer_pop(void) {
+  mp_resume_t* r = timers[0].resume;
+  const timer_entry_t last = timers[--timer_count];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2*i + 1;
+    if (child >= timer_count) break;
+    if (child + 1 < timer_count && timers[child+1].due < timers[child].due) child++;
+    if (timers[child].due >= last.due) break;
+    timers[i] = timers[child];
+    i = child;
+  }
+  timers[i] = last;
+  return r;
+}
+
+
+/*-----------------------------------------------------------------
+  Connections
+-----------------------------------------------------------------*/
+
+typedef struct conn_s {
+  mp_resume_t*  idle;                  // non-NULL when waiting for a request
+  size_t        pending_head;
+  size_t        pending_count;
+  mpb_nsecs_t   pending[PENDING_MAX];  // arrival times of queued requests
+} conn_t;
+
+static conn_t*         conns;
+static mpb_histogram_t latencies;
+static int64_t         completed;
+static int64_t         dropped;
+static bool            stopping;
+
+// Use (and write) about `kib` KiB of stack; only written pages count in the RSS
+static void stack_use(int64_t kib) {
+  mpb_stack_at_depth((size_t)kib, NULL, NULL);
+}
+
+static void* wait_park(mp_resume_t* r, void* arg) {
+  timer_push(mpb_nsecs_now() + (mpb_nsecs_t)(intptr_t)arg, r);
+  return NULL;
+}
+
+static void wait_for(mp_prompt_t* p, mpb_nsecs_t nsecs) {
+  mp_yield(p, &wait_park, (void*)(intptr_t)nsecs);
+}
+
+static void handle_request(mp_prompt_t* p) {
+  if (rnd_below(100) < DEEP_PERCENT) {
+    stack_use(64 + rnd_below(192));
+    const int64_t waits = 2 + rnd_below(3);
+    for (int64_t i = 0; i < waits; i++) {
+      wait_for(p, rnd_below(DEEP_WAIT_MAX));
+    }
+  }
+  else {
+    stack_use(4 + rnd_below(12));
+    wait_for(p, rnd_below(SHORT_WAIT_MAX));
+  }
+}
+
+static void* idle_park(mp_resume_t* r, void* arg) {
+  ((conn_t*)arg)->idle = r;
+  return NULL;
+}
+
+static void* conn_run(mp_prompt_t* p, void* arg) {
+  conn_t* c = (conn_t*)arg;
+  for (;;) {
+    mpb_nsecs_t arrival;
+    if (c->pending_count > 0) {
+      arrival = c->pending[c->pending_head];
+      c->pending_head = (c->pending_head + 1) % PENDING_MAX;
+      c->pending_count--;
+    }
+    else {
+      void* req = mp_yield(p, &idle_park, c);
+      if (req == NULL) break;   // shut down
+      arrival = *((mpb_nsecs_t*)req);
+    }
+    handle_request(p);
+    mpb_histogram_add(&latencies, mpb_nsecs_now() - arrival);
+    completed++;
+  }
+  return NULL;
+}
+
+static void request_arrive(conn_t* c, mpb_nsecs_t arrival) {
+  if (c->idle != NULL) {
+    mp_resume_t* r = c->idle;
+    c->idle = NULL;
+    mp_resume(r, &arrival);
+  }
+  else if (c->pending_count < PENDING_MAX) {
+    c->pending[(c->pending_head + c->pending_count) % PENDING_MAX] = arrival;
+    c->pending_count++;
+  }
+  else {
+    dropped++;
+  }
+}
+
+
+/*-----------------------------------------------------------------
+  Event loop
+-----------------------------------------------------------------*/
+
+static void sleep_until(mpb_nsecs_t until) {
+  mpb_nsecs_t delay = until - mpb_nsecs_now();
+  if (delay > 100000) {   // sleep if more than 0.1ms (a bit less to wake up in time), otherwise spin
+    if (delay > 10000000) { delay = 10000000; }
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long)(delay - 50000);
+    nanosleep(&ts, NULL);
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t  n = 1000;
+  double  rate = 20000;
+  double  secs = 5;
+  if (argc > 1) { n = (size_t)atol(argv[1]); }
+  if (argc > 2) { rate = atof(argv[2]); }
+  if (argc > 3) { secs = atof(argv[3]); }
+  if (n == 0) n = 1;
+  if (rate <= 0) rate = 1;
+  mp_init(NULL);
+  mpb_histogram_clear(&latencies);
+  mpb_printf("server simulation: %zu connections, %.0f requests/s for %.1fs, %d%% deep requests\n", n, rate, secs, DEEP_PERCENT);
+
+  conns = (conn_t*)calloc(n, sizeof(conn_t));
+  if (conns == NULL) return 1;
+  for (size_t i = 0; i < n; i++) {
+    mp_prompt(&conn_run, &conns[i]);   // runs until it waits for its first request
+  }
+
+  const mpb_nsecs_t start = mpb_nsecs_now();
+  const mpb_nsecs_t end = start + (mpb_nsecs_t)(secs * 1e9);
+  const double mean_interval = 1e9 / rate;
+  mpb_nsecs_t next_arrival = start + rnd_exp(mean_interval);
+  mpb_nsecs_t next_report = start + RSS_INTERVAL;
+  size_t peak_rss = 0;
+  for (;;) {
+    const mpb_nsecs_t now = mpb_nsecs_now();
+    if (now >= end) { stopping = true; }
+    if (stopping && timer_count == 0) break;
+    // arrivals (at their scheduled time; if we fall behind they arrive in a burst)
+    while (!stopping && next_arrival <= now) {
+      request_arrive(&conns[rnd_below((int64_t)n)], next_arrival);
+      next_arrival += rnd_exp(mean_interval);
+    }
+    // expired timers
+    while (timer_count > 0 && timers[0].due <= now) {
+      mp_resume(timer_pop(), NULL);
+    }
+    if (now >= next_report) {
+      const size_t rss = mpb_rss_current();
+      if (rss > peak_rss) peak_rss = rss;
+      mpb_printf("  %5.1fs: rss %7.1f MiB, completed %9lld, waiting %6zu\n",
+                 (double)(now - start) / 1e9, (double)rss / (1024.0*1024.0), (long long)completed, timer_count);
+      next_report += RSS_INTERVAL;
+    }
+    mpb_nsecs_t next = (timer_count > 0 ? timers[0].due : end);
+    if (!stopping && next_arrival < next) next = next_arrival;
+    sleep_until(next);
+  }
+  const mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+
+  // shut down the idle connections (all are idle now)
+  for (size_t i = 0; i < n; i++) {
+    if (conns[i].idle != NULL) { mp_resume(conns[i].idle, NULL); }
+  }
+  free(conns);
+  free(timers);
+
+  mpb_printf("throughput: %.0f requests/s (%lld completed, %lld dropped)\n",
+             (double)completed * 1e9 / (double)elapsed, (long long)completed, (long long)dropped);
+  mpb_printf("latency (us): mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+             (latencies.count == 0 ? 0.0 : latencies.total / (double)latencies.count / 1000.0),
+             (double)mpb_histogram_percentile(&latencies, 50.0) / 1000.0,
+             (double)mpb_histogram_percentile(&latencies, 90.0) / 1000.0,
+             (double)mpb_histogram_percentile(&latencies, 99.0) / 1000.0,
+             (double)mpb_histogram_percentile(&latencies, 99.9) / 1000.0,
+             (double)latencies.max / 1000.0);
+  mpb_printf("peak rss: %.1f MiB\n", (double)peak_rss / (1024.0*1024.0));
+  return 0;
+}
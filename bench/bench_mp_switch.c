@@ -0,0 +1,85 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Benchmark the cost of a context switch (a yield or a resume): time and
+  cache misses per switch. With a single prompt all switch metadata stays
+  in the L1 cache; with many prompts that are resumed round-robin each
+  switch has to bring the prompt, return point and resume point back
+  in and the miss count shows how many cache lines a switch touches.
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <mprompt.h>
+#include "bench.h"
+
+// Each yield returns the resumption to the resumer
+static void* switch_yield(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;
+}
+
+static void* switch_body(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  while (mp_yield(p, &switch_yield, NULL) != NULL) { }
+  return NULL;
+}
+
+// Resume `n` suspended prompts round-robin for `rounds`; returns the number of switches.
+static int64_t switch_run(mp_resume_t** rs, size_t n, int64_t rounds) {
+  for (int64_t i = 0; i < rounds; i++) {
+    for (size_t j = 0; j < n; j++) {
+      rs[j] = (mp_resume_t*)mp_resume(rs[j], rs);   // resume and yield again
+    }
+  }
+  return (2 * rounds * (int64_t)n);
+}
+
+static void bench_switch(size_t n, int64_t switches) {
+  mp_resume_t** rs = (mp_resume_t**)calloc(n, sizeof(mp_resume_t*));
+  if (rs == NULL) return;
+  for (size_t j = 0; j < n; j++) {
+    rs[j] = (mp_resume_t*)mp_prompt(&switch_body, NULL);  // suspended at its first yield
+  }
+  int64_t rounds = switches / (2 * (int64_t)n);
+  if (rounds <= 0) rounds = 1;
+  switch_run(rs, n, (rounds / 10) + 1);   // warm up
+
+  bool has_counters = mpb_counters_start();
+  mpb_nsecs_t start = mpb_nsecs_now();
+  int64_t count = switch_run(rs, n, rounds);
+  mpb_nsecs_t elapsed = mpb_nsecs_now() - start;
+  mpb_counters_t counters;
+  has_counters = has_counters && mpb_counters_read(&counters);
+
+  char l1d[32];
+  char llc[32];
+  mpb_printf("prompts: %6zu, switches: %9lld, ns/switch: %7.2f, L1d misses/switch: %8s, cache misses/switch: %8s\n",
+              n, (long long)count, (double)elapsed / (double)count,
+              mpb_per_op(l1d, sizeof(l1d), has_counters, counters.l1d_misses, count),
+              mpb_per_op(llc, sizeof(llc), has_counters, counters.cache_misses, count));
+
+  for (size_t j = 0; j < n; j++) {
+    mp_resume(rs[j], NULL);   // let the prompt return
+  }
+  free(rs);
+}
+
+int main(int argc, char** argv) {
+  int64_t switches = 10000000;
+  if (argc > 1) { switches = atoll(argv[1]); }
+  mp_config_t config = mp_config_default();
+  config.stack_cache_count = 0;   // measure distinct prompts
+  mp_init(&config);
+  mpb_printf("context switch benchmark (%lld switches per run)\n", (long long)switches);
+  const size_t ns[] = { 1, 16, 256, 4096 };
+  for (size_t i = 0; i < sizeof(ns)/sizeof(ns[0]); i++) {
+    bench_switch(ns[i], switches);
+  }
+  mpb_counters_done();
+  return 0;
+}
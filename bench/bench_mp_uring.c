@@ -0,0 +1,142 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Compare the io_uring completion backend with the readiness (epoll) fallback
+  for `mp_io_pread`/`mp_io_pwrite` without using the network:
+  - file: tasks read random 4KiB blocks of a (cached) temporary file.
+  - pipe: pairs of tasks send small messages over a pipe.
+
+  usage: bench_mp_uring [workers]
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mpsched.h>
+#include "bench.h"
+
+#define FILE_TASKS    (64)
+#define FILE_READS    (2000)     // per task
+#define FILE_SIZE     (16*1024*1024)
+#define BLOCK_SIZE    (4096)
+#define PIPE_PAIRS    (64)
+#define PIPE_MSGS     (2000)     // per pair
+
+static int  file_fd;
+static bool pipe_nonblock;
+
+static void file_task(void* arg) {
+  uint64_t rnd = 0x9E3779B97F4A7C15ULL * ((uintptr_t)arg + 1);
+  char buf[BLOCK_SIZE];
+  for (int i = 0; i < FILE_READS; i++) {
+    rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17;
+    off_t offset = (off_t)(rnd % (FILE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+    if (mp_io_pread(file_fd, buf, sizeof(buf), offset) != BLOCK_SIZE) {
+      mpb_printf("file read failed\n");
+      exit(1);
+    }
+  }
+}
+
+static void pipe_reader(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  int64_t msg;
+  while (mp_io_pread(fd, &msg, sizeof(msg), -1) == sizeof(msg)) { }
+  mp_io_close(fd);
+}
+
+static void pipe_writer(void* arg) {
+  UNUSED(arg);
+  int fds[2];
+  if (pipe(fds) != 0) {
+    mpb_printf("unable to create a pipe\n");
+    exit(1);
+  }
+  if (pipe_nonblock) {
+    mp_io_nonblock(fds[0]);
+    mp_io_nonblock(fds[1]);
+  }
+  mp_task_spawn(&pipe_reader, (void*)(intptr_t)fds[0]);
+  for (int64_t i = 0; i < PIPE_MSGS; i++) {
+    if (mp_io_pwrite(fds[1], &i, sizeof(i), -1) != sizeof(i)) {
+      mpb_printf("pipe write failed\n");
+      exit(1);
+    }
+    if (i % 16 == 0) mp_task_yield();  // let the reader run
+  }
+  mp_io_close(fds[1]);
+}
+
+static void bench_report(const char* name, const char* backend, size_t ops, mpb_nsecs_t elapsed) {
+  mpb_printf("%-5s (%-8s): %9.0f ops/s, %7.1f ns/op\n", name, backend,
+             (double)ops / ((double)elapsed / 1e9), (double)elapsed / (double)ops);
+}
+
+static void bench_run(size_t workers, bool use_uring) {
+  // file
+  mp_sched_t* s = mp_sched_create(workers);
+  bool uring = mp_io_uring_enable(s, use_uring);
+  const char* backend = (uring ? "io_uring" : "epoll");
+  if (use_uring && !uring) {
+    mpb_printf("io_uring is not available\n");
+    mp_sched_free(s);
+    return;
+  }
+  for (size_t i = 0; i < FILE_TASKS; i++) {
+    mp_sched_spawn(s, &file_task, (void*)i);
+  }
+  mpb_nsecs_t start = mpb_nsecs_now();
+  mp_sched_run(s);
+  bench_report("file", backend, (size_t)FILE_TASKS * FILE_READS, mpb_nsecs_now() - start);
+  mp_sched_free(s);
+
+  // pipe: with io_uring we can use blocking pipes (the kernel waits for readiness)
+  s = mp_sched_create(workers);
+  mp_io_uring_enable(s, uring);
+  pipe_nonblock = !uring;
+  for (size_t i = 0; i < PIPE_PAIRS; i++) {
+    mp_sched_spawn(s, &pipe_writer, NULL);
+  }
+  start = mpb_nsecs_now();
+  mp_sched_run(s);
+  bench_report("pipe", backend, (size_t)PIPE_PAIRS * PIPE_MSGS * 2, mpb_nsecs_now() - start);
+  mp_sched_free(s);
+}
+
+int main(int argc, char** argv) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = (ncpu <= 0 ? 1 : (size_t)ncpu);
+  if (argc > 1) { workers = (size_t)atol(argv[1]); }
+  if (workers == 0) workers = 1;
+  mp_init(NULL);
+
+  // create a temporary file that is in the page cache
+  char path[] = "/tmp/bench-mp-uring-XXXXXX";
+  file_fd = mkstemp(path);
+  if (file_fd < 0) {
+    mpb_printf("unable to create a temporary file\n");
+    return 1;
+  }
+  unlink(path);
+  char* block = (char*)malloc(BLOCK_SIZE);
+  memset(block, 'x', BLOCK_SIZE);
+  for (off_t ofs = 0; ofs < FILE_SIZE; ofs += BLOCK_SIZE) {
+    if (pwrite(file_fd, block, BLOCK_SIZE, ofs) != BLOCK_SIZE) {
+      mpb_printf("unable to write the temporary file\n");
+      return 1;
+    }
+  }
+  free(block);
+
+  mpb_printf("io backends: %zu workers, file: %d tasks x %d reads of %d bytes, pipe: %d pairs x %d messages\n",
+             workers, FILE_TASKS, FILE_READS, BLOCK_SIZE, PIPE_PAIRS, PIPE_MSGS);
+  bench_run(workers, true);
+  bench_run(workers, false);
+  close(file_fd);
+  return 0;
+}
@@ -0,0 +1,252 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it 
+  under the terms of the MIT License. A copy of the License can be 
+  found in the file "license.txt" at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#include "bench.h"
+#include <string.h>
+
+// ----------------------------------------------------------------
+// Timer
+// ----------------------------------------------------------------
+#ifdef _WIN32
+#include <windows.h>
+mpb_nsecs_t mpb_nsecs_now(void) {
+  static LARGE_INTEGER mfreq; // = 0
+  if (mfreq.QuadPart == 0) {
+    QueryPerformanceFrequency(&mfreq);
+    if (mfreq.QuadPart == 0) mfreq.QuadPart = 1000;
+  }
+  LARGE_INTEGER t;
+  QueryPerformanceCounter(&t);
+  // calculate in parts to avoid overflow
+  int64_t secs = t.QuadPart / mfreq.QuadPart;
+  int64_t frac = t.QuadPart % mfreq.QuadPart;
+  return (secs*1000000000LL + ((frac*1000000000LL)/mfreq.QuadPart));
+}
+#else
+#include <time.h>
+mpb_nsecs_t mpb_nsecs_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((mpb_nsecs_t)t.tv_sec * 1000000000LL) + (mpb_nsecs_t)t.tv_nsec;
+}
+#endif
+
+static int mpb_nsecs_compare(const void* p, const void* q) {
+  mpb_nsecs_t x = *((const mpb_nsecs_t*)p);
+  mpb_nsecs_t y = *((const mpb_nsecs_t*)q);
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+mpb_nsecs_t mpb_percentile(mpb_nsecs_t* samples, size_t count, double p) {
+  if (count == 0) return 0;
+  qsort(samples, count, sizeof(mpb_nsecs_t), &mpb_nsecs_compare);
+  size_t i = (size_t)((p / 100.0) * (double)(count - 1) + 0.5);
+  return samples[i < count ? i : count - 1];
+}
+
+
+// ----------------------------------------------------------------
+// Hardware counters
+// ----------------------------------------------------------------
+#if defined(__linux__)
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int mpb_fd_l1d = -1;
+static int mpb_fd_llc = -1;
+
+static int mpb_perf_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0 /* this thread */, -1 /* any cpu */, -1 /* no group */, 0);
+}
+
+static void mpb_perf_restart(int fd) {
+  if (fd < 0) return;
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static int64_t mpb_perf_read(int fd) {
+  uint64_t count = 0;
+  if (fd < 0 || read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) return -1;
+  return (int64_t)count;
+}
+
+bool mpb_counters_start(void) {
+  if (mpb_fd_l1d < 0) {
+    mpb_fd_l1d = mpb_perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  }
+  if (mpb_fd_llc < 0) {
+    mpb_fd_llc = mpb_perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  }
+  mpb_perf_restart(mpb_fd_l1d);
+  mpb_perf_restart(mpb_fd_llc);
+  return (mpb_fd_l1d >= 0 || mpb_fd_llc >= 0);
+}
+
+bool mpb_counters_read(mpb_counters_t* counters) {
+  counters->l1d_misses = mpb_perf_read(mpb_fd_l1d);
+  counters->cache_misses = mpb_perf_read(mpb_fd_llc);
+  return (counters->l1d_misses >= 0 || counters->cache_misses >= 0);
+}
+
+void mpb_counters_done(void) {
+  if (mpb_fd_l1d >= 0) { close(mpb_fd_l1d); mpb_fd_l1d = -1; }
+  if (mpb_fd_llc >= 0) { close(mpb_fd_llc); mpb_fd_llc = -1; }
+}
+
+#else
+bool mpb_counters_start(void) {
+  return false;
+}
+
+bool mpb_counters_read(mpb_counters_t* counters) {
+  counters->l1d_misses = -1;
+  counters->cache_misses = -1;
+  return false;
+}
+
+void mpb_counters_done(void) { 
+}
+#endif
+
+const char* mpb_per_op(char* buf, size_t bufsize, bool available, int64_t count, int64_t ops) {
+  if (!available || count < 0 || ops <= 0) {
+    snprintf(buf, bufsize, "n/a");
+  }
+  else {
+    snprintf(buf, bufsize, "%.3f", (double)count / (double)ops);
+  }
+  return buf;
+}
+
+
+// ----------------------------------------------------------------
+// Histogram
+// ----------------------------------------------------------------
+
+static size_t mpb_histogram_index(mpb_nsecs_t value) {
+  if (value < MPB_HIST_SUB) return (value < 0 ? 0 : (size_t)value);
+  int e = 63;
+  while ((value >> e) == 0) { e--; }   // e >= 5
+  const size_t sub = (size_t)(value >> (e - 5)) - MPB_HIST_SUB;
+  return ((size_t)(e - 4) * MPB_HIST_SUB) + sub;
+}
+
+static mpb_nsecs_t mpb_histogram_upper(size_t index) {
+  if (index < MPB_HIST_SUB) return (mpb_nsecs_t)index;
+  const int e = (int)(index / MPB_HIST_SUB) + 4;
+  const mpb_nsecs_t sub = (mpb_nsecs_t)(index % MPB_HIST_SUB);
+  return ((MPB_HIST_SUB + sub + 1) << (e - 5)) - 1;
+}
+
+void mpb_histogram_clear(mpb_histogram_t* h) {
+  memset(h, 0, sizeof(*h));
+}
+
+void mpb_histogram_add(mpb_histogram_t* h, mpb_nsecs_t value) {
+  h->counts[mpb_histogram_index(value)]++;
+  h->count++;
+  h->total += (double)value;
+  if (value > h->max) { h->max = value; }
+}
+
+mpb_nsecs_t mpb_histogram_percentile(const mpb_histogram_t* h, double p) {
+  if (h->count == 0) return 0;
+  int64_t rank = (int64_t)((p / 100.0) * (double)h->count + 0.5);
+  if (rank < 1) rank = 1;
+  int64_t seen = 0;
+  for (size_t i = 0; i < MPB_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      const mpb_nsecs_t upper = mpb_histogram_upper(i);
+      return (upper < h->max ? upper : h->max);
+    }
+  }
+  return h->max;
+}
+
+
+// ----------------------------------------------------------------
+// Memory
+// ----------------------------------------------------------------
+#if defined(__linux__)
+size_t mpb_rss_current(void) {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return 0;
+  long pages_total = 0;
+  long pages_resident = 0;
+  const int n = fscanf(f, "%ld %ld", &pages_total, &pages_resident);
+  fclose(f);
+  return (n == 2 ? (size_t)pages_resident * (size_t)sysconf(_SC_PAGESIZE) : 0);
+}
+
+size_t mpb_proc_status(const char* field) {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f == NULL) return 0;
+  const size_t len = strlen(field);
+  size_t kib = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, field, len) == 0 && line[len] == ':') {
+      kib = (size_t)strtoull(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return kib * 1024;
+}
+
+size_t mpb_vma_count(void) {
+  FILE* f = fopen("/proc/self/maps", "r");
+  if (f == NULL) return 0;
+  size_t count = 0;
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    if (c == '\n') count++;
+  }
+  fclose(f);
+  return count;
+}
+#else
+size_t mpb_rss_current(void) {
+  return 0;
+}
+
+size_t mpb_proc_status(const char* field) {
+  (void)field;
+  return 0;
+}
+
+size_t mpb_vma_count(void) {
+  return 0;
+}
+#endif
+
+
+// ----------------------------------------------------------------
+// Stack use
+// ----------------------------------------------------------------
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* mpb_stack_at_depth(size_t kib, void* (*fun)(void*), void* arg) {
+  volatile uint8_t frame[1024];
+  frame[0] = 1;
+  void* res = (kib > 1 ? mpb_stack_at_depth(kib - 1, fun, arg) : (fun != NULL ? fun(arg) : NULL));
+  frame[sizeof(frame)-1] = frame[0];   // read back so the frame stays live across the call
+  return res;
+}
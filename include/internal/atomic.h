@@ -192,6 +192,11 @@ static inline void mp_spin_lock_acquire(mp_spin_lock_t* l) {
   }
 }
 
+static inline bool mp_spin_lock_try_acquire(mp_spin_lock_t* l) {
+  intptr_t expected = 0;
+  return (mp_atomic_load(l) == 0 && mp_atomic_cas(l, &expected, (intptr_t)1));
+}
+
 static inline void mp_spin_lock_release(mp_spin_lock_t* l) {
   mp_atomic_store(l, (intptr_t)0);
 }
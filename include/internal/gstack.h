@@ -21,11 +21,17 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra);
 void         mp_gstack_free(mp_gstack_t* gstack, bool delay);
 void         mp_gstack_enter(mp_gstack_t* g, mp_jmpbuf_t** return_jmp, mp_stack_start_fun_t* fun, void* arg);
 
+ssize_t      mp_gstack_precommit(mp_gstack_t* g, void* key);   // commit the profiled size for `key`; returns the committed size
+void         mp_gstack_profile(mp_gstack_t* g, void* key, ssize_t entry_committed);  // record growth since entry for `key`
+ssize_t      mp_gstack_committed(const mp_gstack_t* g);
+bool         mp_gstack_is_used(const mp_gstack_t* g, const void* sp, const void* p);  // is `p` between `sp` and the base of the stack?
+
 mp_gsave_t*  mp_gstack_save(mp_gstack_t* gstack, uint8_t* sp);    // save up to the given stack pointer (that should be in `gstack`)
 void         mp_gsave_restore(mp_gsave_t* gsave);
 void         mp_gsave_free(mp_gsave_t* gsave);
 
 mp_gstack_t* mp_gstack_current(void);             // implemented in <mprompt.c>
+mp_gstack_t* mp_gstack_left(void);                // implemented in <mprompt.c>
 
 
 
@@ -0,0 +1,271 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MP_SCHED_H
+#define MP_SCHED_H
+
+/*------------------------------------------------------------------------------
+   Internal definitions of the task scheduler (shared by the `src/mpsched` sources)
+------------------------------------------------------------------------------*/
+#include <pthread.h>
+#include <time.h>
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+
+
+// Timers (see `timer.c`)
+typedef struct mp_timer_s mp_timer_t;
+typedef void (mp_timer_fun_t)(mp_timer_t* timer, void* arg);
+
+struct mp_timer_s {
+  mp_timer_t*       next;         // intrusive list of the slot (or the expired list)
+  mp_timer_t**      pprev;
+  uint64_t          expires;      // tick
+  mp_timer_fun_t*   fun;
+  void*             arg;
+  _Atomic(intptr_t) state;
+};
+
+#define MP_TIMER_TICK_NSECS   (1000000)    // 1ms
+#define MP_TIMER_SLOT_BITS    (6)
+#define MP_TIMER_SLOTS        (1 << MP_TIMER_SLOT_BITS)
+#define MP_TIMER_LEVELS       (6)          // covers 2^36 ticks (about 2 years)
+
+typedef struct mp_timers_s {
+  mp_spin_lock_t    lock;
+  int64_t           start;        // clock at tick 0
+  uint64_t          next;         // next tick to expire
+  _Atomic(intptr_t) count;        // pending timers
+  mp_timer_t*       wheel[MP_TIMER_LEVELS][MP_TIMER_SLOTS];
+} mp_timers_t;
+
+
+// A task is allocated in the user data of its prompt (so it needs no separate allocation)
+// and is freed together with the prompt when the task function returns.
+struct mp_task_s {
+  mp_task_t*        next;         // intrusive link in task queues (a task is in at most one queue)
+  mp_sched_t*       sched;
+  mp_prompt_t*      prompt;       // the prompt the task runs under
+  mp_resume_t*      resume;       // the resumption when suspended (NULL if not yet started)
+  void*             resume_arg;   // the result passed to the suspension point
+  mp_task_fun_t*    fun;
+  void*             arg;
+  // parking with a timeout (see `timer.c`)
+  mp_timer_t*       timer;        // the timer if parked with a timeout (and not yet woken)
+  mp_spin_lock_t    timer_lock;
+  _Atomic(intptr_t) timer_gate;
+  // priority class (see `prio.c`)
+  int               priority;     // higher runs first (0 by default)
+  int64_t           deadline;     // absolute monotonic clock in nano-seconds (or 0 for none)
+};
+
+static inline bool mp_task_has_class(const mp_task_t* t) {
+  return (t->priority != 0 || t->deadline != 0);
+}
+
+
+// Intrusive FIFO task queue (not thread-safe)
+typedef struct mp_taskq_s {
+  mp_task_t*  first;
+  mp_task_t*  last;
+} mp_taskq_t;
+
+static inline bool mp_taskq_is_empty(const mp_taskq_t* q) {
+  return (q->first == NULL);
+}
+
+static inline void mp_taskq_push(mp_taskq_t* q, mp_task_t* t) {
+  t->next = NULL;
+  if (q->last == NULL) { q->first = t; }
+                  else { q->last->next = t; }
+  q->last = t;
+}
+
+static inline mp_task_t* mp_taskq_pop(mp_taskq_t* q) {
+  mp_task_t* t = q->first;
+  if (t != NULL) {
+    q->first = t->next;
+    if (q->first == NULL) { q->last = NULL; }
+    t->next = NULL;
+  }
+  return t;
+}
+
+
+// Chase-Lev work-stealing deque: the owning worker pushes and takes at the bottom,
+// while other workers steal from the top. We use sequentially consistent atomics throughout.
+typedef struct mp_deque_array_s {
+  ssize_t                   capacity;   // power of 2
+  struct mp_deque_array_s*  retired;    // previous (smaller) arrays that may still be read by thieves
+  _Atomic(mp_task_t*)       items[1];
+} mp_deque_array_t;
+
+typedef struct mp_deque_s {
+  mp_decl_cache_align _Atomic(ssize_t) top;      // written by thieves
+  mp_decl_cache_align _Atomic(ssize_t) bottom;   // written by the owner
+  _Atomic(mp_deque_array_t*)           array;
+} mp_deque_t;
+
+
+// A worker thread
+typedef struct mp_decl_cache_align mp_worker_s {
+  mp_deque_t        deque;      // ready tasks
+  mp_sched_t*       sched;
+  size_t            index;
+  mp_task_t*        current;    // currently running task
+  mp_taskq_t        yielded;    // tasks that yielded (FIFO so they run after the other ready tasks)
+  uint64_t          rnd;        // random state to pick a victim to steal from
+  size_t            tick;       // scheduling decisions (for fairness)
+  pthread_t         thread;
+  size_t            runs;         // count of task runs (to detect a task that runs for a full time slice)
+  size_t            preempt_runs; // `runs` at the previous time slice tick
+  bool              preempt_active;
+  timer_t           preempt_timer;
+} mp_worker_t;
+
+
+// I/O readiness (see `io.c`): file descriptors are tracked in lazily allocated chunks.
+#define MP_IO_FD_CHUNK_SIZE   (1024)
+#define MP_IO_FD_CHUNKS       (256)
+
+typedef struct mp_io_fd_s mp_io_fd_t;
+typedef struct mp_uring_s mp_uring_t;
+
+typedef struct mp_io_s {
+  int                   epfd;       // shared epoll instance
+  int                   evfd;       // eventfd to wake up a poller blocked in `epoll_wait`
+  _Atomic(intptr_t)     poller;     // set if some worker has the poller role
+  _Atomic(intptr_t)     blocked;    // set while the poller is blocked in `epoll_wait`
+  _Atomic(intptr_t)     notified;   // set if `evfd` was written but not yet read
+  _Atomic(intptr_t)     waiting;    // tasks waiting for I/O (readiness or completion)
+  mp_uring_t*           uring;      // io_uring completions (or NULL if not available)
+  _Atomic(intptr_t)     uring_pending;  // io_uring entries that are not yet submitted
+  _Atomic(mp_io_fd_t*)  fds[MP_IO_FD_CHUNKS];
+  struct mp_io_s*       next;       // in the list of all pollers (see `mp_io_close`)
+} mp_io_t;
+
+
+// Binary heap of ready entries ordered by priority and deadline (see `prio.c`)
+typedef struct mp_pheap_entry_s {
+  void*       item;
+  void*       arg;
+  int         priority;
+  int64_t     deadline;
+  uint64_t    seq;      // insertion order for FIFO between equal classes
+} mp_pheap_entry_t;
+
+typedef struct mp_pheap_s {
+  mp_pheap_entry_t* entries;
+  size_t            count;
+  size_t            capacity;
+  uint64_t          seq;
+} mp_pheap_t;
+
+
+// Pool of threads for blocking calls (see `offload.c`)
+typedef struct mp_offload_job_s mp_offload_job_t;
+
+typedef struct mp_offload_s {
+  pthread_mutex_t       lock;       // protects the job queue and the threads
+  pthread_cond_t        cond;
+  mp_offload_job_t*     first;      // job queue
+  mp_offload_job_t*     last;
+  bool                  stop;
+  size_t                thread_max;
+  size_t                thread_count;
+  pthread_t*            threads;
+  _Atomic(mp_task_t*)   completed;  // lock-free stack of completed tasks (linked through `next`)
+  _Atomic(intptr_t)     pending;    // offloaded tasks that are not yet reaped
+} mp_offload_t;
+
+
+struct mp_sched_s {
+  size_t            worker_count;
+  mp_worker_t*      workers;
+  _Atomic(intptr_t) task_count;   // live tasks; `mp_sched_run` returns when it drops to zero
+  _Atomic(intptr_t) done;
+  // injection queue for tasks that become ready outside a worker thread
+  pthread_mutex_t   inject_lock;
+  mp_taskq_t        inject;
+  _Atomic(intptr_t) inject_count;
+  // idle workers sleep on the condition
+  pthread_mutex_t   idle_lock;
+  pthread_cond_t    idle_cond;
+  _Atomic(intptr_t) sleepers;     // workers waiting on `idle_cond`
+  _Atomic(intptr_t) idle;         // workers looking for work (including the sleepers)
+  mp_io_t           io;
+  mp_timers_t       timers;
+  mp_offload_t      offload;
+  int64_t           timeslice;    // preemption time slice in nano-seconds (or 0)
+  // ready tasks with a priority class
+  mp_spin_lock_t    prio_lock;
+  mp_pheap_t        prio;
+  _Atomic(intptr_t) prio_count;
+};
+
+
+// The worker of the current thread (or NULL).
+// note: never inlined as a task may migrate between threads and we should not cache the thread-local address.
+mp_worker_t* mp_worker_current(void);
+
+// Create a task (that is not yet ready)
+mp_task_t* mp_task_create(mp_sched_t* s, mp_task_fun_t* fun, void* arg);
+
+// Make a suspended task ready to run
+void mp_sched_ready(mp_task_t* t);
+
+// Wake up a sleeping worker (or the blocked poller)
+void mp_sched_notify(mp_sched_t* s);
+
+// I/O polling
+bool   mp_io_init(mp_io_t* io);
+void   mp_io_done(mp_io_t* io);
+bool   mp_io_poller_acquire(mp_io_t* io);
+void   mp_io_poller_release(mp_io_t* io);
+void   mp_io_notify(mp_io_t* io);
+size_t mp_io_poll(mp_sched_t* s, int timeout_ms);
+ssize_t mp_io_pread_fallback(int fd, void* buf, size_t len, off_t offset);
+ssize_t mp_io_pwrite_fallback(int fd, const void* buf, size_t len, off_t offset);
+
+// Timers
+int64_t mp_timers_clock(void);   // monotonic clock in nano-seconds
+void   mp_timers_init(mp_timers_t* timers);
+size_t mp_timers_advance(mp_timers_t* timers);
+int    mp_timers_wait_ms(mp_timers_t* timers, int max_ms);
+void   mp_timer_start(mp_timers_t* timers, mp_timer_t* timer, int64_t clock, mp_timer_fun_t* fun, void* arg);
+bool   mp_timer_cancel(mp_timers_t* timers, mp_timer_t* timer);
+void   mp_timer_fired(mp_timer_t* timer);
+bool   mp_timeout_wake(mp_task_t* t, void* result);
+
+// Priority classes
+void   mp_pheap_push(mp_pheap_t* h, void* item, void* arg, int priority, int64_t deadline);
+bool   mp_pheap_pop(mp_pheap_t* h, void** item, void** arg);
+void   mp_pheap_done(mp_pheap_t* h);
+void   mp_sched_prio_push(mp_sched_t* s, mp_task_t* t);
+mp_task_t* mp_sched_prio_pop(mp_sched_t* s);
+
+// Offload pool
+void   mp_offload_init(mp_offload_t* pool);
+void   mp_offload_done(mp_offload_t* pool);
+bool   mp_offload_has_completed(mp_sched_t* s);
+size_t mp_offload_reap(mp_sched_t* s);
+
+// Preemption (see `preempt.c`)
+void   mp_preempt_start(mp_worker_t* w);
+void   mp_preempt_stop(mp_worker_t* w);
+void   mp_preempt_clear(void);
+
+// io_uring (see `uring.c`)
+void   mp_uring_init(mp_io_t* io);
+void   mp_uring_done(mp_io_t* io);
+bool   mp_uring_is_fd(mp_io_t* io, int fd);
+size_t mp_uring_reap(mp_io_t* io);
+size_t mp_uring_flush(mp_io_t* io, intptr_t min_pending);
+
+
+#endif
@@ -0,0 +1,37 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MP_TRACE_H
+#define MP_TRACE_H
+
+/*------------------------------------------------------------------------------
+  Event trace (compiled in with `MP_EVENT_TRACE=1`)
+------------------------------------------------------------------------------*/
+
+#ifndef MP_EVENT_TRACE
+#define MP_EVENT_TRACE  0
+#endif
+
+typedef enum mp_event_kind_e {
+  MP_EVENT_CREATE,    // prompt created (with a fresh or cached gstack)
+  MP_EVENT_ENTER,     // initial entry
+  MP_EVENT_RESUME,
+  MP_EVENT_YIELD,
+  MP_EVENT_RETURN,
+  MP_EVENT_DROP,      // prompt freed
+  MP_EVENT_COMMIT,    // commit-on-demand in the fault handler (the argument is the committed KiB)
+  MP_EVENT_KIND_COUNT
+} mp_event_kind_t;
+
+#if MP_EVENT_TRACE
+uint32_t  mp_event_prompt_id(void);   // a fresh id for a prompt
+void      mp_event_record(mp_event_kind_t kind, uint32_t id, uint32_t arg);
+#else
+#define mp_event_record(kind,id,arg)  ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MP_USDT_H
+#define MP_USDT_H
+
+/*------------------------------------------------------------------------------
+  USDT static tracepoints (compiled in with `MP_USDT=1`)
+  Each probe is a `nop` with an ELF note in `.note.stapsdt` in the format of
+  `<sys/sdt.h>` (provider `mprompt`), so `bpftrace`, `perf probe` and
+  SystemTap can attach to it in a running process. When nothing is attached
+  the cost is the `nop` (and keeping the arguments in a register or stack slot).
+  Arguments are passed as 8 byte values. We emit the notes ourselves as
+  `<sys/sdt.h>` is often not installed; only on 64-bit ELF platforms.
+------------------------------------------------------------------------------*/
+
+#ifndef MP_USDT
+#define MP_USDT  0
+#endif
+
+#if MP_USDT && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && (defined(__GNUC__) || defined(__clang__))
+
+#define MP_USDT_ENABLED  1
+
+#define mp_usdt_note_(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"mprompt\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define mp_usdt_arg_(x)  "nor"((uint64_t)(uintptr_t)(x))
+
+#define mp_usdt0(name)        __asm__ __volatile__(mp_usdt_note_(name, "") :: )
+#define mp_usdt1(name,a)      __asm__ __volatile__(mp_usdt_note_(name, "8@%0") :: mp_usdt_arg_(a))
+#define mp_usdt2(name,a,b)    __asm__ __volatile__(mp_usdt_note_(name, "8@%0 8@%1") :: mp_usdt_arg_(a), mp_usdt_arg_(b))
+
+#else
+
+#define MP_USDT_ENABLED  0
+#define mp_usdt0(name)        ((void)0)
+#define mp_usdt1(name,a)      ((void)0)
+#define mp_usdt2(name,a,b)    ((void)0)
+
+#endif
+
+#endif
@@ -17,6 +17,12 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdlib.h>     // malloc
+#if defined(_WIN32)
+#include <malloc.h>     // _aligned_malloc
+#endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>     // __rdtsc
+#endif
 #include <sys/types.h>  // ssize_t  
 
 #if (defined(_MSC_VER) || defined(__MINGW32__)) && !defined(__ssize_t_defined)
@@ -43,6 +49,14 @@ typedef ptrdiff_t  ssize_t;
 #endif
 
 
+// Functions that contain a checked `mp_setjmp` label must exist exactly once (see `mp_checked_longjmp`)
+// so we prevent both inlining and the cloning of specialized copies during (link time) optimization.
+#if defined(__GNUC__) && !defined(__clang__)
+#define mp_decl_noclone         __attribute__((noinline,noclone))
+#else
+#define mp_decl_noclone         mp_decl_noinline
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 #define mp_unlikely(x)          __builtin_expect((x),0)
 #define mp_likely(x)            __builtin_expect((x),1)
@@ -57,6 +71,29 @@ typedef ptrdiff_t  ssize_t;
 #define mp_decl_externc 
 #endif
 
+// Cache line alignment of (switch critical) data
+#if defined(__APPLE__) && (defined(__aarch64__) || defined(__arm64__))
+#define MP_CACHE_LINE           (128)   // Apple silicon
+#else
+#define MP_CACHE_LINE           (64)
+#endif
+#if defined(_MSC_VER)
+#define mp_decl_cache_align     __declspec(align(64))   // needs a literal (and all msvc targets have 64 byte lines)
+#elif defined(__GNUC__)
+#define mp_decl_cache_align     __attribute__((aligned(MP_CACHE_LINE)))
+#else
+#define mp_decl_cache_align
+#endif
+
+// Compile time assertions
+#if defined(__cplusplus)
+#define mp_static_assert(x,msg) static_assert(x,msg)
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define mp_static_assert(x,msg) _Static_assert(x,msg)
+#else
+#define mp_static_assert(x,msg)
+#endif
+
 
 /*------------------------------------------------------------------------------
   Defines
@@ -75,9 +112,6 @@ typedef ptrdiff_t  ssize_t;
   Util
 ------------------------------------------------------------------------------*/
 
-typedef void (mp_output_fun)(const char* msg, void* arg);
-typedef void (mp_error_fun)(int err, void* arg);
-
 void mp_trace_message(const char* fmt, ...);
 void mp_system_error_message(int err, const char* fmt, ...);  // if err == EFAULT, abort
 void mp_error_message(int err, const char* fmt, ...);         // if err == EFAULT, abort
@@ -111,16 +145,50 @@ static inline ssize_t mp_min(ssize_t x, ssize_t y) {
 
 
 /*------------------------------------------------------------------------------
-  Guard cookie; used to encode ip and sp in a longjmp
+  Clocks
+  `mp_cycles` is a cheap cycle counter (rdtsc or cntvct_el0) for timing
+  switches; convert with `mp_cycles_per_nsec` (calibrated once against
+  `mp_nsecs`). Platforms without a counter fall back to `mp_nsecs`.
+------------------------------------------------------------------------------*/
+
+uint64_t mp_nsecs(void);                // monotonic clock in nano-seconds
+double   mp_cycles_per_nsec(void);
+
+static inline uint64_t mp_cycles(void) {
+  #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  return __rdtsc();
+  #elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_ia32_rdtsc();
+  #elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+  uint64_t t;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+  #else
+  #define MP_CYCLES_ARE_NSECS  1
+  return mp_nsecs();
+  #endif
+}
+
+
+/*------------------------------------------------------------------------------
+  Guard cookie; used to encode ip and sp in a longjmp.
+  The cookie is read on every switch together with the checked longjmp 
+  labels (see `mprompt.c`) so these share a single cache line.
 ------------------------------------------------------------------------------*/
-extern uintptr_t mp_guard_cookie;
+typedef struct mp_decl_cache_align mp_guard_s {
+  uintptr_t cookie;
+  void*     return_label;   // (guarded) code address right after the `mp_setjmp` in `mp_prompt_resume`
+  void*     resume_label;   // (guarded) code address right after the `mp_setjmp` in `mp_yield`
+} mp_guard_t;
+
+extern mp_guard_t mp_guard_data;
 
 static inline void* mp_guard(void* p) {
-  return (void*)((uintptr_t)p ^ mp_guard_cookie);
+  return (void*)((uintptr_t)p ^ mp_guard_data.cookie);
 }
 
 static inline void* mp_unguard(void* p) {
-  return (void*)((uintptr_t)p ^ mp_guard_cookie);
+  return (void*)((uintptr_t)p ^ mp_guard_data.cookie);
 }
 
 void mp_guard_init(void);
@@ -148,6 +216,24 @@ static inline void mp_free(void* p) {
   free(p);
 }
 
+// aligned allocation must be freed with `mp_free_aligned`
+static inline void* mp_malloc_aligned(size_t size, size_t alignment) {
+  #if defined(_WIN32)
+  return _aligned_malloc(size, alignment);
+  #else
+  void* p = NULL;
+  return (posix_memalign(&p, alignment, size) == 0 ? p : NULL);
+  #endif
+}
+
+static inline void mp_free_aligned(void* p) {
+  #if defined(_WIN32)
+  _aligned_free(p);
+  #else
+  free(p);
+  #endif
+}
+
 static inline void* mp_malloc_safe(size_t size) {
   void* p = mp_malloc(size);
   if (p == NULL) {
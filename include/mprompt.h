@@ -41,6 +41,12 @@ typedef void* (mp_yield_fun_t)(mp_resume_t*, void* arg);
 // Continue with `fun(p,arg)` under a fresh prompt `p`.
 mp_decl_export void* mp_prompt(mp_start_fun_t* fun, void* arg); 
 
+// Continue with `fun(p,arg)` under a prompt `p` with the promise that `fun` never yields to `p`
+// (yielding to outer prompts is still fine). This runs `fun` in place on the current stack without
+// allocating a gstack or switching stacks, and is about as cheap as a plain function call.
+// The prompt `p` is only valid during `fun` and is not part of the prompt chain; yielding to it is not allowed (asserted in debug builds).
+mp_decl_export void* mp_prompt_noyield(mp_start_fun_t* fun, void* arg);
+
 // Yield back up to a parent prompt `p` and run `fun(r,arg)` from there, where `r` is a `mp_resume_t` resumption.
 mp_decl_export void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg);
 
@@ -64,6 +70,7 @@ mp_decl_export mp_resume_t* mp_resume_dup(mp_resume_t* r);    // only multi-resu
 //---------------------------------------------------------------------------
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // Configuration settings
 typedef struct mp_config_s {
@@ -77,6 +84,9 @@ typedef struct mp_config_s {
   ptrdiff_t stack_initial_commit; // initial commit size of a gstack (OS page size, 4 KiB)
   ptrdiff_t stack_gap_size;       // virtual no-access gap between stacks for security (64 KiB)
   ptrdiff_t stack_cache_count;    // count of gstacks to keep in a thread-local cache (4)  
+  bool      stack_no_profile;     // do not record the committed stack per start function to commit that up front on the next entry (false)
+  bool      prompt_registry;      // register all prompts so `mp_prompt_foreach` can enumerate them (false)
+  bool      prompt_accounting;    // time each prompt between switches for `mp_prompt_stats` and the slice hook (false)
 } mp_config_t;
 
 // Initialize with `config`; use NULL for default settings.
@@ -103,9 +113,138 @@ mp_decl_export int          mp_resume_should_unwind(mp_resume_t* r);  // refcoun
 mp_decl_export mp_prompt_t* mp_prompt_create(void);
 mp_decl_export void* mp_prompt_enter(mp_prompt_t* p, mp_start_fun_t* fun, void* arg) ;
 
+// Create a prompt with `user_size` bytes of (zero initialized, 16-byte aligned) user data that is allocated
+// together with the prompt (in the gstack header); use this for task state to avoid a separate allocation.
+// The user data is valid as long as the prompt is (and `mp_prompt_user_data` returns NULL if `user_size` was 0).
+mp_decl_export mp_prompt_t* mp_prompt_create_ex(size_t user_size);
+mp_decl_export void*        mp_prompt_user_data(mp_prompt_t* p);
+mp_decl_export size_t       mp_prompt_user_size(mp_prompt_t* p);
+
+// Recyclable prompts: `mp_prompt_reenter` runs `fun(p,arg)` on a fresh prompt `p` (from `mp_prompt_create`),
+// or on a prompt whose previous start function (entered by `mp_prompt_reenter`) has returned.
+// In contrast to `mp_prompt_enter`, the prompt stays alive after `fun` returns (parked at the base of its
+// gstack with its committed stack intact) so worker loops can re-enter it without any allocation.
+// Use `mp_prompt_release` to free it again (which is also allowed if it was never entered).
+// Both fail with `EINVAL` if the current task of `p` is suspended (by its own `mp_yield`) instead of returned.
+mp_decl_export void* mp_prompt_reenter(mp_prompt_t* p, mp_start_fun_t* fun, void* arg);
+mp_decl_export void  mp_prompt_release(mp_prompt_t* p);
+
 // Walk the chain of prompts.
 mp_decl_export mp_prompt_t* mp_prompt_top(void);
 mp_decl_export mp_prompt_t* mp_prompt_parent(mp_prompt_t* p);
 
+// Stack profiles: when a gstack grows while a prompt runs, its committed size is recorded per start function
+// and on the next entry with that function that much is committed up front (avoiding the commit-on-demand
+// faults). Wrappers that enter many different functions through one start function can set the key to use
+// instead (before entering). Saved profiles store the keys as offsets in their module so a later run of the
+// same program can load them (Linux only for now).
+typedef void (mp_stack_profile_fun_t)(void* key, size_t commit, void* arg);
+
+mp_decl_export void  mp_prompt_set_stack_key(mp_prompt_t* p, void* key);
+mp_decl_export void  mp_stack_profile_set(void* key, size_t commit);   // only increases an existing entry
+mp_decl_export void  mp_stack_profile_foreach(mp_stack_profile_fun_t* fun, void* arg);
+mp_decl_export bool  mp_stack_profile_save(const char* fname);
+mp_decl_export bool  mp_stack_profile_load(const char* fname);
+
+// Enumerate the live prompts (of all threads) if the registry is enabled (`mp_config_t.prompt_registry`).
+// For a suspended prompt the backtrace is taken from its resume point by following frame pointers within
+// its innermost stack (so it is only complete with frame pointers, e.g. `-fno-omit-frame-pointer`).
+// Only suspended prompts are reported with details (start, committed, and backtrace); running prompts
+// (of any thread) are reported with just the `prompt` field. A suspended prompt is briefly kept from
+// being resumed while its details are read, and the information is a snapshot.
+#define MP_PROMPT_INFO_BACKTRACE  (16)
+
+typedef struct mp_prompt_info_s {
+  mp_prompt_t*  prompt;
+  void*         start;            // start function (or the key set with `mp_prompt_set_stack_key`)
+  size_t        committed;        // committed stack memory (an estimate)
+  bool          suspended;        // suspended as a resumption (otherwise active or never entered)
+  int64_t       suspended_nsecs;  // time since it was suspended
+  int           backtrace_len;
+  void*         backtrace[MP_PROMPT_INFO_BACKTRACE];   // return addresses of the suspended stack (innermost first)
+} mp_prompt_info_t;
+
+typedef bool (mp_prompt_visit_fun_t)(const mp_prompt_info_t* info, void* arg);   // return false to stop
+
+mp_decl_export void  mp_prompt_foreach(mp_prompt_visit_fun_t* visit, void* arg);
+
+
+//---------------------------------------------------------------------------
+// Output and error handlers
+// Error (and debug trace) messages are written to stderr by default; an output
+// handler receives each message instead (possibly in several parts). After an
+// error message the error handler is called with the error code (like `EINVAL`);
+// by default an `EFAULT` error aborts. Fatal errors always abort after the handler
+// returns. Register with NULL to restore the default.
+//---------------------------------------------------------------------------
+
+typedef void (mp_output_fun_t)(const char* msg, void* arg);
+typedef void (mp_error_fun_t)(int err, void* arg);
+
+mp_decl_export void mp_output_handler_register(mp_output_fun_t* fun, void* arg);
+mp_decl_export void mp_error_handler_register(mp_error_fun_t* fun, void* arg);
+
+
+//---------------------------------------------------------------------------
+// Context switch hooks
+// `switch_in(p,arg)` is called when prompt `p` (with its suspended chain) is linked into the
+// current stack chain (enter or resume), and `switch_out(p,arg)` when it is unlinked again
+// (yield or return). Both are called while `p` is active and before the actual stack switch.
+// Use these to swap external thread-local state (allocator caches, trace spans, etc.) per prompt.
+// Register at startup before any prompts are used (at most 8 hooks); returns `false` if full.
+// When no hooks are registered the overhead is a single predictable branch per switch.
+//---------------------------------------------------------------------------
+
+typedef void (mp_switch_hook_fun_t)(mp_prompt_t* p, void* arg);
+
+mp_decl_export bool mp_switch_hook_register(mp_switch_hook_fun_t* switch_in, mp_switch_hook_fun_t* switch_out, void* arg);
+
+
+//---------------------------------------------------------------------------
+// Accounting
+// With `mp_config_t.prompt_accounting` enabled, each prompt accumulates the time it ran
+// between being linked (enter/resume) and unlinked (yield/return), using the cycle counter.
+// The time of a prompt includes that of prompts running nested inside it.
+// The slice hook is called (on unlink, while the prompt is still active) whenever a single
+// slice exceeds the threshold; register at startup before any prompts are used.
+//---------------------------------------------------------------------------
+
+typedef struct mp_prompt_stats_s {
+  uint64_t  run_nsecs;        // total running time
+  uint64_t  max_slice_nsecs;  // longest running time between two switches
+  size_t    switches;         // number of times it was entered or resumed
+} mp_prompt_stats_t;
+
+typedef void (mp_slice_fun_t)(mp_prompt_t* p, uint64_t slice_nsecs, void* arg);
+
+mp_decl_export bool mp_prompt_stats(mp_prompt_t* p, mp_prompt_stats_t* stats);   // false if accounting is not enabled
+mp_decl_export void mp_slice_hook_register(uint64_t threshold_nsecs, mp_slice_fun_t* fun, void* arg);
+
+
+//---------------------------------------------------------------------------
+// Event trace
+// When compiled with `MP_EVENT_TRACE=1` (cmake `-DMP_EVENT_TRACE=ON`), each thread records
+// the prompt creates, enters, resumes, yields, returns, drops, and commit-on-demand faults
+// (with a cycle counter timestamp) in a ring buffer of its last 64Ki events. Dump writes the
+// rings of all threads as a Chrome trace (JSON) when the threads are quiescent.
+// Returns `false` (with `errno` set to `ENOSYS`) if the trace is not compiled in.
+//---------------------------------------------------------------------------
+
+mp_decl_export bool mp_event_trace_dump(const char* fname);
+
+
+//---------------------------------------------------------------------------
+// Sampling profiler
+// Start samples the calling thread `hz` times per second of its CPU time (with `SIGPROF`).
+// A sample records the frame pointer stack across the whole prompt chain together with the
+// start function of the innermost prompt. Dump writes the samples of all threads as folded
+// stacks (`[prompt <start>];outer;..;inner <count>`) for flame graph tools; stop the
+// profiled threads first. Linux only for now: elsewhere these return `false` with `ENOSYS`.
+//---------------------------------------------------------------------------
+
+mp_decl_export bool mp_profiler_start(int hz);
+mp_decl_export void mp_profiler_stop(void);
+mp_decl_export bool mp_profiler_dump(const char* fname);
+
 
 #endif
\ No newline at end of file
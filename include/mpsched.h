@@ -0,0 +1,307 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#pragma once
+#ifndef MP_MPSCHED_H
+#define MP_MPSCHED_H
+
+#include "mprompt.h"
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+//---------------------------------------------------------------------------
+// M:N task scheduler
+// Tasks run under their own prompt and are scheduled over a set of worker
+// threads. Each worker has a work-stealing deque and idle workers steal
+// suspended tasks from other workers. As such, a task can resume on a
+// different thread after any suspension point (`mp_task_yield`, `mp_task_park`, etc.)
+// and should not keep pointers to thread-local state across one.
+//---------------------------------------------------------------------------
+
+typedef struct mp_sched_s mp_sched_t;
+typedef struct mp_task_s  mp_task_t;
+
+typedef void (mp_task_fun_t)(void* arg);
+
+// Create a scheduler with `worker_count` worker threads (use 0 for the number of processors).
+mp_decl_export mp_sched_t* mp_sched_create(size_t worker_count);
+mp_decl_export void        mp_sched_free(mp_sched_t* s);
+mp_decl_export size_t      mp_sched_worker_count(mp_sched_t* s);
+
+// Spawn a task that runs `fun(arg)`; can be called from any thread (and also before `mp_sched_run`).
+mp_decl_export void        mp_sched_spawn(mp_sched_t* s, mp_task_fun_t* fun, void* arg);
+
+// Run until all tasks are done; the calling thread becomes worker 0 for the duration.
+mp_decl_export void        mp_sched_run(mp_sched_t* s);
+
+
+// Within a task
+mp_decl_export mp_task_t*  mp_task_current(void);       // NULL if not running in a task
+mp_decl_export size_t      mp_task_worker(void);        // index of the current worker
+mp_decl_export void        mp_task_spawn(mp_task_fun_t* fun, void* arg);  // spawn in the scheduler of the current task
+mp_decl_export void        mp_task_yield(void);         // let other tasks run first
+
+// Suspend the current task: `park(t,arg)` is called right after the task is suspended (on the
+// worker stack) and should arrange for `mp_task_wake(t,result)` to be called at some point (from any
+// thread, and possibly right away) after which `mp_task_park` returns with `result`.
+// Note: after `t` is handed out in `park` it may already be running elsewhere.
+typedef void (mp_task_park_fun_t)(mp_task_t* t, void* arg);
+
+mp_decl_export void*       mp_task_park(mp_task_park_fun_t* park, void* arg);
+mp_decl_export void        mp_task_wake(mp_task_t* t, void* result);
+
+
+//---------------------------------------------------------------------------
+// Timers
+// Timers are kept in a hierarchical timing wheel (per scheduler) with a 1ms
+// tick, with O(1) insertion and cancelation. Idle workers wait for the next
+// tick and expire all due timers at once.
+//---------------------------------------------------------------------------
+
+// Suspend the current task for at least `nsecs` nano-seconds (or block the thread outside a task).
+mp_decl_export void        mp_sleep(int64_t nsecs);
+
+// Park with a timeout: like `mp_task_park` but if there is no `mp_task_wake` within `nsecs`
+// nano-seconds, `cancel(t,arg)` is called. It should remove `t` from wherever `park` published it and
+// return `true`, after which the task resumes with `MP_TIMEOUT`. If it returns `false` a wake
+// is already on its way and the task resumes with that result instead. The timer is no longer
+// involved when `cancel` runs, so it may take locks that are held while calling `mp_task_wake`.
+#define MP_TIMEOUT   ((void*)(intptr_t)(-1))
+
+typedef bool (mp_task_cancel_fun_t)(mp_task_t* t, void* arg);
+
+mp_decl_export void*       mp_timeout(int64_t nsecs, mp_task_park_fun_t* park, mp_task_cancel_fun_t* cancel, void* arg);
+
+
+//---------------------------------------------------------------------------
+// Preemption
+// Long running computations can call `mp_maybe_yield` at safe points: it
+// yields the task if it ran for more than a time slice without suspending
+// (and is just a thread-local load and a branch otherwise). The time slice
+// is measured on the CPU-time clock of the worker thread by a timer that
+// signals the thread (with `SIGURG`). Only available on Linux.
+//---------------------------------------------------------------------------
+
+// Set the time slice before `mp_sched_run` (0 to disable, which is the default).
+// Returns `false` if preemption is not supported on this platform.
+mp_decl_export bool        mp_sched_timeslice(mp_sched_t* s, int64_t nsecs);
+mp_decl_export void        mp_maybe_yield(void);
+
+
+//---------------------------------------------------------------------------
+// Priority classes
+// A task can have a priority (higher runs first, 0 by default) and a deadline
+// (in nano-seconds from now, or 0 for none). Ready tasks with a class run before
+// tasks without one, in strict priority order and earliest deadline first within
+// a priority (and FIFO otherwise). Tasks with a class are kept in a shared heap
+// per scheduler (O(log n)), while the default tasks use the per-worker deques.
+//---------------------------------------------------------------------------
+
+mp_decl_export void        mp_sched_spawn_prio(mp_sched_t* s, mp_task_fun_t* fun, void* arg, int priority, int64_t deadline);
+mp_decl_export void        mp_task_set_priority(int priority, int64_t deadline);  // of the current task (from its next suspension)
+
+// A ready queue of plain resumptions with the same ordering (not thread-safe).
+typedef struct mp_readyq_s mp_readyq_t;
+
+mp_decl_export mp_readyq_t* mp_readyq_create(void);
+mp_decl_export void         mp_readyq_free(mp_readyq_t* q);   // drops remaining resumptions
+mp_decl_export size_t       mp_readyq_count(mp_readyq_t* q);
+mp_decl_export void         mp_readyq_push(mp_readyq_t* q, mp_resume_t* r, void* arg, int priority, int64_t deadline);
+mp_decl_export bool         mp_readyq_resume_next(mp_readyq_t* q, void** result);  // resume the first one with its `arg`; false if empty
+
+
+//---------------------------------------------------------------------------
+// Inboxes
+// A resumption must be resumed on the thread that owns it (the thread that runs
+// its parent prompt). Other threads can post a resumption to an inbox of the
+// owner thread, which resumes the posted entries in order when it drains the
+// inbox. Posting is lock-free and only the first post into an empty inbox
+// signals the eventfd of the inbox (which the owner can wait on, or add to its
+// own event loop). Tasks of a scheduler do not need this (use `mp_task_wake`).
+//---------------------------------------------------------------------------
+
+typedef struct mp_inbox_s mp_inbox_t;
+
+mp_decl_export mp_inbox_t* mp_inbox_create(void);
+mp_decl_export void        mp_inbox_free(mp_inbox_t* ib);     // drops remaining resumptions
+mp_decl_export int         mp_inbox_fd(mp_inbox_t* ib);       // readable when entries are posted
+
+mp_decl_export void        mp_resume_post(mp_inbox_t* ib, mp_resume_t* r, void* arg);  // from any thread
+mp_decl_export size_t      mp_inbox_drain(mp_inbox_t* ib);    // resume all posted entries (on the owner thread); returns the count
+mp_decl_export size_t      mp_inbox_wait(mp_inbox_t* ib, int timeout_ms);  // wait until entries are posted (or -1 for no timeout) and drain
+
+
+//---------------------------------------------------------------------------
+// Groups
+// A group owns the prompts started by `mp_group_spawn` (on the current thread).
+// A member suspends with `mp_member_suspend`, where `park(m,arg)` publishes the
+// member `m` to whatever will resume it later with `mp_member_resume`.
+// Cancelling a group handles all suspended members in one pass: either they are
+// resumed such that `mp_member_suspend` returns false (and the member should
+// unwind by returning from its start function, running its cleanup), or their
+// resumptions are dropped without running them. After cancelling, any
+// further `mp_member_suspend` returns false right away.
+//---------------------------------------------------------------------------
+
+typedef struct mp_group_s  mp_group_t;
+typedef struct mp_member_s mp_member_t;
+
+typedef void (mp_member_park_fun_t)(mp_member_t* m, void* arg);
+
+mp_decl_export mp_group_t* mp_group_create(void);
+mp_decl_export void        mp_group_free(mp_group_t* g);      // cancels (and unwinds) the suspended members
+mp_decl_export size_t      mp_group_count(mp_group_t* g);     // members that have not finished yet
+mp_decl_export size_t      mp_group_suspended_count(mp_group_t* g);
+mp_decl_export bool        mp_group_is_cancelled(mp_group_t* g);
+mp_decl_export size_t      mp_group_cancel(mp_group_t* g, bool unwind);  // returns the number of suspended members that were cancelled
+
+// Run `fun(p,arg)` under a fresh prompt `p` as a member of `g`; returns its result when it
+// finishes, or NULL when it suspends.
+mp_decl_export void*       mp_group_spawn(mp_group_t* g, mp_start_fun_t* fun, void* arg);
+
+// Suspend the member running under `p` (as passed to its start function); returns false when cancelled.
+mp_decl_export bool        mp_member_suspend(mp_prompt_t* p, mp_member_park_fun_t* park, void* arg, void** result);
+mp_decl_export void*       mp_member_resume(mp_member_t* m, void* value);  // `value` is the `result` of the suspend
+
+
+//---------------------------------------------------------------------------
+// Offloading blocking calls
+// Run a call that may block (like `getaddrinfo` or `fsync`) on a small pool of
+// threads (per scheduler) while the current task is suspended, such that the
+// worker thread can keep running other tasks. Returns the result of `fun(arg)`.
+// Outside a task the call just runs on the calling thread.
+//---------------------------------------------------------------------------
+
+typedef void* (mp_offload_fun_t)(void* arg);
+
+mp_decl_export void*       mp_offload(mp_offload_fun_t* fun, void* arg);
+
+// Set the number of pool threads (use 0 for the default of 4); the threads are started
+// on the first offload and this returns `false` if they were already started.
+mp_decl_export bool        mp_offload_threads(mp_sched_t* s, size_t count);
+
+
+//---------------------------------------------------------------------------
+// Channels
+// Channels pass `void*` values between tasks. A channel has a capacity of
+// `0` (unbuffered: each send waits for a receiver), `n` (bounded), or
+// `MP_CHAN_UNBOUNDED`. A blocked task is suspended (not the worker) and a
+// matching operation hands the value directly to the blocked peer and wakes it up.
+// Blocking operations can only be used from within a task.
+//---------------------------------------------------------------------------
+
+typedef struct mp_chan_s mp_chan_t;
+
+#define MP_CHAN_UNBOUNDED  (SIZE_MAX)
+
+mp_decl_export mp_chan_t*  mp_chan_create(size_t capacity);
+mp_decl_export void        mp_chan_free(mp_chan_t* c);
+mp_decl_export void        mp_chan_close(mp_chan_t* c);   // wakes up all blocked tasks; sends fail after this, and receives once the buffer is empty
+
+mp_decl_export bool        mp_chan_send(mp_chan_t* c, void* value);     // returns false if the channel is closed
+mp_decl_export bool        mp_chan_recv(mp_chan_t* c, void** value);    // returns false if the channel is closed (and empty)
+mp_decl_export bool        mp_chan_try_send(mp_chan_t* c, void* value); // never blocks; returns true if sent
+mp_decl_export bool        mp_chan_try_recv(mp_chan_t* c, void** value);
+
+// Wait for one of several operations: returns the index of the operation that completed
+// (at most 64 operations; the first ready one in order is chosen). Returns -1 (with an
+// `EINVAL` error) for an invalid operation count, or if it would block outside a task.
+typedef enum mp_chan_kind_e {
+  MP_CHAN_SEND,
+  MP_CHAN_RECV
+} mp_chan_kind_t;
+
+typedef struct mp_chan_op_s {
+  mp_chan_t*      chan;
+  mp_chan_kind_t  kind;
+  void*           value;    // the value to send, or the received value
+  bool            ok;       // false if the channel was closed
+} mp_chan_op_t;
+
+mp_decl_export ssize_t     mp_chan_select(mp_chan_op_t* ops, size_t count);
+
+
+//---------------------------------------------------------------------------
+// Synchronization
+// Like the pthread primitives, but a blocked task is suspended (instead of the
+// worker thread) in a FIFO queue. Uncontended operations take a single atomic
+// instruction. Blocking operations can only be used from within a task.
+//---------------------------------------------------------------------------
+
+typedef struct mp_mutex_s      mp_mutex_t;
+typedef struct mp_cond_s       mp_cond_t;
+typedef struct mp_sem_s        mp_sem_t;
+typedef struct mp_waitgroup_s  mp_waitgroup_t;
+
+// Mutex: on unlock the lock is handed to the first waiting task (if any).
+mp_decl_export mp_mutex_t*     mp_mutex_create(void);
+mp_decl_export void            mp_mutex_free(mp_mutex_t* m);
+mp_decl_export void            mp_mutex_lock(mp_mutex_t* m);
+mp_decl_export bool            mp_mutex_try_lock(mp_mutex_t* m);
+mp_decl_export void            mp_mutex_unlock(mp_mutex_t* m);
+
+// Condition variable: `mp_cond_wait` atomically unlocks `m` and waits for a signal,
+// and locks `m` again before returning. (There are no spurious wake ups, but as usual
+// the condition may no longer hold once the mutex is reacquired.)
+mp_decl_export mp_cond_t*      mp_cond_create(void);
+mp_decl_export void            mp_cond_free(mp_cond_t* c);
+mp_decl_export void            mp_cond_wait(mp_cond_t* c, mp_mutex_t* m);
+mp_decl_export void            mp_cond_signal(mp_cond_t* c);     // wake up the first waiting task
+mp_decl_export void            mp_cond_broadcast(mp_cond_t* c);  // wake up all waiting tasks
+
+// Counting semaphore
+mp_decl_export mp_sem_t*       mp_sem_create(size_t count);
+mp_decl_export void            mp_sem_free(mp_sem_t* s);
+mp_decl_export void            mp_sem_acquire(mp_sem_t* s);
+mp_decl_export bool            mp_sem_try_acquire(mp_sem_t* s);
+mp_decl_export void            mp_sem_release(mp_sem_t* s);
+
+// Wait group: wait until the count drops to zero (usually by `mp_waitgroup_add(wg,n)` before
+// spawning `n` tasks that each call `mp_waitgroup_done(wg)` when finished).
+mp_decl_export mp_waitgroup_t* mp_waitgroup_create(void);
+mp_decl_export void            mp_waitgroup_free(mp_waitgroup_t* wg);
+mp_decl_export void            mp_waitgroup_add(mp_waitgroup_t* wg, ssize_t n);
+mp_decl_export void            mp_waitgroup_done(mp_waitgroup_t* wg);
+mp_decl_export void            mp_waitgroup_wait(mp_waitgroup_t* wg);
+
+
+//---------------------------------------------------------------------------
+// I/O
+// Non-blocking file descriptors where a task is suspended (instead of the worker
+// thread) until the descriptor is ready. Each scheduler has an epoll instance
+// that is polled by otherwise idle workers. These return -1 and set `errno` on
+// failure just like the corresponding system calls. Outside a task they block
+// the calling thread. File descriptors should be put in non-blocking mode first
+// (see `mp_io_nonblock`) and at most one task should wait for reading (or
+// writing) on a descriptor at a time (or `EBUSY` is returned).
+//---------------------------------------------------------------------------
+
+#define MP_IO_READ   (1)
+#define MP_IO_WRITE  (2)
+
+mp_decl_export int         mp_io_nonblock(int fd);
+mp_decl_export int         mp_io_wait(int fd, int events);   // wait until readable (`MP_IO_READ`) or writable (`MP_IO_WRITE`)
+mp_decl_export ssize_t     mp_io_read(int fd, void* buf, size_t len);
+mp_decl_export ssize_t     mp_io_write(int fd, const void* buf, size_t len);
+mp_decl_export int         mp_io_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);  // the new socket is non-blocking
+mp_decl_export int         mp_io_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+mp_decl_export int         mp_io_close(int fd);   // unregister and close (a task waiting on `fd` fails with `EBADF`)
+
+// Read or write at a file offset (or at the current position if `offset < 0`).
+// These work for regular files as well and use io_uring completions if available: the operation
+// is submitted when the task suspends and the task is resumed with the result. Otherwise (or outside
+// a task) these fall back to the readiness based operations (and plain `pread`/`pwrite` for files).
+mp_decl_export ssize_t     mp_io_pread(int fd, void* buf, size_t len, off_t offset);
+mp_decl_export ssize_t     mp_io_pwrite(int fd, const void* buf, size_t len, off_t offset);
+
+// Use io_uring for `mp_io_pread`/`mp_io_pwrite` (enabled by default if the kernel supports it,
+// unless the `MP_IO_URING=0` environment variable is set). Call this before `mp_sched_run`.
+// Returns whether io_uring is used.
+mp_decl_export bool        mp_io_uring_enable(mp_sched_t* s, bool enable);
+
+
+#endif
@@ -7,5 +7,9 @@
   Include all sources in one file for compilation for better optimization
 -----------------------------------------------------------------------------*/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE   // for `dl_iterate_phdr` in libmprompt (and always defined by g++)
+#endif
+
 #include "mpeff.c"
 #include "../mprompt/main.c"
@@ -450,11 +450,30 @@ static mpe_decl_noinline void* mpe_handle_start(mp_prompt_t* prompt, void* earg)
   return result;
 }
 
+// A handler never yields to its own prompt if all its operations are tail resumptive 
+// (and execute in place) or unwind using an exception (`MPE_OP_NEVER` in C++).
+static bool mpe_handlerdef_is_noyield(const mpe_handlerdef_t* hdef) {
+  const size_t n = sizeof(hdef->operations) / sizeof(hdef->operations[0]);
+  for (size_t i = 0; i < n && hdef->operations[i].opkind != MPE_OP_NULL; i++) {
+    mpe_opkind_t opkind = hdef->operations[i].opkind;
+    if (opkind == MPE_OP_TAIL_NOOP || opkind == MPE_OP_TAIL) continue;
+    if (MPE_HAS_TRY && opkind == MPE_OP_NEVER) continue;
+    return false;
+  }
+  return true;
+}
+
 /// Handle a particular effect.
 /// Handles operations yielded in `body(arg)` with the given handler definition `def`.
 void* mpe_handle(const mpe_handlerdef_t* hdef, void* local, mpe_actionfun_t* body, void* arg) {
   struct mpe_handle_start_env env = { hdef, local, body, arg };
-  return mp_prompt(&mpe_handle_start, &env);
+  if (mpe_handlerdef_is_noyield(hdef)) {
+    return mp_prompt_noyield(&mpe_handle_start, &env);  // no need for a fresh gstack
+  }
+  // profile the stack per body function (instead of sharing one entry for `mpe_handle_start`)
+  mp_prompt_t* p = mp_prompt_create();
+  mp_prompt_set_stack_key(p, (void*)(uintptr_t)body);
+  return mp_prompt_enter(p, &mpe_handle_start, &env);
 }
 
 
@@ -10,12 +10,16 @@
   committed memory at minimum (and 2 on Windows)
 -----------------------------------------------------------------------------*/
 
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include "mprompt.h"
 #include "internal/util.h"
+#include "internal/atomic.h"
 #include "internal/longjmp.h"       // mp_stack_enter
 #include "internal/gstack.h"
+#include "internal/trace.h"
+#include "internal/usdt.h"
 
 #ifdef __cplusplus
 #include <exception>
@@ -39,9 +43,14 @@ struct mp_gstack_s {
   ssize_t       initial_commit;     // initial committed memory (usually `os_page_size`)  
   ssize_t       committed;          // current committed estimate
   ssize_t       extra_size;         // size of extra allocated bytes.         
-  uint8_t       extra[1];           // extra allocated (holds the mp_prompt_t structure)
+  mp_decl_cache_align uint8_t extra[1];  // extra allocated (holds the mp_prompt_t structure) (on its own cache line as it is used on every switch)
 };
 
+// The header is cache line aligned (and allocated with `mp_malloc_aligned`)
+static ssize_t mp_gstack_header_size(ssize_t extra_size) {
+  return (ssize_t)offsetof(mp_gstack_t, extra) + extra_size;
+}
+
 
 
 //----------------------------------------------------------------------------------
@@ -62,6 +71,7 @@ static bool    os_gstack_reset_decommits  = false;         // force full decommi
 static bool    os_gstack_grow_fast        = true;          // use doubling to grow gstacks (up to 1MiB)
 static ssize_t os_gstack_cache_max_count  = 4;             // number of prompts to keep in the thread local cache
 static ssize_t os_gstack_exn_guaranteed   = 32 * MP_KIB;   // guaranteed stack size available during an exception unwind (only used on Windows)
+static bool    os_gstack_profile          = true;          // record the committed size per start function and pre-commit on entry
 
 #if defined(_MSC_VER) && !defined(NDEBUG)  // gpool a tad smaller in msvc so debug traces work (as the gpool can be placed lower than the system stack)
 static ssize_t os_gpool_max_size          = 16 * MP_GIB;   // virtual size of one gstack pooled area (holds about 2^15 gstacks)
@@ -105,6 +115,10 @@ static uint8_t* mp_os_mem_reserve(ssize_t size);
 static void     mp_os_mem_free(uint8_t* p, ssize_t size);
 static bool     mp_os_mem_commit(uint8_t* start, ssize_t size);
 
+// Used to save stack profiles across runs (as an offset in a loaded module)
+static bool     mp_os_module_offset(const void* addr, char* name, size_t name_size, size_t* offset);
+static void*    mp_os_module_address(const char* name, size_t offset);
+
 // Used by signal handler to check access
 typedef enum mp_access_e {
   MP_NOACCESS,                    // no access (outside pool)
@@ -200,33 +214,54 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
   #if !defined(NDEBUG)
   void* sp = (void*)&sp;
   #endif
+  // we prefer a stack with enough extra space, but otherwise reuse a stack with a too small 
+  // header (`small`) and just reallocate its header as that is much cheaper than a fresh stack.
   mp_gstack_t* g = _mp_gstack_cache;  
   mp_gstack_t* prev = NULL;
+  mp_gstack_t* small = NULL;
+  mp_gstack_t* small_prev = NULL;
   while (g != NULL) {
-    bool good = (g->extra_size >= extra_size);
+    bool good = true;
     #if !defined(NDEBUG)
     // only use a cached stack if it is under the parent stack (to help unwinding during debugging)
     void* stack = g->stack;
-    good = good && (os_stack_grows_down ? stack < sp : sp < stack);
+    good = (os_stack_grows_down ? stack < sp : sp < stack);
     #endif  
-    if (good) {
-      if (prev == NULL) { _mp_gstack_cache = g->next; }
-                   else { prev->next = g->next; }
-      _mp_gstack_cache_count--;
-      g->next = NULL;
-      break;
+    if (good && g->extra_size < extra_size) {
+      if (small == NULL) { small = g; small_prev = prev; }
+      good = false;
     }
-    else {
-      prev = g;
-      g = g->next;
+    if (good) break;
+    prev = g;
+    g = g->next;
+  }
+  if (g == NULL && small != NULL) {
+    ssize_t new_extra_size = mp_align_up(extra_size, sizeof(void*));
+    mp_gstack_t* gnew = (mp_gstack_t*)mp_malloc_aligned(mp_gstack_header_size(new_extra_size), MP_CACHE_LINE);
+    if (gnew != NULL) {
+      memcpy(gnew, small, offsetof(mp_gstack_t, extra));
+      mp_free_aligned(small);
+      if (small_prev == NULL) { _mp_gstack_cache = gnew; }
+                         else { small_prev->next = gnew; }
+      gnew->extra_size = new_extra_size;
+      g = gnew;
+      prev = small_prev;
     }
   }
+  if (g != NULL) {
+    if (prev == NULL) { _mp_gstack_cache = g->next; }
+                 else { prev->next = g->next; }
+    _mp_gstack_cache_count--;
+    g->next = NULL;
+    mp_usdt1(gstack_cache_hit, g);
+  }
 
   // otherwise allocate fresh
   if (g == NULL) {
+    mp_usdt0(gstack_cache_miss);
     // allocate separately for security
     extra_size = mp_align_up(extra_size, sizeof(void*));    
-    g = (mp_gstack_t*)mp_malloc(sizeof(mp_gstack_t) - 1 + extra_size); 
+    g = (mp_gstack_t*)mp_malloc_aligned(mp_gstack_header_size(extra_size), MP_CACHE_LINE);
     if (g == NULL) {
       return NULL;
     }
@@ -237,7 +272,7 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
     ssize_t  initial_commit;
     uint8_t* full = mp_gstack_os_alloc(&stk, &stk_size, &initial_commit);
     if (full == NULL) { 
-      mp_free(g);
+      mp_free_aligned(g);
       errno = ENOMEM;
       return NULL;
     }    
@@ -260,6 +295,7 @@ mp_gstack_t* mp_gstack_alloc(ssize_t extra_size, void** extra)
     g->stack_size = stk_size;
     g->initial_commit = g->committed = initial_commit;
     g->extra_size = extra_size;
+    mp_usdt2(gstack_alloc, g, stk_size);
   }
 
   if (extra != NULL && extra_size > 0) {
@@ -290,6 +326,17 @@ void mp_gstack_enter(mp_gstack_t* g, mp_jmpbuf_t** return_jmp, mp_stack_start_fu
 }
 
 
+ssize_t mp_gstack_committed(const mp_gstack_t* g) {
+  return g->committed;
+}
+
+bool mp_gstack_is_used(const mp_gstack_t* g, const void* sp, const void* p) {
+  const uint8_t* q = (const uint8_t*)p;
+  if (!mp_gstack_contains(g, (const uint8_t*)sp) || !mp_gstack_contains(g, q)) return false;
+  return (os_stack_grows_down ? q >= (const uint8_t*)sp : q <= (const uint8_t*)sp);
+}
+
+
 // Free a gstack
 void mp_gstack_free(mp_gstack_t* g, bool delay) {
   if (g == NULL) return;
@@ -314,8 +361,138 @@ void mp_gstack_free(mp_gstack_t* g, bool delay) {
   }
 
   // otherwise free it to the OS
+  mp_usdt1(gstack_free, g);
   mp_gstack_os_free(g->full, g->stack, g->stack_size, g->committed);
-  mp_free(g);
+  mp_free_aligned(g);
+}
+
+
+//----------------------------------------------------------------------------------
+// Stack profiles
+// When a prompt is freed and its gstack grew while it ran, the committed size
+// is recorded for its key (usually the start function). On the next entry with
+// the same key that much is committed up front, which avoids the repeated
+// commit-on-demand faults on fresh gstacks. The table is global with a fixed
+// size (open addressing) and entries are only added or increased.
+//----------------------------------------------------------------------------------
+
+#define MP_STACK_PROFILE_SIZE  (1024)   // power of 2
+
+typedef struct mp_stack_profile_s {
+  _Atomic(intptr_t)  key;
+  _Atomic(intptr_t)  commit;
+} mp_stack_profile_t;
+
+static mp_stack_profile_t  mp_stack_profiles[MP_STACK_PROFILE_SIZE];
+static _Atomic(intptr_t)   mp_stack_profile_count;
+
+static size_t mp_stack_profile_hash(intptr_t key) {
+  return (size_t)(((uintptr_t)key >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (MP_STACK_PROFILE_SIZE - 1);
+}
+
+// Find the entry for a key (and add it if `add` is set); NULL if not found or if the table is full
+static mp_stack_profile_t* mp_stack_profile_find(intptr_t key, bool add) {
+  size_t i = mp_stack_profile_hash(key);
+  for (size_t n = 0; n < MP_STACK_PROFILE_SIZE; n++, i = (i + 1) & (MP_STACK_PROFILE_SIZE - 1)) {
+    mp_stack_profile_t* e = &mp_stack_profiles[i];
+    intptr_t k = mp_atomic_load(&e->key);
+    if (k == key) return e;
+    if (k == 0) {
+      if (!add) return NULL;
+      if (mp_atomic_cas(&e->key, &k, key)) {
+        mp_atomic_add(&mp_stack_profile_count, 1);
+        return e;
+      }
+      if (k == key) return e;   // added concurrently
+    }
+  }
+  return NULL;
+}
+
+static void mp_stack_profile_raise(intptr_t key, ssize_t commit) {
+  mp_stack_profile_t* e = mp_stack_profile_find(key, true);
+  if (e == NULL) return;
+  intptr_t current = mp_atomic_load(&e->commit);
+  while (current < commit && !mp_atomic_cas(&e->commit, &current, (intptr_t)commit)) { };
+}
+
+// Commit the profiled size for `key` up front; returns the committed size at entry.
+ssize_t mp_gstack_precommit(mp_gstack_t* g, void* key) {
+  #if !defined(_WIN32)   // on Windows the stack limit and guard page are managed by the OS
+  if (key != NULL && os_gstack_profile && !os_use_overcommit && mp_atomic_load(&mp_stack_profile_count) > 0) {
+    mp_stack_profile_t* e = mp_stack_profile_find((intptr_t)key, false);
+    if (e != NULL) {
+      ssize_t commit = mp_atomic_load(&e->commit);
+      if (commit > g->committed) {
+        commit = mp_align_up(commit, os_page_size);
+        if (commit > g->stack_size) { commit = g->stack_size; }
+        uint8_t* commit_start;
+        mp_push(mp_gstack_base(g), commit, &commit_start);
+        if (mp_os_mem_commit(commit_start, commit)) { g->committed = commit; }
+      }
+    }
+  }
+  #else
+  MP_UNUSED(key);
+  #endif
+  return g->committed;
+}
+
+// Record the committed size for `key` if the stack grew since entry.
+void mp_gstack_profile(mp_gstack_t* g, void* key, ssize_t entry_committed) {
+  if (os_gstack_profile && key != NULL && g->committed > entry_committed) {
+    mp_stack_profile_raise((intptr_t)key, g->committed);
+  }
+}
+
+void mp_stack_profile_set(void* key, size_t commit) {
+  mp_stack_profile_raise((intptr_t)key, (ssize_t)commit);
+}
+
+void mp_stack_profile_foreach(mp_stack_profile_fun_t* fun, void* arg) {
+  for (size_t i = 0; i < MP_STACK_PROFILE_SIZE; i++) {
+    mp_stack_profile_t* e = &mp_stack_profiles[i];
+    intptr_t key = mp_atomic_load(&e->key);
+    intptr_t commit = mp_atomic_load(&e->commit);
+    if (key != 0 && commit > 0) { fun((void*)key, (size_t)commit, arg); }
+  }
+}
+
+// Saved as lines of `<offset> <commit> <module>` so it can be loaded by a later run
+static void mp_stack_profile_write(void* key, size_t commit, void* arg) {
+  char name[1024];
+  size_t offset;
+  if (mp_os_module_offset(key, name, sizeof(name), &offset)) {
+    fprintf((FILE*)arg, "%zx %zu %s\n", offset, commit, name);
+  }
+}
+
+bool mp_stack_profile_save(const char* fname) {
+  FILE* f = fopen(fname, "w");
+  if (f == NULL) {
+    mp_system_error_message(errno, "unable to write the stack profile to %s\n", fname);
+    return false;
+  }
+  mp_stack_profile_foreach(&mp_stack_profile_write, f);
+  return (fclose(f) == 0);
+}
+
+bool mp_stack_profile_load(const char* fname) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) return false;
+  char line[1100];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    size_t offset;
+    size_t commit;
+    int n = 0;
+    if (sscanf(line, "%zx %zu %n", &offset, &commit, &n) != 2 || n <= 0) continue;
+    char* name = line + n;
+    name[strcspn(name, "\r\n")] = 0;
+    void* key = mp_os_module_address(name, offset);
+    if (key != NULL) { mp_stack_profile_set(key, commit); }
+  }
+  fclose(f);
+  return true;
 }
 
 
@@ -327,7 +504,7 @@ void mp_gstack_clear_cache(void) {
     mp_gstack_t* next = _mp_gstack_cache = g->next;
     _mp_gstack_cache_count--;
     mp_gstack_os_free(g->full, g->stack, g->stack_size, g->committed);
-    mp_free(g);
+    mp_free_aligned(g);
     g = next;
   }
   mp_assert_internal(_mp_gstack_cache == NULL);
@@ -453,6 +630,9 @@ bool mp_gstack_init(const mp_config_t* config) {
       if (config->stack_gap_size > 0) {
         os_gstack_gap = mp_align_up(config->stack_gap_size, 4 * MP_KIB);
       }
+      if (config->stack_no_profile) {
+        os_gstack_profile = false;
+      }
       if (config->stack_cache_count >= 0) {
         os_gstack_cache_max_count = config->stack_cache_count;
       }
@@ -501,6 +681,7 @@ mp_config_t mp_config_default(void) {
   cfg.stack_exn_guaranteed = os_gstack_exn_guaranteed;
   cfg.stack_cache_count = os_gstack_cache_max_count;
   cfg.stack_gap_size = os_gstack_gap;
+  cfg.stack_no_profile = !os_gstack_profile;
   return cfg;
 }
 
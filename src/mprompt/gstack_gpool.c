@@ -112,6 +112,7 @@ static mp_gpool_t* mp_gpool_create(void* p, ssize_t size, ssize_t stack_size, ss
   // push atomically at the head of the pools
   gp->next = mp_atomic_load_ptr(mp_gpool_t, &mp_gpools);
   while (!mp_atomic_cas_ptr(mp_gpool_t, &mp_gpools, &gp->next, gp)) {};
+  mp_usdt2(gpool_create, gp, gp->size);
   //mp_trace_message("gpool_create: %p, b1: %p, b2: %p\n", gp, (uint8_t*)gp + gp->block_size, (uint8_t*)gp + 2*gp->block_size);
   return gp;
 }
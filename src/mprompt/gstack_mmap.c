@@ -143,6 +143,78 @@ static bool mp_os_mem_reset(uint8_t* p, ssize_t size) {
 }
 
 
+//----------------------------------------------------------------------------------
+// Module offsets (for saved stack profiles)
+//----------------------------------------------------------------------------------
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <link.h>      // dl_iterate_phdr
+
+typedef struct mp_module_find_s {
+  const void* addr;       // find the module containing `addr`,
+  const char* name;       // or the module with this name
+  const char* found_name;
+  uintptr_t   found_base;
+  bool        found;
+} mp_module_find_t;
+
+static int mp_module_find_visit(struct dl_phdr_info* info, size_t size, void* arg) {
+  MP_UNUSED(size);
+  mp_module_find_t* find = (mp_module_find_t*)arg;
+  const char* name = (info->dlpi_name == NULL || info->dlpi_name[0] == 0 ? "[main]" : info->dlpi_name);
+  if (find->name != NULL) {
+    if (strcmp(name, find->name) != 0) return 0;
+  }
+  else {
+    bool contains = false;
+    for (int i = 0; i < info->dlpi_phnum && !contains; i++) {
+      const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+      if (ph->p_type != PT_LOAD) continue;
+      uintptr_t start = (uintptr_t)info->dlpi_addr + (uintptr_t)ph->p_vaddr;
+      contains = ((uintptr_t)find->addr >= start && (uintptr_t)find->addr < start + (uintptr_t)ph->p_memsz);
+    }
+    if (!contains) return 0;
+  }
+  find->found_name = name;
+  find->found_base = (uintptr_t)info->dlpi_addr;
+  find->found = true;
+  return 1;
+}
+
+static bool mp_os_module_offset(const void* addr, char* name, size_t name_size, size_t* offset) {
+  mp_module_find_t find;
+  memset(&find, 0, sizeof(find));
+  find.addr = addr;
+  dl_iterate_phdr(&mp_module_find_visit, &find);
+  if (!find.found || name_size == 0) return false;
+  snprintf(name, name_size, "%s", find.found_name);
+  *offset = (size_t)((uintptr_t)addr - find.found_base);
+  return true;
+}
+
+static void* mp_os_module_address(const char* name, size_t offset) {
+  mp_module_find_t find;
+  memset(&find, 0, sizeof(find));
+  find.name = name;
+  dl_iterate_phdr(&mp_module_find_visit, &find);
+  return (find.found ? (void*)(find.found_base + offset) : NULL);
+}
+
+#else
+
+static bool mp_os_module_offset(const void* addr, char* name, size_t name_size, size_t* offset) {
+  MP_UNUSED(addr); MP_UNUSED(name); MP_UNUSED(name_size); MP_UNUSED(offset);
+  return false;
+}
+
+static void* mp_os_module_address(const char* name, size_t offset) {
+  MP_UNUSED(name); MP_UNUSED(offset);
+  return NULL;
+}
+
+#endif
+
+
 //----------------------------------------------------------------------------------
 // The OS primitive `gstack` interface based on `mmap`.
 //----------------------------------------------------------------------------------
@@ -304,7 +376,17 @@ static bool mp_mmap_commit_on_demand(void* addr, bool addr_in_other_thread) {
     // normally we only handle accesses in our current gstack
     access = mp_gstack_check_access(g, page, &stack_size, &available, NULL);
   }
-  else if (addr_in_other_thread && os_use_gpools) {
+  if (access != MP_ACCESS && !addr_in_other_thread) {
+    // or in the gstack we just unlinked from (as the final longjmp of an unlink still pushes on it)
+    mp_gstack_t* left = mp_gstack_left();
+    if (left != NULL && left != g) {
+      if (mp_gstack_check_access(left, page, &stack_size, &available, NULL) == MP_ACCESS) {
+        access = MP_ACCESS;
+        g = left;
+      }
+    }
+  }
+  if (g == NULL && addr_in_other_thread && os_use_gpools) {
      // on mach (macOS) while debugging we use a separate mach exception thread handler
      // in that case we can use gpools to determine if the access is in one of our gstacks.
      access = mp_gpools_check_access( page, &stack_size, &available, NULL );
@@ -324,7 +406,10 @@ static bool mp_mmap_commit_on_demand(void* addr, bool addr_in_other_thread) {
     uint8_t* commit_start;
     mp_push(page, extra, &commit_start);
     if (mprotect(commit_start, extra + os_page_size, PROT_READ | PROT_WRITE) == 0) {
-      if (g != NULL) { g->committed = mp_unpush(commit_start, g->stack, g->stack_size ); }
+      // keep the maximum: a large frame can fault at its deepest page first and then on the pages above it
+      if (g != NULL) { g->committed = mp_max(g->committed, mp_unpush(commit_start, g->stack, g->stack_size)); }
+      mp_event_record(MP_EVENT_COMMIT, 0, (uint32_t)((extra + os_page_size) / MP_KIB));
+      mp_usdt2(commit_on_demand, addr, extra + os_page_size);
     };
     return true; 
   }
@@ -182,6 +182,17 @@ static void mp_gstack_os_thread_init(void) {
 }
 
 
+// Saved stack profiles are not supported on Windows yet
+static bool mp_os_module_offset(const void* addr, char* name, size_t name_size, size_t* offset) {
+  MP_UNUSED(addr); MP_UNUSED(name); MP_UNUSED(name_size); MP_UNUSED(offset);
+  return false;
+}
+
+static void* mp_os_module_address(const char* name, size_t offset) {
+  MP_UNUSED(name); MP_UNUSED(offset);
+  return NULL;
+}
+
 static LONG WINAPI mp_gstack_win_page_fault(PEXCEPTION_POINTERS ep);
 
 static uint8_t* mp_win_main_stack_base;
@@ -351,6 +362,7 @@ static LONG WINAPI mp_gstack_win_page_fault(PEXCEPTION_POINTERS ep)
           tib->StackLimit = extend;
           tib->StackRealLimit = gpage; 
           if (g != NULL) { g->committed = mp_unpush(extend, g->stack, g->stack_size); }
+          mp_event_record(MP_EVENT_COMMIT, 0, (uint32_t)(commit_size / MP_KIB));
           //mp_trace_message("expanded stack: extra: %zdk, available: %zdk, stack_size: %zdk, used: %zdk\n", extra/1024, available/1024, g->stack_size/1024, used/1024);
           //mp_win_trace_stack_layout(tib->StackBase, tib->StackBase - g->stack_size);
           return (exncode!=MP_CPP_EXN ? EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH);
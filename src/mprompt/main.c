@@ -8,6 +8,12 @@
   (and to generate a single object file as well)
 -----------------------------------------------------------------------------*/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE   // for `dl_iterate_phdr` (and always defined by g++)
+#endif
+
 #include "mprompt.c"
 #include "gstack.c"
 #include "util.c"
+#include "trace.c"
+#include "profile.c"
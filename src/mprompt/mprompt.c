@@ -8,12 +8,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
 
 #include "mprompt.h"
 #include "internal/util.h"
 #include "internal/longjmp.h"
 #include "internal/gstack.h"
+#include "internal/trace.h"
+#include "internal/usdt.h"
+#include "internal/atomic.h"
 
 #ifdef __cplusplus
 #include <exception>
@@ -32,6 +36,9 @@ typedef enum mp_return_kind_e {
 } mp_return_kind_t;
 
 
+// note: return and resume points are not cache line aligned as the extra stack realignment 
+// and cache set conflicts (as points end up at the same offset in many stacks) make switching 
+// between many prompts slower in practice (see `bench/bench_mp_switch.c`).
 typedef struct mp_resume_point_s {   // allocated on the suspended stack (which performed a yield)
   mp_jmpbuf_t        jmp;     
   void*              result;  // the yield result (= resume argument)
@@ -59,19 +66,48 @@ typedef struct mp_return_point_s {   // allocated on the parent stack (which per
 //              and the prompt (and its children) are not part of the current stack chain.
 //              note that the prompt children are still themselves in the _active_ state (but not part of a current execution stack chain)
 
+// The prompt is allocated at the start of a cache line (in the gstack header) and the fields
+// used on every yield and resume come first so a steady state switch touches just one line;
+// the cold fields start at the next cache line.
 struct mp_prompt_s {  
+  // hot: accessed on every switch
   mp_prompt_t*       parent;        // parent: previous prompt up in the stack chain (towards bottom of the stack)
   mp_prompt_t*       top;           // top of a suspended prompt chain.
-  intptr_t           refcount;      // free when drops to zero
-  mp_gstack_t*       gstack;        // the growable stacklet associated with this prompt;
-                                 
   mp_return_point_t* return_point;  // return point in the parent (if not suspended..)
   mp_resume_point_t* resume_point;  // resume point for a suspended prompt chain. (the resume will be in the `top->gstack`)
-
   void*              sp;            // security: contains the (guarded) expected stack pointer for a return (if active) or resume (if suspended)
+  mp_gstack_t*       gstack;        // the growable stacklet associated with this prompt;
+
+  // cold: only used on creation, return, or for multi-shot resumptions
+  mp_decl_cache_align intptr_t refcount; // free when drops to zero
   mp_unwind_frame_t* unwind_frame;  // used to aid with unwinding on some platforms (windows only for now)
+  ssize_t            user_size;     // size of the user data that follows the prompt (see `mp_prompt_create_ex`)
+  void*              stack_key;     // key for the stack profile (usually the start function)
+  ssize_t            stack_committed; // committed stack at entry (to detect growth for the stack profile)
+  bool               parked;        // parked in the entry loop of a recyclable prompt (see `mp_prompt_reenter`)
+  #if MP_EVENT_TRACE
+  uint32_t           trace_id;      // prompt id in the event trace
+  #endif
+  struct mp_registry_s* registry;   // registry list (if the registry is enabled)
+  _Atomic(intptr_t)  reg_state;     // MP_REG_xxx (if the registry is enabled)
+  mp_prompt_t*       reg_next;
+  mp_prompt_t*       reg_prev;
+  uint64_t           suspended_at;  // cycle count at the last yield (if the registry is enabled)
+  uint64_t           slice_start;   // cycle count at the last link (if accounting is enabled)
+  uint64_t           run_cycles;    // total cycles while linked
+  uint64_t           max_slice;     // longest link to unlink interval in cycles
+  size_t             switches;      // count of links
 };
 
+#if defined(__GNUC__) || defined(_MSC_VER)
+mp_static_assert(offsetof(mp_prompt_t, gstack) + sizeof(mp_gstack_t*) <= MP_CACHE_LINE && offsetof(mp_prompt_t, refcount) == MP_CACHE_LINE,
+                 "the switch critical fields of a prompt should be on their own cache line");
+#endif
+
+// User data follows the prompt structure in the gstack extra area
+#define MP_PROMPT_USER_ALIGN   (16)
+#define MP_PROMPT_USER_OFFSET  (mp_align_up(sizeof(mp_prompt_t), MP_PROMPT_USER_ALIGN))
+
 
 // Abstract type of resumptions (never used as such)
 struct mp_resume_s {
@@ -133,9 +169,17 @@ static mp_resume_t* mp_resume_as_multi(mp_mresume_t* r) {
 // Initialize
 //-----------------------------------------------------------------------
 
+static bool mp_registry_enabled;     // see `mp_config_t.prompt_registry`
+static bool mp_accounting_enabled;   // see `mp_config_t.prompt_accounting`
+
 void mp_init(const mp_config_t* config) {
   mp_guard_init();
   mp_gstack_init(config);
+  if (config != NULL) {
+    mp_registry_enabled = config->prompt_registry;
+    mp_accounting_enabled = config->prompt_accounting;
+    if (mp_accounting_enabled) { mp_cycles_per_nsec(); }   // calibrate up front
+  }
 }
 
 
@@ -145,6 +189,7 @@ void mp_init(const mp_config_t* config) {
 
 // The top of the prompts chain; points to the prompt on whose stack we currently execute.
 mp_decl_thread mp_prompt_t* _mp_prompt_top;
+static mp_decl_thread mp_gstack_t* _mp_gstack_left;   // the gstack of the top at the last unlink
 
 // get the top of the prompt chain
 mp_prompt_t* mp_prompt_top(void) {  
@@ -157,6 +202,12 @@ mp_gstack_t* mp_gstack_current(void) {
   return (top != NULL ? top->gstack : NULL);
 }
 
+// get the gstack we last unlinked from: the final `mp_checked_longjmp` of an unlink
+// still pushes on that gstack while it is no longer current.
+mp_gstack_t* mp_gstack_left(void) {
+  return _mp_gstack_left;
+}
+
 // walk the prompt chain; returns NULL when done.
 // with initial argument `NULL` the first prompt returned is the current top.
 mp_prompt_t* mp_prompt_parent(mp_prompt_t* p) {
@@ -179,11 +230,161 @@ static bool mp_prompt_is_ancestor(mp_prompt_t* p) {
 }
 #endif
 
-// Allocate a fresh (suspended) prompt
-mp_prompt_t* mp_prompt_create(void) {
+//-----------------------------------------------------------------------
+// Registry of live prompts
+// Prompts are registered in an intrusive list of the thread that created
+// them. Each list has a spin lock that is only taken when a prompt is
+// created or freed (and uncontended unless the prompt migrated to another
+// thread). The lists are kept in a global lock-free list (and never freed).
+//
+// `mp_prompt_foreach` reads the fields and stack of a prompt only while it
+// is idle (suspended or not yet entered) and claims it meanwhile: an unlink
+// publishes the idle state after its last write, and a link takes it back
+// (waiting while the prompt is being inspected). This costs an atomic store
+// per unlink and a compare-and-swap per link, only with the registry enabled.
+//-----------------------------------------------------------------------
+
+#define MP_REG_ACTIVE   (0)   // linked, or part of a suspended chain
+#define MP_REG_IDLE     (1)   // suspended, or not yet entered
+#define MP_REG_INSPECT  (2)   // idle and being inspected by `mp_prompt_foreach`
+
+typedef struct mp_registry_s {
+  mp_spin_lock_t          lock;
+  mp_prompt_t*            first;
+  struct mp_registry_s*   next;   // in the global list
+} mp_registry_t;
+
+static mp_decl_thread mp_registry_t* _mp_registry;
+static _Atomic(mp_registry_t*)       mp_registries;
+
+static mp_decl_noinline mp_registry_t* mp_registry_init(void) {
+  mp_registry_t* reg = (mp_registry_t*)mp_malloc_safe(sizeof(mp_registry_t));
+  mp_atomic_store(&reg->lock, mp_spin_lock_create());
+  reg->first = NULL;
+  reg->next = mp_atomic_load_ptr(mp_registry_t, &mp_registries);
+  while (!mp_atomic_cas_ptr(mp_registry_t, &mp_registries, &reg->next, reg)) {};
+  _mp_registry = reg;
+  return reg;
+}
+
+static void mp_registry_add(mp_prompt_t* p) {
+  mp_registry_t* reg = _mp_registry;
+  if (mp_unlikely(reg == NULL)) { reg = mp_registry_init(); }
+  p->registry = reg;
+  p->reg_prev = NULL;
+  mp_atomic_store(&p->reg_state, (intptr_t)MP_REG_IDLE);
+  mp_spin_lock(&reg->lock) {
+    p->reg_next = reg->first;
+    if (reg->first != NULL) { reg->first->reg_prev = p; }
+    reg->first = p;
+  }
+}
+
+static void mp_registry_remove(mp_prompt_t* p) {
+  mp_registry_t* reg = p->registry;
+  mp_spin_lock(&reg->lock) {
+    if (p->reg_prev != NULL) { p->reg_prev->reg_next = p->reg_next; }
+                        else { reg->first = p->reg_next; }
+    if (p->reg_next != NULL) { p->reg_next->reg_prev = p->reg_prev; }
+  }
+  p->registry = NULL;
+}
+
+// Called on link: take the prompt back from the idle state (waiting while it is inspected)
+static mp_decl_noinline void mp_registry_activate(mp_prompt_t* p) {
+  intptr_t expected = MP_REG_IDLE;
+  while (!mp_atomic_cas(&p->reg_state, &expected, (intptr_t)MP_REG_ACTIVE)) {
+    mp_assert_internal(expected == MP_REG_INSPECT);
+    expected = MP_REG_IDLE;
+    mp_atomic_yield();
+  }
+}
+
+static void* mp_jmpbuf_frame_pointer(const mp_jmpbuf_t* jmp) {
+  #if defined(_M_ARM64) || defined(__aarch64__)
+  return jmp->reg_fp;
+  #else
+  return (void*)jmp->reg_rbp;
+  #endif
+}
+
+// Backtrace of a suspended prompt using the frame pointers from its resume point
+// (within the stack of the innermost prompt of its suspended chain)
+static int mp_prompt_suspended_backtrace(mp_prompt_t* p, void** bt, int len) {
+  const mp_resume_point_t* res = p->resume_point;
+  if (res == NULL || len <= 0) return 0;
+  const mp_gstack_t* g = p->top->gstack;
+  const void* sp = res->jmp.reg_sp;
+  int n = 0;
+  bt[n++] = res->jmp.reg_ip;
+  void** fp = (void**)mp_jmpbuf_frame_pointer(&res->jmp);
+  while (n < len && ((uintptr_t)fp % sizeof(void*)) == 0 && mp_gstack_is_used(g, sp, fp + 1)) {
+    void* ip = fp[1];
+    void** next = (void**)fp[0];
+    if (ip == NULL) break;
+    bt[n++] = ip;
+    if (next <= fp) break;   // frames must go towards the base
+    fp = next;
+  }
+  return n;
+}
+
+static void mp_prompt_info(mp_prompt_t* p, uint64_t now, double cycles_per_nsec, mp_prompt_info_t* info) {
+  memset(info, 0, sizeof(mp_prompt_info_t));
+  info->prompt = p;
+  // claim an idle prompt so it cannot be resumed (and change) while we read it
+  intptr_t expected = MP_REG_IDLE;
+  if (!mp_atomic_cas(&p->reg_state, &expected, (intptr_t)MP_REG_INSPECT)) return;
+  if (p->resume_point != NULL) {   // suspended (and not just created)
+    mp_assert_internal(p->top != NULL);
+    info->start = p->stack_key;
+    info->committed = (size_t)mp_gstack_committed(p->gstack);
+    info->suspended = true;
+    info->suspended_nsecs = (now > p->suspended_at ? (int64_t)((double)(now - p->suspended_at) / cycles_per_nsec) : 0);
+    info->backtrace_len = mp_prompt_suspended_backtrace(p, info->backtrace, MP_PROMPT_INFO_BACKTRACE);
+  }
+  mp_atomic_store(&p->reg_state, (intptr_t)MP_REG_IDLE);
+}
+
+void mp_prompt_foreach(mp_prompt_visit_fun_t* visit, void* arg) {
+  // take a snapshot per registry under its lock (so none of its prompts can be freed meanwhile),
+  // and visit outside the lock so `visit` can use prompts itself
+  const double cycles_per_nsec = mp_cycles_per_nsec();
+  const uint64_t now = mp_cycles();
+  size_t capacity = 0;
+  mp_prompt_info_t* infos = NULL;
+  for (mp_registry_t* reg = mp_atomic_load_ptr(mp_registry_t, &mp_registries); reg != NULL; reg = reg->next) {
+    size_t count = 0;
+    bool retry;
+    do {
+      retry = false;
+      mp_spin_lock(&reg->lock) {
+        count = 0;
+        for (mp_prompt_t* p = reg->first; p != NULL; p = p->reg_next) {
+          if (count >= capacity) { retry = true; count++; continue; }
+          mp_prompt_info(p, now, cycles_per_nsec, &infos[count++]);
+        }
+      }
+      if (retry) {
+        mp_free(infos);
+        capacity = 2*count + 64;
+        infos = (mp_prompt_info_t*)mp_malloc_safe(capacity * sizeof(mp_prompt_info_t));
+      }
+    } while (retry);
+    for (size_t i = 0; i < count; i++) {
+      if (!visit(&infos[i], arg)) { mp_free(infos); return; }
+    }
+  }
+  mp_free(infos);
+}
+
+
+// Allocate a fresh (suspended) prompt with `user_size` zero initialized bytes of user data
+mp_prompt_t* mp_prompt_create_ex(size_t user_size) {
   // allocate a fresh growable stack
   mp_prompt_t* p;
-  mp_gstack_t* gstack = mp_gstack_alloc(sizeof(mp_prompt_t), (void**)&p);
+  const ssize_t extra_size = (user_size == 0 ? (ssize_t)sizeof(mp_prompt_t) : MP_PROMPT_USER_OFFSET + (ssize_t)user_size);
+  mp_gstack_t* gstack = mp_gstack_alloc(extra_size, (void**)&p);
   if (gstack == NULL) { mp_fatal_message(ENOMEM, "unable to allocate a stack\n"); }
   // allocate the prompt structure at the base of the new stack
   p->parent = NULL;
@@ -193,9 +394,45 @@ mp_prompt_t* mp_prompt_create(void) {
   p->resume_point = NULL;
   p->return_point = NULL;
   p->unwind_frame = NULL;
+  p->user_size = (ssize_t)user_size;
+  p->stack_key = NULL;
+  p->stack_committed = 0;
+  p->parked = false;
+  #if MP_EVENT_TRACE
+  p->trace_id = mp_event_prompt_id();
+  #endif
+  mp_event_record(MP_EVENT_CREATE, p->trace_id, 0);
+  mp_usdt1(prompt_create, p);
+  p->registry = NULL;
+  p->suspended_at = 0;
+  p->slice_start = 0;
+  p->run_cycles = 0;
+  p->max_slice = 0;
+  p->switches = 0;
+  if (mp_unlikely(mp_registry_enabled)) { mp_registry_add(p); }
+  if (user_size > 0) { memset(mp_prompt_user_data(p), 0, user_size); }
   return p;
 }
 
+mp_prompt_t* mp_prompt_create(void) {
+  return mp_prompt_create_ex(0);
+}
+
+// Get the user data of a prompt (or NULL if it was created without user data)
+void* mp_prompt_user_data(mp_prompt_t* p) {
+  return (p->user_size == 0 ? NULL : (uint8_t*)p + MP_PROMPT_USER_OFFSET);
+}
+
+// Set the key of the stack profile (instead of the start function)
+void mp_prompt_set_stack_key(mp_prompt_t* p, void* key) {
+  p->stack_key = key;
+}
+
+// Get the user data size of a prompt
+size_t mp_prompt_user_size(mp_prompt_t* p) {
+  return (size_t)p->user_size;
+}
+
 // Free a prompt and drop its children
 static void mp_prompt_free(mp_prompt_t* p, bool delay) {
   mp_assert_internal(!mp_prompt_is_active(p));
@@ -203,6 +440,11 @@ static void mp_prompt_free(mp_prompt_t* p, bool delay) {
   while (p != NULL) {
     mp_assert_internal(p->refcount == 0);
     mp_prompt_t* parent = p->parent;    
+    mp_event_record(MP_EVENT_DROP, p->trace_id, 0);
+    mp_usdt1(prompt_drop, p);
+    if (p->registry != NULL) { mp_registry_remove(p); }
+    mp_gstack_profile(p->gstack, p->stack_key, p->stack_committed);
+    if (p->gstack == _mp_gstack_left) { _mp_gstack_left = NULL; }
     mp_gstack_free(p->gstack, delay);
     if (parent != NULL) {
       mp_assert_internal(parent->refcount == 1);
@@ -236,10 +478,111 @@ static mp_prompt_t* mp_prompt_dup(mp_prompt_t* p) {
   return p;
 }
 
+
+//-----------------------------------------------------------------------
+// Context switch hooks
+// Called on every link (enter/resume) and unlink (yield/return) so
+// external thread-local state can be swapped per prompt. When no hooks
+// are registered, the check in the link/unlink path is a single branch.
+//-----------------------------------------------------------------------
+
+#define MP_SWITCH_HOOKS_MAX  (8)
+
+typedef struct mp_switch_hook_s {
+  mp_switch_hook_fun_t* switch_in;
+  mp_switch_hook_fun_t* switch_out;
+  void*                 arg;
+} mp_switch_hook_t;
+
+static mp_switch_hook_t mp_switch_hooks[MP_SWITCH_HOOKS_MAX];
+static size_t           mp_switch_hooks_count;   // usually 0
+
+// Register hooks; not thread-safe so should be called at startup before prompts are used.
+bool mp_switch_hook_register(mp_switch_hook_fun_t* switch_in, mp_switch_hook_fun_t* switch_out, void* arg) {
+  if (mp_switch_hooks_count >= MP_SWITCH_HOOKS_MAX) {
+    mp_error_message(ENOMEM, "too many context switch hooks registered (at most %d)\n", MP_SWITCH_HOOKS_MAX);
+    return false;
+  }
+  mp_switch_hook_t* hook = &mp_switch_hooks[mp_switch_hooks_count];
+  hook->switch_in = switch_in;
+  hook->switch_out = switch_out;
+  hook->arg = arg;
+  mp_switch_hooks_count++;
+  return true;
+}
+
+// Switch-in hooks are called in registration order..
+static mp_decl_noinline void mp_switch_hooks_in(mp_prompt_t* p) {
+  for (size_t i = 0; i < mp_switch_hooks_count; i++) {
+    mp_switch_hook_t* hook = &mp_switch_hooks[i];
+    if (hook->switch_in != NULL) (hook->switch_in)(p, hook->arg);
+  }
+}
+
+// .. and switch-out hooks in reverse order
+static mp_decl_noinline void mp_switch_hooks_out(mp_prompt_t* p) {
+  for (size_t i = mp_switch_hooks_count; i > 0; i--) {
+    mp_switch_hook_t* hook = &mp_switch_hooks[i-1];
+    if (hook->switch_out != NULL) (hook->switch_out)(p, hook->arg);
+  }
+}
+
+
+//-----------------------------------------------------------------------
+// Accounting
+// Time a prompt from link (enter/resume) to unlink (yield/return) with the
+// cycle counter. The interval of a prompt includes any prompts that run
+// nested inside it (as those are part of its chain).
+//-----------------------------------------------------------------------
+
+static uint64_t        mp_slice_threshold;   // in cycles (the calibration is final once read)
+static mp_slice_fun_t* mp_slice_fun;
+static void*           mp_slice_arg;
+
+void mp_slice_hook_register(uint64_t threshold_nsecs, mp_slice_fun_t* fun, void* arg) {
+  mp_slice_threshold = (uint64_t)((double)threshold_nsecs * mp_cycles_per_nsec());
+  mp_slice_arg = arg;
+  mp_slice_fun = fun;
+}
+
+static mp_decl_noinline void mp_prompt_account(mp_prompt_t* p) {
+  const uint64_t slice = mp_cycles() - p->slice_start;
+  p->run_cycles += slice;
+  p->switches++;
+  if (slice > p->max_slice) { p->max_slice = slice; }
+  if (slice > mp_slice_threshold && mp_slice_fun != NULL) {
+    (mp_slice_fun)(p, (uint64_t)((double)slice / mp_cycles_per_nsec()), mp_slice_arg);
+  }
+}
+
+bool mp_prompt_stats(mp_prompt_t* p, mp_prompt_stats_t* stats) {
+  memset(stats, 0, sizeof(mp_prompt_stats_t));
+  if (!mp_accounting_enabled) return false;
+  const double cycles_per_nsec = mp_cycles_per_nsec();
+  stats->run_nsecs = (uint64_t)((double)p->run_cycles / cycles_per_nsec);
+  stats->max_slice_nsecs = (uint64_t)((double)p->max_slice / cycles_per_nsec);
+  stats->switches = p->switches;
+  return true;
+}
+
+
+#if MP_EVENT_TRACE
+// The prompts nested inside `p` (from `top` up to `p`) are suspended or resumed along with it;
+// record those too so each prompt's running intervals in the trace are accurate.
+static mp_decl_noinline void mp_event_record_nested(mp_prompt_t* top, mp_prompt_t* p, mp_event_kind_t kind) {
+  for (mp_prompt_t* q = top; q != NULL && q != p; q = q->parent) {
+    mp_event_record(kind, q->trace_id, 1);
+  }
+}
+#else
+#define mp_event_record_nested(top,p,kind)  ((void)0)
+#endif
+
 // Link a suspended prompt to the current prompt chain and set the new prompt top
 static inline mp_resume_point_t* mp_prompt_link(mp_prompt_t* p, mp_return_point_t* ret, void** sp) {
   mp_assert_internal(ret != NULL);
   mp_assert_internal(!mp_prompt_is_active(p));
+  if (mp_unlikely(mp_registry_enabled)) { mp_registry_activate(p); }
   *sp = p->sp;
   p->parent = mp_prompt_top();
   _mp_prompt_top = p->top;
@@ -250,6 +593,11 @@ static inline mp_resume_point_t* mp_prompt_link(mp_prompt_t* p, mp_return_point_
     mp_unwind_frame_update(p->unwind_frame, &ret->jmp);
   }                           
   mp_assert_internal(mp_prompt_is_active(p));  
+  if (mp_unlikely(mp_switch_hooks_count != 0)) { mp_switch_hooks_in(p); }
+  mp_event_record(p->resume_point == NULL ? MP_EVENT_ENTER : MP_EVENT_RESUME, p->trace_id, 0);
+  if (MP_EVENT_TRACE && p->resume_point != NULL) { mp_event_record_nested(_mp_prompt_top, p, MP_EVENT_RESUME); }
+  if (p->resume_point == NULL) { mp_usdt1(prompt_enter, p); } else { mp_usdt1(prompt_resume, p); }
+  if (mp_unlikely(mp_accounting_enabled)) { p->slice_start = mp_cycles(); }
   mp_debug_asan_start_switch(_mp_prompt_top->gstack);
   return p->resume_point;
 }
@@ -258,8 +606,15 @@ static inline mp_resume_point_t* mp_prompt_link(mp_prompt_t* p, mp_return_point_
 static inline mp_return_point_t* mp_prompt_unlink(mp_prompt_t* p, mp_resume_point_t* res, void** sp) {
   mp_assert_internal(mp_prompt_is_active(p));
   mp_assert_internal(mp_prompt_is_ancestor(p)); // ancestor of current top?
+  if (mp_unlikely(mp_accounting_enabled)) { mp_prompt_account(p); }
+  if (mp_unlikely(mp_switch_hooks_count != 0)) { mp_switch_hooks_out(p); }
+  if (MP_EVENT_TRACE && res != NULL) { mp_event_record_nested(mp_prompt_top(), p, MP_EVENT_YIELD); }
+  mp_event_record(res == NULL ? MP_EVENT_RETURN : MP_EVENT_YIELD, p->trace_id, 0);
+  if (res == NULL) { mp_usdt1(prompt_return, p); } else { mp_usdt1(prompt_yield, p); }
+  if (mp_unlikely(mp_registry_enabled)) { p->suspended_at = mp_cycles(); }
   *sp = p->sp;
   p->top = mp_prompt_top();
+  _mp_gstack_left = p->top->gstack;
   _mp_prompt_top = p->parent;
   p->parent = NULL;  
   p->resume_point = res;
@@ -268,6 +623,7 @@ static inline mp_return_point_t* mp_prompt_unlink(mp_prompt_t* p, mp_resume_poin
   }
   // note: leave return_point as-is for potential reuse in tail resumes
   mp_assert_internal(!mp_prompt_is_active(p));
+  if (mp_unlikely(mp_registry_enabled)) { mp_atomic_store(&p->reg_state, (intptr_t)MP_REG_IDLE); }   // publish after the last write
   mp_debug_asan_start_switch(_mp_prompt_top == NULL ? NULL : _mp_prompt_top->gstack);
   return p->return_point;
 }
@@ -280,9 +636,10 @@ static inline mp_return_point_t* mp_prompt_unlink(mp_prompt_t* p, mp_resume_poin
 //-----------------------------------------------------------------------
 
 // The code addresses are initialized on the first call to setjmp (and are located right after the setjmp call)
+// They are stored next to the guard cookie (in `mp_guard_data`) so a switch touches just one cache line for these.
 // todo: can we make this static so these go to the readonly section? 
-static void* mp_return_label;
-static void* mp_resume_label;
+#define mp_return_label   (mp_guard_data.return_label)
+#define mp_resume_label   (mp_guard_data.resume_label)
 
 
 // Checked longjmp to a known location (with a known stack pointer)
@@ -369,7 +726,7 @@ static mp_decl_noinline void* mp_prompt_exec_yield_fun(mp_return_point_t* ret, m
 
 
 // Resume a prompt: used for the initial entry as well as for resuming in a suspended prompt.
-static mp_decl_noinline void* mp_prompt_resume(mp_prompt_t * p, void* arg) {
+static mp_decl_noclone void* mp_prompt_resume(mp_prompt_t * p, void* arg) {
   mp_return_point_t ret;    
   // save our return location for yields and regular return  
   if (mp_setjmp(&ret.jmp)) {
@@ -403,6 +760,8 @@ static mp_decl_noinline void* mp_prompt_resume(mp_prompt_t * p, void* arg) {
 
 void* mp_prompt_enter(mp_prompt_t* p, mp_start_fun_t* fun, void* arg) {
   mp_assert_internal(!mp_prompt_is_active(p) && p->resume_point == NULL);
+  if (p->stack_key == NULL) { p->stack_key = (void*)(uintptr_t)fun; }
+  p->stack_committed = mp_gstack_precommit(p->gstack, p->stack_key);
   mp_entry_env_t env;
   env.prompt = p;
   env.fun = fun;
@@ -418,6 +777,108 @@ void* mp_prompt(mp_start_fun_t* fun, void* arg) {
 
 
 
+//-----------------------------------------------------------------------
+// Recyclable prompts
+// The start function runs in a loop at the base of the gstack: when it
+// returns, the prompt yields to itself and parks with its entry frame
+// (and unwind frame) intact, waiting to be resumed with the next 
+// start function. Re-entering is thus just a resume without any
+// allocation, cache search, or header initialization.
+//-----------------------------------------------------------------------
+
+// Executed in the parent when a recycled start function returns
+static void* mp_prompt_recycle_return(mp_resume_t* r, void* arg) {
+  MP_UNUSED(r);   // the resumption is the prompt itself which is owned by the caller of `mp_prompt_reenter`
+  return arg;
+}
+
+#ifdef __cplusplus
+static void* mp_prompt_recycle_rethrow(mp_resume_t* r, void* arg) {
+  MP_UNUSED(r);
+  std::rethrow_exception(*((std::exception_ptr*)arg));
+}
+#endif
+
+static void* mp_prompt_recycle_entry(mp_prompt_t* p, void* arg) {
+  mp_entry_env_t* env = (mp_entry_env_t*)arg;
+  while (env != NULL) {   // a NULL environment is used to release the prompt
+    mp_start_fun_t* fun = env->fun;    // read out before running as `env` lives on the stack of `mp_prompt_reenter`
+    void* farg = env->arg;
+    #ifdef __cplusplus
+    // propagate exceptions to the caller but keep the prompt alive
+    std::exception_ptr exn = nullptr;
+    void* result = NULL;
+    try {
+      result = fun(p, farg);
+    }
+    catch (...) {
+      exn = std::current_exception();
+    }
+    if (exn != nullptr) {
+      p->parked = true;
+      env = (mp_entry_env_t*)mp_yield(p, &mp_prompt_recycle_rethrow, &exn);  // (outside the catch block)
+      p->parked = false;
+      continue;
+    }
+    #else
+    void* result = fun(p, farg);
+    #endif
+    p->parked = true;
+    env = (mp_entry_env_t*)mp_yield(p, &mp_prompt_recycle_return, result);  // park until re-entered
+    p->parked = false;
+  }
+  return NULL;
+}
+
+// Enter a fresh prompt, or re-enter a parked one, and keep it alive after `fun` returns.
+void* mp_prompt_reenter(mp_prompt_t* p, mp_start_fun_t* fun, void* arg) {
+  mp_assert(!mp_prompt_is_active(p));
+  mp_entry_env_t env;
+  env.prompt = p;
+  env.fun = fun;
+  env.arg = arg;
+  if (p->resume_point == NULL) {
+    if (p->stack_key == NULL) { p->stack_key = (void*)(uintptr_t)fun; }
+    return mp_prompt_enter(p, &mp_prompt_recycle_entry, &env);   // first entry
+  }
+  else if (!p->parked) {
+    // suspended by the task itself: resuming would continue at its yield point instead
+    mp_error_message(EINVAL, "cannot re-enter a prompt whose task is suspended (%p)\n", p);
+    return NULL;
+  }
+  else {
+    return mp_resume(mp_resume_as_once(p), &env);                 // resume the parked entry loop
+  }
+}
+
+// Release a prompt that was created with `mp_prompt_create` and possibly (re)entered with `mp_prompt_reenter`.
+void mp_prompt_release(mp_prompt_t* p) {
+  mp_assert(!mp_prompt_is_active(p));
+  if (p->resume_point == NULL) {
+    mp_prompt_drop(p);           // never entered
+  }
+  else if (!p->parked) {
+    mp_error_message(EINVAL, "cannot release a prompt whose task is suspended (%p)\n", p);
+  }
+  else {
+    mp_resume(mp_resume_as_once(p), NULL);  // exit the entry loop so its frame is properly unwound
+  }
+}
+
+
+// Run `fun(p,arg)` in place under a prompt `p` that is never yielded to.
+// The prompt has no gstack and is never linked into the prompt chain; it is 
+// only used as a marker so `mp_yield` can detect a broken promise.
+void* mp_prompt_noyield(mp_start_fun_t* fun, void* arg) {
+  mp_prompt_t p;
+  memset(&p, 0, sizeof(p));
+  p.top = &p;       // suspended state
+  p.refcount = 1;
+  return fun(&p, arg);
+}
+
+
+
 //-----------------------------------------------------------------------
 // Resume from a yield (once)
 //-----------------------------------------------------------------------
@@ -496,7 +957,8 @@ int mp_resume_should_unwind(mp_resume_t* resume) {
 
 
 // Yield back to a prompt with a `mp_resume_once_t` resumption and run `fun(arg)` at the yield point
-void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
+mp_decl_noclone void* mp_yield(mp_prompt_t* p, mp_yield_fun_t* fun, void* arg) {
+  mp_assert(p->gstack != NULL);                  // cannot yield to a prompt entered by `mp_prompt_noyield`
   mp_assert(mp_prompt_is_ancestor(p));           // can only yield up to an ancestor
   mp_assert_internal(mp_prompt_is_active(p));    // can only yield to an active prompt
   // set our resume point (Y)
@@ -0,0 +1,324 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Sampling profiler (Linux only for now).
+  Each profiled thread has a timer on its own CPU-time clock that sends it
+  `SIGPROF`. The handler walks the frame pointers of the running stack and,
+  when it reaches the base of a gstack, continues in the parent at the
+  `return_point` of that prompt, so a sample covers the whole prompt chain
+  (which external profilers cannot unwind). The start function of the
+  innermost prompt is recorded as well to attribute samples to a task.
+  Samples are appended to a per-thread log (no allocation or locks in the
+  handler) and `mp_profiler_dump` writes all logs as folded stacks, ready
+  for `flamegraph.pl` or speedscope.
+
+  Only frames with a frame pointer are found; compile with frame pointers
+  (cmake `-DMP_FRAME_POINTERS=ON` for the library) for complete stacks, and
+  link with `-rdynamic` to resolve symbols of the main program (otherwise
+  frames show as `module+offset`).
+-----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mprompt.h"
+#include "internal/util.h"
+
+#if defined(__linux__)
+
+#include "internal/atomic.h"
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id  _sigev_un._tid
+#endif
+
+#define MP_PROFILE_MAX_DEPTH  (64)
+#define MP_PROFILE_LOG_WORDS  (1 << 20)   // 8 MiB virtual per thread; only touched pages are committed
+
+// A sample in the log is `count, start, frames[count-1]` (innermost frame first)
+typedef struct mp_profile_thread_s {
+  struct mp_profile_thread_s* next;   // in the global list
+  timer_t           timer;
+  volatile bool     active;
+  const uint8_t*    stack_lo;         // bounds of the thread stack (below the prompt chain)
+  const uint8_t*    stack_hi;
+  size_t            used;             // words used in the log
+  size_t            samples;
+  size_t            dropped;          // samples dropped as the log was full
+  void**            log;
+} mp_profile_thread_t;
+
+static mp_decl_thread mp_profile_thread_t* _mp_profile_thread;
+static _Atomic(mp_profile_thread_t*)       mp_profile_threads;
+
+
+//-----------------------------------------------------------------------
+// Sampling
+//-----------------------------------------------------------------------
+
+// Is `p` (with `size` bytes) within the used part of the stack that contains `sp`?
+static bool mp_profile_on_stack(mp_profile_thread_t* t, const mp_prompt_t* p, const uint8_t* sp, const void* q, size_t size) {
+  const uint8_t* lo = sp;
+  const uint8_t* hi;
+  if (p == NULL) {
+    if (sp < t->stack_lo || sp >= t->stack_hi) return false;
+    hi = t->stack_hi;
+  }
+  else {
+    if (!mp_gstack_is_used(p->gstack, sp, sp)) return false;
+    hi = mp_gstack_base(p->gstack);
+  }
+  return ((const uint8_t*)q >= lo && (const uint8_t*)q + size <= hi);
+}
+
+static size_t mp_profile_walk(mp_profile_thread_t* t, void* pc, void** fp, const uint8_t* sp, void** frames) {
+  size_t n = 0;
+  frames[n++] = pc;
+  mp_prompt_t* p = _mp_prompt_top;
+  while (n < MP_PROFILE_MAX_DEPTH) {
+    // frames on the stack of `p` (or the thread stack if `p == NULL`)
+    while (n < MP_PROFILE_MAX_DEPTH && ((uintptr_t)fp % sizeof(void*)) == 0 && mp_profile_on_stack(t, p, sp, fp, 2*sizeof(void*))) {
+      void* ip = fp[1];
+      void** next = (void**)fp[0];
+      if (ip == NULL) break;
+      frames[n++] = ip;
+      if (next <= fp) break;   // frames must go towards the base
+      fp = next;
+    }
+    if (p == NULL) break;
+    // and continue in the parent at the point where `p` was entered or resumed;
+    // the return point is on the parent stack (and may be stale if we are in the middle of a switch)
+    const mp_return_point_t* ret = p->return_point;
+    mp_prompt_t* parent = p->parent;
+    if (ret == NULL || n >= MP_PROFILE_MAX_DEPTH) break;
+    const uint8_t* ret_sp = (const uint8_t*)ret;
+    if (!mp_profile_on_stack(t, parent, ret_sp, ret, sizeof(mp_return_point_t))) break;
+    sp = (const uint8_t*)ret->jmp.reg_sp;
+    if (sp > ret_sp || !mp_profile_on_stack(t, parent, sp, ret, sizeof(mp_return_point_t))) break;
+    frames[n++] = ret->jmp.reg_ip;
+    fp = (void**)mp_jmpbuf_frame_pointer(&ret->jmp);
+    p = parent;
+  }
+  return n;
+}
+
+static void mp_profile_sample(mp_profile_thread_t* t, ucontext_t* uc) {
+  void* frames[MP_PROFILE_MAX_DEPTH];
+  size_t n;
+  #if defined(__x86_64__)
+  n = mp_profile_walk(t, (void*)uc->uc_mcontext.gregs[REG_RIP], (void**)uc->uc_mcontext.gregs[REG_RBP], (const uint8_t*)uc->uc_mcontext.gregs[REG_RSP], frames);
+  #elif defined(__aarch64__)
+  n = mp_profile_walk(t, (void*)uc->uc_mcontext.pc, (void**)uc->uc_mcontext.regs[29], (const uint8_t*)uc->uc_mcontext.sp, frames);
+  #else
+  MP_UNUSED(uc);
+  n = 0;    // only attribute to the start function
+  #endif
+  const mp_prompt_t* p = _mp_prompt_top;
+  if (t->used + n + 2 > MP_PROFILE_LOG_WORDS) {
+    t->dropped++;
+    return;
+  }
+  void** rec = &t->log[t->used];
+  rec[0] = (void*)(uintptr_t)(n + 1);
+  rec[1] = (p != NULL ? p->stack_key : NULL);
+  memcpy(&rec[2], frames, n * sizeof(void*));
+  t->used += n + 2;
+  t->samples++;
+}
+
+static void mp_profile_handler(int signum, siginfo_t* info, void* uctx) {
+  MP_UNUSED(signum); MP_UNUSED(info);
+  const int err = errno;
+  mp_profile_thread_t* t = _mp_profile_thread;
+  if (t != NULL && t->active) { mp_profile_sample(t, (ucontext_t*)uctx); }
+  errno = err;
+}
+
+static pthread_once_t mp_profile_once = PTHREAD_ONCE_INIT;
+
+static void mp_profile_install(void) {
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_sigaction = &mp_profile_handler;
+  act.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+  sigemptyset(&act.sa_mask);
+  if (sigaction(SIGPROF, &act, NULL) != 0) {
+    mp_system_error_message(errno, "unable to install the profiler signal handler\n");
+  }
+}
+
+static mp_profile_thread_t* mp_profile_thread_init(void) {
+  mp_profile_thread_t* t = mp_zalloc_safe_tp(mp_profile_thread_t);
+  t->log = (void**)mp_malloc_safe(MP_PROFILE_LOG_WORDS * sizeof(void*));
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+      t->stack_lo = (const uint8_t*)addr;
+      t->stack_hi = (const uint8_t*)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  t->next = mp_atomic_load_ptr(mp_profile_thread_t, &mp_profile_threads);
+  while (!mp_atomic_cas_ptr(mp_profile_thread_t, &mp_profile_threads, &t->next, t)) {};
+  _mp_profile_thread = t;
+  return t;
+}
+
+bool mp_profiler_start(int hz) {
+  if (hz <= 0 || hz > 1000000) {
+    mp_error_message(EINVAL, "invalid profiler frequency: %d\n", hz);
+    return false;
+  }
+  mp_profile_thread_t* t = _mp_profile_thread;
+  if (t == NULL) { t = mp_profile_thread_init(); }
+  if (t->active) return true;
+  pthread_once(&mp_profile_once, &mp_profile_install);
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &t->timer) != 0) {
+    mp_system_error_message(errno, "unable to create the profiler timer\n");
+    return false;
+  }
+  const long interval = 1000000000L / hz;
+  struct itimerspec its;
+  its.it_interval.tv_sec = interval / 1000000000L;
+  its.it_interval.tv_nsec = interval % 1000000000L;
+  its.it_value = its.it_interval;
+  t->active = true;
+  if (timer_settime(t->timer, 0, &its, NULL) != 0) {
+    mp_system_error_message(errno, "unable to start the profiler timer\n");
+    t->active = false;
+    timer_delete(t->timer);
+    return false;
+  }
+  return true;
+}
+
+void mp_profiler_stop(void) {
+  mp_profile_thread_t* t = _mp_profile_thread;
+  if (t == NULL || !t->active) return;
+  t->active = false;
+  timer_delete(t->timer);
+}
+
+
+//-----------------------------------------------------------------------
+// Folded stacks
+// One line per distinct stack from the root to the leaf, separated by `;`,
+// followed by the sample count. The root is the start function of the
+// innermost prompt (as `[prompt <name>]`) or `[thread]` outside any prompt.
+//-----------------------------------------------------------------------
+
+static void mp_profile_symbol(const void* addr, char* buf, size_t size) {
+  Dl_info info;
+  if (dladdr(addr, &info) != 0) {
+    if (info.dli_sname != NULL) {
+      snprintf(buf, size, "%s", info.dli_sname);
+      return;
+    }
+    if (info.dli_fname != NULL) {
+      const char* base = strrchr(info.dli_fname, '/');
+      snprintf(buf, size, "%s+0x%zx", (base != NULL ? base + 1 : info.dli_fname), (size_t)((const uint8_t*)addr - (const uint8_t*)info.dli_fbase));
+      return;
+    }
+  }
+  snprintf(buf, size, "%p", addr);
+}
+
+static int mp_profile_sample_cmp(const void* x, const void* y) {
+  void* const* a = *(void** const*)x;
+  void* const* b = *(void** const*)y;
+  const uintptr_t n = (uintptr_t)a[0];
+  const uintptr_t m = (uintptr_t)b[0];
+  if (n != m) return (n < m ? -1 : 1);
+  return memcmp(&a[1], &b[1], n * sizeof(void*));
+}
+
+bool mp_profiler_dump(const char* fname) {
+  // collect all samples
+  size_t count = 0;
+  for (mp_profile_thread_t* t = mp_atomic_load_ptr(mp_profile_thread_t, &mp_profile_threads); t != NULL; t = t->next) {
+    count += t->samples;
+  }
+  void*** samples = (void***)mp_malloc_safe((count + 1) * sizeof(void**));
+  size_t n = 0;
+  size_t dropped = 0;
+  for (mp_profile_thread_t* t = mp_atomic_load_ptr(mp_profile_thread_t, &mp_profile_threads); t != NULL; t = t->next) {
+    const size_t used = t->used;
+    for (size_t i = 0; i < used && n < count; i += (uintptr_t)t->log[i] + 1) {
+      samples[n++] = &t->log[i];
+    }
+    dropped += t->dropped;
+  }
+  FILE* f = fopen(fname, "w");
+  if (f == NULL) {
+    mp_system_error_message(errno, "unable to write the profile to %s\n", fname);
+    mp_free(samples);
+    return false;
+  }
+  // sort so equal stacks are adjacent and write each once with its count
+  qsort(samples, n, sizeof(void**), &mp_profile_sample_cmp);
+  char name[256];
+  for (size_t i = 0; i < n; ) {
+    size_t j = i + 1;
+    while (j < n && mp_profile_sample_cmp(&samples[i], &samples[j]) == 0) { j++; }
+    void** rec = samples[i];
+    const size_t depth = (uintptr_t)rec[0] - 1;
+    if (rec[1] == NULL) {
+      fputs("[thread]", f);
+    }
+    else {
+      mp_profile_symbol(rec[1], name, sizeof(name));
+      fprintf(f, "[prompt %s]", name);
+    }
+    for (size_t k = depth; k > 0; k--) {
+      // return addresses point after the call; look up the call itself
+      const uint8_t* ip = (const uint8_t*)rec[1 + k];
+      mp_profile_symbol((k == 1 ? ip : ip - 1), name, sizeof(name));
+      fprintf(f, ";%s", name);
+    }
+    fprintf(f, " %zu\n", j - i);
+    i = j;
+  }
+  mp_free(samples);
+  if (dropped > 0) {
+    mp_error_message(ENOSPC, "the profile log was full; %zu samples were dropped\n", dropped);
+  }
+  return (fclose(f) == 0);
+}
+
+#else
+
+bool mp_profiler_start(int hz) {
+  MP_UNUSED(hz);
+  errno = ENOSYS;
+  return false;
+}
+
+void mp_profiler_stop(void) {
+}
+
+bool mp_profiler_dump(const char* fname) {
+  MP_UNUSED(fname);
+  errno = ENOSYS;
+  return false;
+}
+
+#endif
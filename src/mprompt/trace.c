@@ -0,0 +1,152 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Event trace of prompt switches (compiled in with `MP_EVENT_TRACE=1`).
+  Every thread records into its own ring buffer (of the last 64Ki events)
+  with a cycle counter timestamp, so recording is just a few stores without
+  any synchronization. The rings are registered in a global lock-free list
+  (and kept after their thread terminates) so `mp_event_trace_dump` can
+  write all of them as a Chrome trace (viewable in `chrome://tracing` or
+  Perfetto). Dump when the threads are quiescent.
+-----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mprompt.h"
+#include "internal/util.h"
+#include "internal/trace.h"
+
+#if MP_EVENT_TRACE
+
+#include "internal/atomic.h"
+
+#define MP_EVENT_RING_SIZE  (1 << 16)   // power of 2
+
+typedef struct mp_event_s {
+  uint64_t  ts;         // cycle counter
+  uint32_t  id;         // prompt id
+  uint16_t  kind;
+  uint16_t  arg;
+} mp_event_t;
+
+typedef struct mp_event_ring_s {
+  struct mp_event_ring_s* next;     // in the global list
+  size_t      tid;                  // registration order
+  size_t      count;                // total events recorded (the ring holds the last `MP_EVENT_RING_SIZE`)
+  mp_event_t  events[MP_EVENT_RING_SIZE];
+} mp_event_ring_t;
+
+static mp_decl_thread mp_event_ring_t*  _mp_event_ring;
+static _Atomic(mp_event_ring_t*)        mp_event_rings;
+static _Atomic(intptr_t)                mp_event_ring_count;
+static _Atomic(intptr_t)                mp_event_ids;
+
+// Time stamps are relative to the first event
+static uint64_t mp_event_start_cycles;
+
+
+//-----------------------------------------------------------------------
+// Recording
+//-----------------------------------------------------------------------
+
+static mp_decl_noinline mp_event_ring_t* mp_event_ring_init(void) {
+  mp_event_ring_t* ring = (mp_event_ring_t*)mp_malloc_safe(sizeof(mp_event_ring_t));
+  ring->count = 0;
+  intptr_t tid = mp_atomic_add(&mp_event_ring_count, 1);
+  ring->tid = (size_t)tid + 1;
+  if (tid == 0) {   // first ring; racy but only used as the origin
+    mp_event_start_cycles = mp_cycles();
+  }
+  ring->next = mp_atomic_load_ptr(mp_event_ring_t, &mp_event_rings);
+  while (!mp_atomic_cas_ptr(mp_event_ring_t, &mp_event_rings, &ring->next, ring)) {};
+  _mp_event_ring = ring;
+  return ring;
+}
+
+uint32_t mp_event_prompt_id(void) {
+  return (uint32_t)mp_atomic_add(&mp_event_ids, 1) + 1;
+}
+
+void mp_event_record(mp_event_kind_t kind, uint32_t id, uint32_t arg) {
+  mp_event_ring_t* ring = _mp_event_ring;
+  if (mp_unlikely(ring == NULL)) {
+    if (kind == MP_EVENT_COMMIT) return;   // do not allocate in a signal handler
+    ring = mp_event_ring_init();
+  }
+  // a signal handler that records in between may overwrite this entry; that only loses an event
+  mp_event_t* ev = &ring->events[ring->count & (MP_EVENT_RING_SIZE - 1)];
+  ev->ts = mp_cycles();
+  ev->id = id;
+  ev->kind = (uint16_t)kind;
+  ev->arg = (uint16_t)(arg > UINT16_MAX ? UINT16_MAX : arg);
+  ring->count++;
+}
+
+
+//-----------------------------------------------------------------------
+// Chrome trace format
+// Running intervals of a prompt are async begin/end ("b"/"e") pairs keyed
+// by the prompt id: a yield to an ancestor suspends the nested prompts too,
+// so the intervals do not nest like the "B"/"E" duration events per thread.
+// Prompts suspended or resumed along with an ancestor have `"nested":1`.
+// Creation, drops and commits are instant events.
+//-----------------------------------------------------------------------
+
+static const char* mp_event_names[MP_EVENT_KIND_COUNT] = {
+  "create", "enter", "resume", "yield", "return", "drop", "commit"
+};
+
+bool mp_event_trace_dump(const char* fname) {
+  FILE* f = fopen(fname, "w");
+  if (f == NULL) {
+    mp_system_error_message(errno, "unable to write the event trace to %s\n", fname);
+    return false;
+  }
+  const double cycles_per_usec = mp_cycles_per_nsec() * 1000.0;
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  bool first = true;
+  for (mp_event_ring_t* ring = mp_atomic_load_ptr(mp_event_ring_t, &mp_event_rings); ring != NULL; ring = ring->next) {
+    const size_t count = ring->count;
+    const size_t start = (count > MP_EVENT_RING_SIZE ? count - MP_EVENT_RING_SIZE : 0);
+    for (size_t i = start; i < count; i++) {
+      const mp_event_t* ev = &ring->events[i & (MP_EVENT_RING_SIZE - 1)];
+      const double ts = (double)(int64_t)(ev->ts - mp_event_start_cycles) / cycles_per_usec;
+      const mp_event_kind_t kind = (mp_event_kind_t)ev->kind;
+      fprintf(f, "%s{\"pid\":1,\"tid\":%zu,\"ts\":%.3f,", (first ? "" : ",\n"), ring->tid, ts);
+      first = false;
+      switch (kind) {
+        case MP_EVENT_ENTER:
+        case MP_EVENT_RESUME:
+        case MP_EVENT_YIELD:
+        case MP_EVENT_RETURN:
+          fprintf(f, "\"ph\":\"%s\",\"cat\":\"prompt\",\"id\":%u,\"name\":\"prompt %u\",\"args\":{\"event\":\"%s\",\"nested\":%u}}",
+                  (kind == MP_EVENT_ENTER || kind == MP_EVENT_RESUME ? "b" : "e"), ev->id, ev->id, mp_event_names[kind], (unsigned)ev->arg);
+          break;
+        case MP_EVENT_COMMIT:
+          fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"commit\",\"args\":{\"kib\":%u}}", (unsigned)ev->arg);
+          break;
+        default:
+          fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"prompt\":%u}}", mp_event_names[kind], ev->id);
+          break;
+      }
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return (fclose(f) == 0);
+}
+
+#else
+
+bool mp_event_trace_dump(const char* fname) {
+  MP_UNUSED(fname);
+  errno = ENOSYS;
+  return false;
+}
+
+#endif
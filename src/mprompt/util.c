@@ -12,14 +12,24 @@
 
 #include "mprompt.h"
 #include "internal/util.h"
+#include "internal/atomic.h"
 
 
 // Abstract over output and error handlers
-// todo: add functions to register custom handlers.
-static mp_output_fun* mp_output_handler;
-static void*          mp_output_arg;
-static mp_error_fun*  mp_error_handler;
-static void*          mp_error_arg;
+static mp_output_fun_t* mp_output_handler;
+static void*            mp_output_arg;
+static mp_error_fun_t*  mp_error_handler;
+static void*            mp_error_arg;
+
+void mp_output_handler_register(mp_output_fun_t* fun, void* arg) {
+  mp_output_handler = fun;
+  mp_output_arg = arg;
+}
+
+void mp_error_handler_register(mp_error_fun_t* fun, void* arg) {
+  mp_error_handler = fun;
+  mp_error_arg = arg;
+}
 
 
 // use `write` and `vsnprintf` so the message functions  are safe to call from signal handlers
@@ -31,7 +41,7 @@ static void*          mp_error_arg;
 #endif
 
 // low-level output
-static void mp_fputs(mp_output_fun* out, const char* prefix, const char* message) {
+static void mp_fputs(mp_output_fun_t* out, const char* prefix, const char* message) {
   int fd = -1;
   if (out == NULL || (intptr_t)out == 2 || (FILE*)out == stderr) fd = 2;
   else if ((intptr_t)out == 1 || (FILE*)out == stdout) fd = 1;
@@ -47,7 +57,7 @@ static void mp_fputs(mp_output_fun* out, const char* prefix, const char* message
 }
 
 // Formatted messages
-static void mp_vfprintf( mp_output_fun* out, const char* prefix, const char* fmt, va_list args ) {
+static void mp_vfprintf( mp_output_fun_t* out, const char* prefix, const char* fmt, va_list args ) {
   char buf[256];
   if (fmt==NULL) return;
   vsnprintf(buf,sizeof(buf)-1,fmt,args);
@@ -153,6 +163,58 @@ mp_decl_noreturn void mp_unreachable(const char* msg) {
 }
 
 
+/* ----------------------------------------------------------------------------
+  Clocks
+-----------------------------------------------------------------------------*/
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+uint64_t mp_nsecs(void) {
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&f);
+  return (uint64_t)((double)t.QuadPart * 1e9 / (double)f.QuadPart);
+}
+#else
+#include <time.h>
+uint64_t mp_nsecs(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec);
+}
+#endif
+
+// Calibrate once by spinning for a millisecond on the first call. The ratio is
+// published atomically (as fixed point) and never changes once it is read; if
+// threads race on the first call, the first ratio stored is used by all.
+#define MP_CYCLES_FIXED_SHIFT  (24)
+
+static _Atomic(intptr_t) mp_cycles_nsec_fixed;
+
+double mp_cycles_per_nsec(void) {
+  #if defined(MP_CYCLES_ARE_NSECS)
+  return 1.0;
+  #else
+  const double one = (double)((intptr_t)1 << MP_CYCLES_FIXED_SHIFT);
+  intptr_t fixed = mp_atomic_load(&mp_cycles_nsec_fixed);
+  if (mp_unlikely(fixed == 0)) {
+    const uint64_t nsecs = mp_nsecs();
+    const uint64_t cycles = mp_cycles();
+    uint64_t elapsed;
+    do { elapsed = mp_nsecs() - nsecs; } while (elapsed < 1000000);
+    const double ratio = (double)(mp_cycles() - cycles) / (double)elapsed;
+    intptr_t calibrated = (intptr_t)(ratio * one);
+    if (calibrated <= 0) { calibrated = (intptr_t)one; }
+    intptr_t expected = 0;
+    if (!mp_atomic_cas(&mp_cycles_nsec_fixed, &expected, calibrated)) { calibrated = expected; }
+    fixed = calibrated;
+  }
+  return (double)fixed / one;
+  #endif
+}
+
+
 /* ----------------------------------------------------------------------------
   Guard cookie
   To get an initial secure random context we rely on the OS:
@@ -276,9 +338,9 @@ static uint64_t os_random_weak(void) {
 }
 
 #if INT64_MAX == INTPTR_MAX
-uintptr_t mp_guard_cookie = 0x00002B992DDFA232;
+mp_guard_t mp_guard_data = { 0x00002B992DDFA232, NULL, NULL };
 #else
-uintptr_t mp_guard_cookie = 0x0040E64E;
+mp_guard_t mp_guard_data = { 0x0040E64E, NULL, NULL };
 #endif
 
 void mp_guard_init(void) {
@@ -286,5 +348,5 @@ void mp_guard_init(void) {
   if (!os_random_buf(&key, sizeof(key))) {   // try secure random first
     key = os_random_weak();                  // .. and otherwise fall back to weaker random
   }
-  mp_guard_cookie = key;
+  mp_guard_data.cookie = (uintptr_t)key;
 }
\ No newline at end of file
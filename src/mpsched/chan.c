@@ -0,0 +1,402 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Channels between tasks.
+  A channel has a (possibly empty) ring buffer of values and FIFO queues of
+  blocked senders and receivers. When a task blocks, a waiter is put in the
+  queue(s) of the channel(s) (on the stack of the suspended task) and a
+  matching operation hands the value directly to or from the waiter and
+  wakes it up; values are never copied through the buffer when there is a
+  blocked peer, and each hand-off costs one resume.
+
+  A `select` puts a waiter on every channel with a shared `fired` flag; the
+  first peer that claims it (with a CAS) completes the operation and the
+  other waiters are unlinked by the task once it resumes.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+// Shared state of a blocked send, receive, or select
+typedef struct mp_chan_sel_s {
+  mp_task_t*        task;
+  _Atomic(intptr_t) fired;   // 0, or index+1 of the operation that completed
+  bool              ok;      // false if the channel was closed
+} mp_chan_sel_t;
+
+typedef struct mp_chan_waiter_s {
+  struct mp_chan_waiter_s* next;
+  struct mp_chan_waiter_s* prev;
+  mp_chan_sel_t*    sel;
+  size_t            index;   // index of the operation in the select
+  mp_chan_op_t*     op;      // value to send, or where to receive
+  bool              linked;  // in a queue of the channel
+} mp_chan_waiter_t;
+
+typedef struct mp_chan_waitq_s {
+  mp_chan_waiter_t* first;
+  mp_chan_waiter_t* last;
+} mp_chan_waitq_t;
+
+struct mp_chan_s {
+  mp_spin_lock_t    lock;
+  size_t            capacity;   // 0 for unbuffered, `MP_CHAN_UNBOUNDED` for unbounded
+  bool              closed;
+  // ring buffer
+  void**            buffer;
+  size_t            buf_size;   // allocated entries (a power of 2)
+  size_t            head;
+  size_t            count;
+  // blocked tasks
+  mp_chan_waitq_t   senders;
+  mp_chan_waitq_t   receivers;
+};
+
+
+//-----------------------------------------------------------------------
+// Wait queues
+//-----------------------------------------------------------------------
+
+static void mp_chan_waitq_push(mp_chan_waitq_t* q, mp_chan_waiter_t* w) {
+  w->next = NULL;
+  w->prev = q->last;
+  if (q->last == NULL) { q->first = w; } else { q->last->next = w; }
+  q->last = w;
+  w->linked = true;
+}
+
+static void mp_chan_waitq_remove(mp_chan_waitq_t* q, mp_chan_waiter_t* w) {
+  if (w->prev == NULL) { q->first = w->next; } else { w->prev->next = w->next; }
+  if (w->next == NULL) { q->last = w->prev; } else { w->next->prev = w->prev; }
+  w->next = w->prev = NULL;
+  w->linked = false;
+}
+
+// Pop the first waiter that we can claim (skipping those of a select that fired already)
+static mp_chan_waiter_t* mp_chan_waitq_claim(mp_chan_waitq_t* q) {
+  mp_chan_waiter_t* w;
+  while ((w = q->first) != NULL) {
+    mp_chan_waitq_remove(q, w);
+    intptr_t expected = 0;
+    if (mp_atomic_cas(&w->sel->fired, &expected, (intptr_t)(w->index + 1))) return w;
+  }
+  return NULL;
+}
+
+// Wake up a claimed waiter; call after releasing the channel lock
+static void mp_chan_waiter_wake(mp_chan_waiter_t* w, bool ok) {
+  mp_chan_sel_t* sel = w->sel;   // `w` and `sel` are gone once the task resumes
+  mp_task_t* t = sel->task;
+  sel->ok = ok;
+  mp_task_wake(t, NULL);
+}
+
+
+//-----------------------------------------------------------------------
+// Create
+//-----------------------------------------------------------------------
+
+mp_chan_t* mp_chan_create(size_t capacity) {
+  mp_chan_t* c = mp_zalloc_safe_tp(mp_chan_t);
+  c->capacity = capacity;
+  if (capacity > 0) {
+    size_t size = 1;
+    while (size < capacity && size < 64) { size *= 2; }
+    c->buffer = (void**)mp_malloc_safe(size * sizeof(void*));
+    c->buf_size = size;
+  }
+  mp_atomic_store(&c->lock, mp_spin_lock_create());
+  return c;
+}
+
+void mp_chan_free(mp_chan_t* c) {
+  if (c == NULL) return;
+  if (c->senders.first != NULL || c->receivers.first != NULL) {
+    mp_error_message(EINVAL, "freeing a channel with blocked tasks\n");
+  }
+  mp_free(c->buffer);
+  mp_free(c);
+}
+
+
+//-----------------------------------------------------------------------
+// Buffer
+//-----------------------------------------------------------------------
+
+static bool mp_chan_buf_full(mp_chan_t* c) {
+  return (c->count >= c->capacity);
+}
+
+static void mp_chan_buf_push(mp_chan_t* c, void* value) {
+  if (c->count == c->buf_size) {
+    // grow (for unbounded channels and large capacities)
+    size_t size = 2 * c->buf_size;
+    void** buffer = (void**)mp_malloc_safe(size * sizeof(void*));
+    for (size_t i = 0; i < c->count; i++) {
+      buffer[i] = c->buffer[(c->head + i) & (c->buf_size - 1)];
+    }
+    mp_free(c->buffer);
+    c->buffer = buffer;
+    c->buf_size = size;
+    c->head = 0;
+  }
+  c->buffer[(c->head + c->count) & (c->buf_size - 1)] = value;
+  c->count++;
+}
+
+static void* mp_chan_buf_pop(mp_chan_t* c) {
+  void* value = c->buffer[c->head];
+  c->head = (c->head + 1) & (c->buf_size - 1);
+  c->count--;
+  return value;
+}
+
+
+//-----------------------------------------------------------------------
+// Operations without blocking; must hold the lock.
+// Returns true if the operation completed, and sets `*peer` to a waiter that
+// should be woken up once the lock is released.
+//-----------------------------------------------------------------------
+
+static bool mp_chan_try_send_locked(mp_chan_t* c, mp_chan_op_t* op, mp_chan_waiter_t** peer) {
+  *peer = NULL;
+  if (c->closed) {
+    op->ok = false;
+    return true;
+  }
+  mp_chan_waiter_t* r = mp_chan_waitq_claim(&c->receivers);
+  if (r != NULL) {
+    // hand off directly
+    r->op->value = op->value;
+    r->op->ok = true;
+    *peer = r;
+    op->ok = true;
+    return true;
+  }
+  if (!mp_chan_buf_full(c)) {
+    mp_chan_buf_push(c, op->value);
+    op->ok = true;
+    return true;
+  }
+  return false;
+}
+
+static bool mp_chan_try_recv_locked(mp_chan_t* c, mp_chan_op_t* op, mp_chan_waiter_t** peer) {
+  *peer = NULL;
+  if (c->count > 0) {
+    op->value = mp_chan_buf_pop(c);
+    op->ok = true;
+    // and move a blocked sender into the buffer
+    mp_chan_waiter_t* s = mp_chan_waitq_claim(&c->senders);
+    if (s != NULL) {
+      mp_chan_buf_push(c, s->op->value);
+      s->op->ok = true;
+      *peer = s;
+    }
+    return true;
+  }
+  mp_chan_waiter_t* s = mp_chan_waitq_claim(&c->senders);
+  if (s != NULL) {
+    // hand off directly (unbuffered channel)
+    op->value = s->op->value;
+    op->ok = true;
+    s->op->ok = true;
+    *peer = s;
+    return true;
+  }
+  if (c->closed) {
+    op->value = NULL;
+    op->ok = false;
+    return true;
+  }
+  return false;
+}
+
+static bool mp_chan_try_locked(mp_chan_op_t* op, mp_chan_waiter_t** peer) {
+  return (op->kind == MP_CHAN_SEND ? mp_chan_try_send_locked(op->chan, op, peer) : mp_chan_try_recv_locked(op->chan, op, peer));
+}
+
+static bool mp_chan_try(mp_chan_op_t* op) {
+  mp_chan_t* c = op->chan;
+  mp_chan_waiter_t* peer = NULL;
+  bool done = false;
+  mp_spin_lock(&c->lock) {
+    done = mp_chan_try_locked(op, &peer);
+  }
+  if (peer != NULL) { mp_chan_waiter_wake(peer, true); }
+  return done;
+}
+
+
+//-----------------------------------------------------------------------
+// Blocking select
+//-----------------------------------------------------------------------
+
+#define MP_CHAN_SELECT_MAX  (64)
+
+typedef struct mp_chan_park_env_s {
+  mp_chan_op_t*     ops;
+  size_t            count;
+  mp_chan_t**       locks;      // distinct channels in address order
+  size_t            lock_count;
+  mp_chan_waiter_t* waiters;
+  mp_chan_sel_t*    sel;
+} mp_chan_park_env_t;
+
+static int mp_chan_ptr_compare(const void* p, const void* q) {
+  uintptr_t x = (uintptr_t)(*((mp_chan_t* const*)p));
+  uintptr_t y = (uintptr_t)(*((mp_chan_t* const*)q));
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+// Runs once the task is suspended: check again under all locks and either complete
+// an operation right away, or enqueue the waiters.
+static void mp_chan_select_park(mp_task_t* t, void* arg) {
+  mp_chan_park_env_t* env = (mp_chan_park_env_t*)arg;
+  mp_chan_sel_t* sel = env->sel;
+  sel->task = t;
+  const size_t lock_count = env->lock_count;
+  mp_chan_t** locks = env->locks;
+  for (size_t i = 0; i < lock_count; i++) { mp_spin_lock_acquire(&locks[i]->lock); }
+  mp_chan_waiter_t* peer = NULL;
+  bool done = false;
+  for (size_t i = 0; i < env->count && !done; i++) {
+    if (mp_chan_try_locked(&env->ops[i], &peer)) {
+      mp_atomic_store(&sel->fired, (intptr_t)(i + 1));
+      sel->ok = env->ops[i].ok;
+      done = true;
+    }
+  }
+  if (!done) {
+    for (size_t i = 0; i < env->count; i++) {
+      mp_chan_waiter_t* w = &env->waiters[i];
+      mp_chan_t* c = env->ops[i].chan;
+      w->sel = sel;
+      w->index = i;
+      w->op = &env->ops[i];
+      mp_chan_waitq_push(env->ops[i].kind == MP_CHAN_SEND ? &c->senders : &c->receivers, w);
+    }
+  }
+  // note: once we release the locks, the task may be resumed by a peer (and `env` is gone)
+  for (size_t i = lock_count; i > 0; i--) { mp_spin_lock_release(&locks[i-1]->lock); }
+  if (peer != NULL) { mp_chan_waiter_wake(peer, true); }
+  if (done) { mp_task_wake(t, NULL); }
+}
+
+ssize_t mp_chan_select(mp_chan_op_t* ops, size_t count) {
+  if (count == 0 || count > MP_CHAN_SELECT_MAX) {
+    mp_error_message(EINVAL, "invalid select operation count: %zu\n", count);
+    return -1;
+  }
+  // fast path: try each operation in order
+  for (size_t i = 0; i < count; i++) {
+    if (mp_chan_try(&ops[i])) return (ssize_t)i;
+  }
+  if (mp_task_current() == NULL) {
+    mp_error_message(EINVAL, "can only block on a channel from within a task\n");
+    return -1;
+  }
+  // block
+  mp_chan_t*       locks[MP_CHAN_SELECT_MAX];
+  mp_chan_waiter_t waiters[MP_CHAN_SELECT_MAX];
+  size_t lock_count = 0;
+  for (size_t i = 0; i < count; i++) { locks[lock_count++] = ops[i].chan; }
+  if (lock_count > 1) {
+    qsort(locks, lock_count, sizeof(mp_chan_t*), &mp_chan_ptr_compare);
+    size_t n = 1;
+    for (size_t i = 1; i < lock_count; i++) {
+      if (locks[i] != locks[n-1]) { locks[n++] = locks[i]; }
+    }
+    lock_count = n;
+  }
+  memset(waiters, 0, count * sizeof(mp_chan_waiter_t));
+  mp_chan_sel_t sel;
+  sel.task = NULL;
+  sel.ok = false;
+  mp_atomic_store(&sel.fired, (intptr_t)0);
+  mp_chan_park_env_t env = { ops, count, locks, lock_count, waiters, &sel };
+  mp_task_park(&mp_chan_select_park, &env);
+  // resumed: unlink the waiters that did not fire
+  const size_t index = (size_t)(mp_atomic_load(&sel.fired) - 1);
+  for (size_t i = 0; i < count; i++) {
+    mp_chan_waiter_t* w = &waiters[i];
+    if (i == index) continue;
+    mp_chan_t* c = ops[i].chan;
+    mp_spin_lock(&c->lock) {
+      if (w->linked) {
+        mp_chan_waitq_remove(ops[i].kind == MP_CHAN_SEND ? &c->senders : &c->receivers, w);
+      }
+    }
+  }
+  ops[index].ok = sel.ok;
+  return (ssize_t)index;
+}
+
+
+//-----------------------------------------------------------------------
+// Send, receive, and close
+//-----------------------------------------------------------------------
+
+bool mp_chan_send(mp_chan_t* c, void* value) {
+  mp_chan_op_t op = { c, MP_CHAN_SEND, value, false };
+  mp_chan_select(&op, 1);
+  return op.ok;
+}
+
+bool mp_chan_recv(mp_chan_t* c, void** value) {
+  mp_chan_op_t op = { c, MP_CHAN_RECV, NULL, false };
+  mp_chan_select(&op, 1);
+  if (value != NULL) { *value = op.value; }
+  return op.ok;
+}
+
+bool mp_chan_try_send(mp_chan_t* c, void* value) {
+  mp_chan_op_t op = { c, MP_CHAN_SEND, value, false };
+  return (mp_chan_try(&op) && op.ok);
+}
+
+bool mp_chan_try_recv(mp_chan_t* c, void** value) {
+  mp_chan_op_t op = { c, MP_CHAN_RECV, NULL, false };
+  if (!mp_chan_try(&op) || !op.ok) return false;
+  if (value != NULL) { *value = op.value; }
+  return true;
+}
+
+void mp_chan_close(mp_chan_t* c) {
+  mp_chan_waitq_t wake;
+  wake.first = wake.last = NULL;
+  mp_spin_lock(&c->lock) {
+    if (!c->closed) {
+      c->closed = true;
+      // all blocked receivers (there can only be some if the buffer is empty) and senders fail
+      mp_chan_waiter_t* w;
+      while ((w = mp_chan_waitq_claim(&c->receivers)) != NULL) {
+        w->op->value = NULL;
+        w->op->ok = false;
+        mp_chan_waitq_push(&wake, w);
+      }
+      while ((w = mp_chan_waitq_claim(&c->senders)) != NULL) {
+        w->op->ok = false;
+        mp_chan_waitq_push(&wake, w);
+      }
+    }
+  }
+  mp_chan_waiter_t* w = wake.first;
+  while (w != NULL) {
+    mp_chan_waiter_t* next = w->next;   // read before waking as `w` is gone after
+    mp_chan_waiter_wake(w, false);
+    w = next;
+  }
+}
@@ -0,0 +1,183 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Groups of prompts.
+  A group owns the prompts started with `mp_group_spawn`. The member state is
+  kept in the user data of the prompt (so a member needs no extra allocation)
+  and suspended members are linked in a doubly linked list of the group.
+  Cancelling a group walks that list once: it either resumes each member with
+  the cancellation (such that `mp_member_suspend` returns false and the member
+  unwinds by returning from its start function, running its cleanup or C++
+  destructors on the way), or drops the resumptions directly (which releases
+  the gstacks without running anything). Dropped gstacks are released one by
+  one as usual (to the thread-local cache while it has room, otherwise to
+  the OS or gpool); there is no separate batch release.
+
+  A group is used from a single thread (the one that runs the parent of its
+  prompts); use an inbox to resume members from other threads.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/sched.h"
+
+struct mp_member_s {
+  mp_group_t*   group;
+  mp_member_t*  prev;       // in the suspended list of the group
+  mp_member_t*  next;
+  mp_resume_t*  resume;     // non-NULL while suspended
+  mp_start_fun_t* fun;
+  void*         arg;
+};
+
+struct mp_group_s {
+  mp_member_t*  suspended;  // suspended members
+  size_t        count;      // live members
+  size_t        suspended_count;
+  bool          cancelled;
+};
+
+mp_group_t* mp_group_create(void) {
+  return mp_zalloc_safe_tp(mp_group_t);
+}
+
+void mp_group_free(mp_group_t* g) {
+  if (g == NULL) return;
+  mp_group_cancel(g, true);
+  if (g->count > 0) {
+    mp_error_message(EINVAL, "freeing a group with %zu members still running\n", g->count);
+  }
+  mp_free(g);
+}
+
+size_t mp_group_count(mp_group_t* g) {
+  return g->count;
+}
+
+size_t mp_group_suspended_count(mp_group_t* g) {
+  return g->suspended_count;
+}
+
+bool mp_group_is_cancelled(mp_group_t* g) {
+  return g->cancelled;
+}
+
+
+//-----------------------------------------------------------------------
+// Members
+//-----------------------------------------------------------------------
+
+static void mp_group_link(mp_group_t* g, mp_member_t* m) {
+  m->prev = NULL;
+  m->next = g->suspended;
+  if (g->suspended != NULL) { g->suspended->prev = m; }
+  g->suspended = m;
+  g->suspended_count++;
+}
+
+static void mp_group_unlink(mp_group_t* g, mp_member_t* m) {
+  if (m->prev != NULL) { m->prev->next = m->next; } else { g->suspended = m->next; }
+  if (m->next != NULL) { m->next->prev = m->prev; }
+  m->prev = m->next = NULL;
+  g->suspended_count--;
+}
+
+// The member count is decremented on every exit of the start function (including exceptions)
+static void* mp_member_start(mp_prompt_t* p, void* arg) {
+  MP_UNUSED(arg);
+  mp_member_t* m = (mp_member_t*)mp_prompt_user_data(p);
+  #ifdef __cplusplus
+  void* result = NULL;
+  try {
+    result = (m->fun)(p, m->arg);
+  }
+  catch (...) {
+    m->group->count--;
+    throw;
+  }
+  #else
+  void* result = (m->fun)(p, m->arg);
+  #endif
+  m->group->count--;
+  return result;
+}
+
+void* mp_group_spawn(mp_group_t* g, mp_start_fun_t* fun, void* arg) {
+  mp_prompt_t* p = mp_prompt_create_ex(sizeof(mp_member_t));
+  mp_prompt_set_stack_key(p, (void*)(uintptr_t)fun);
+  mp_member_t* m = (mp_member_t*)mp_prompt_user_data(p);
+  m->group = g;
+  m->fun = fun;
+  m->arg = arg;
+  g->count++;
+  return mp_prompt_enter(p, &mp_member_start, NULL);
+}
+
+typedef struct mp_member_park_env_s {
+  mp_member_t*   member;
+  mp_member_park_fun_t* park;
+  void*          arg;
+} mp_member_park_env_t;
+
+static void* mp_member_park(mp_resume_t* r, void* envarg) {
+  mp_member_park_env_t* env = (mp_member_park_env_t*)envarg;
+  mp_member_t* m = env->member;
+  m->resume = r;
+  mp_group_link(m->group, m);
+  if (env->park != NULL) { (env->park)(m, env->arg); }
+  return NULL;
+}
+
+bool mp_member_suspend(mp_prompt_t* p, mp_member_park_fun_t* park, void* arg, void** result) {
+  mp_member_t* m = (mp_member_t*)mp_prompt_user_data(p);
+  if (m->group->cancelled) return false;   // keep unwinding
+  mp_member_park_env_t env = { m, park, arg };
+  void* res = mp_yield(p, &mp_member_park, &env);
+  if (m->group->cancelled) return false;
+  if (result != NULL) { *result = res; }
+  return true;
+}
+
+void* mp_member_resume(mp_member_t* m, void* value) {
+  mp_resume_t* r = m->resume;
+  if (r == NULL) {
+    mp_error_message(EINVAL, "resuming a group member that is not suspended (%p)\n", m);
+    return NULL;
+  }
+  m->resume = NULL;
+  mp_group_unlink(m->group, m);
+  return mp_resume(r, value);
+}
+
+
+//-----------------------------------------------------------------------
+// Cancellation
+//-----------------------------------------------------------------------
+
+size_t mp_group_cancel(mp_group_t* g, bool unwind) {
+  g->cancelled = true;
+  size_t count = 0;
+  mp_member_t* m;
+  while ((m = g->suspended) != NULL) {
+    mp_resume_t* r = m->resume;
+    m->resume = NULL;
+    mp_group_unlink(g, m);
+    if (unwind) {
+      mp_resume(r, NULL);    // `mp_member_suspend` returns false and the member unwinds
+    }
+    else {
+      g->count--;
+      mp_resume_drop(r);     // release the gstack without running the member
+    }
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,127 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Inboxes for resuming prompts on their owner thread.
+  A suspended prompt must be resumed on the thread that runs its parent
+  (as the prompt chain and gstack cache are thread-local), so another thread
+  that completes work for it posts the resumption to the inbox of the owner.
+
+  The inbox is a lock-free stack (multiple producers) that the owner takes
+  all at once and reverses to resume the entries in posting order. A post
+  that finds the inbox empty writes to an eventfd, so the owner can block on
+  it (or add it to its own epoll set) and is woken once per batch.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+typedef struct mp_inbox_entry_s {
+  struct mp_inbox_entry_s* next;
+  mp_resume_t*      resume;
+  void*             arg;
+} mp_inbox_entry_t;
+
+struct mp_inbox_s {
+  _Atomic(mp_inbox_entry_t*) posted;   // lock-free stack of posted entries
+  int               evfd;
+};
+
+mp_inbox_t* mp_inbox_create(void) {
+  int evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (evfd < 0) {
+    mp_system_error_message(errno, "unable to create an eventfd for an inbox\n");
+    return NULL;
+  }
+  mp_inbox_t* ib = mp_zalloc_safe_tp(mp_inbox_t);
+  mp_atomic_store_ptr(mp_inbox_entry_t, &ib->posted, NULL);
+  ib->evfd = evfd;
+  return ib;
+}
+
+void mp_inbox_free(mp_inbox_t* ib) {
+  if (ib == NULL) return;
+  mp_inbox_entry_t* e = mp_atomic_load_ptr(mp_inbox_entry_t, &ib->posted);
+  while (e != NULL) {
+    mp_inbox_entry_t* next = e->next;
+    mp_resume_drop(e->resume);
+    mp_free(e);
+    e = next;
+  }
+  close(ib->evfd);
+  mp_free(ib);
+}
+
+int mp_inbox_fd(mp_inbox_t* ib) {
+  return ib->evfd;
+}
+
+void mp_resume_post(mp_inbox_t* ib, mp_resume_t* r, void* arg) {
+  mp_inbox_entry_t* e = mp_malloc_safe_tp(mp_inbox_entry_t);
+  e->resume = r;
+  e->arg = arg;
+  mp_inbox_entry_t* top = mp_atomic_load_ptr(mp_inbox_entry_t, &ib->posted);
+  do {
+    e->next = top;
+  } while (!mp_atomic_cas_ptr(mp_inbox_entry_t, &ib->posted, &top, e));
+  if (top == NULL) {
+    // the first post of a batch wakes up the owner
+    uint64_t one = 1;
+    ssize_t n;
+    do { n = write(ib->evfd, &one, sizeof(one)); } while (n < 0 && errno == EINTR);
+  }
+}
+
+size_t mp_inbox_drain(mp_inbox_t* ib) {
+  if (mp_atomic_load_ptr(mp_inbox_entry_t, &ib->posted) == NULL) return 0;
+  // reset the eventfd before taking the entries so a later post signals again
+  uint64_t count;
+  ssize_t n;
+  do { n = read(ib->evfd, &count, sizeof(count)); } while (n < 0 && errno == EINTR);
+  mp_inbox_entry_t* top = mp_atomic_load_ptr(mp_inbox_entry_t, &ib->posted);
+  while (!mp_atomic_cas_ptr(mp_inbox_entry_t, &ib->posted, &top, NULL)) { }
+  // reverse to posting order
+  mp_inbox_entry_t* first = NULL;
+  while (top != NULL) {
+    mp_inbox_entry_t* next = top->next;
+    top->next = first;
+    first = top;
+    top = next;
+  }
+  size_t resumed = 0;
+  while (first != NULL) {
+    mp_inbox_entry_t* e = first;
+    first = e->next;
+    mp_resume_t* r = e->resume;
+    void* arg = e->arg;
+    mp_free(e);
+    mp_resume(r, arg);
+    resumed++;
+  }
+  return resumed;
+}
+
+size_t mp_inbox_wait(mp_inbox_t* ib, int timeout_ms) {
+  if (mp_atomic_load_ptr(mp_inbox_entry_t, &ib->posted) == NULL) {
+    struct pollfd pfd;
+    pfd.fd = ib->evfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+      mp_system_error_message(errno, "unable to wait for an inbox\n");
+    }
+  }
+  return mp_inbox_drain(ib);
+}
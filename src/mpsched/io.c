@@ -0,0 +1,434 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  I/O readiness with epoll.
+  There is one epoll instance per scheduler that is shared by all workers;
+  an idle worker takes the "poller" role and blocks in `epoll_wait` (and an
+  eventfd is used to wake it up when other work arrives), while busy workers
+  poll without blocking every few scheduling decisions.
+
+  Each file descriptor has an entry with (at most) one waiting reader and
+  writer task and is registered with `EPOLLONESHOT` so a readiness event is
+  delivered to exactly one worker; the entry is re-armed on a next wait.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+#define MP_IO_EVENTS_MAX   (64)
+#define MP_IO_CLOSED       ((void*)(~(uintptr_t)0))   // wake up value when the descriptor is closed while waiting
+
+// per file descriptor waiters
+struct mp_io_fd_s {
+  mp_spin_lock_t    lock;
+  mp_task_t*        reader;
+  mp_task_t*        writer;
+  bool              registered;   // added to the epoll set
+};
+
+
+//-----------------------------------------------------------------------
+// Initialization
+//-----------------------------------------------------------------------
+
+// All pollers, so `mp_io_close` can unregister a descriptor even outside a task
+static pthread_mutex_t mp_io_all_lock = PTHREAD_MUTEX_INITIALIZER;
+static mp_io_t*        mp_io_all;
+
+bool mp_io_init(mp_io_t* io) {
+  memset((void*)io, 0, sizeof(mp_io_t));
+  io->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (io->epfd < 0) return false;
+  io->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io->evfd < 0) {
+    int err = errno;
+    close(io->epfd);
+    io->epfd = -1;
+    errno = err;
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = io->evfd;
+  epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->evfd, &ev);
+  mp_atomic_store(&io->poller, (intptr_t)0);
+  mp_atomic_store(&io->blocked, (intptr_t)0);
+  mp_atomic_store(&io->notified, (intptr_t)0);
+  mp_atomic_store(&io->waiting, (intptr_t)0);
+  mp_atomic_store(&io->uring_pending, (intptr_t)0);
+  mp_uring_init(io);
+  pthread_mutex_lock(&mp_io_all_lock);
+  io->next = mp_io_all;
+  mp_io_all = io;
+  pthread_mutex_unlock(&mp_io_all_lock);
+  return true;
+}
+
+void mp_io_done(mp_io_t* io) {
+  pthread_mutex_lock(&mp_io_all_lock);
+  for (mp_io_t** pio = &mp_io_all; *pio != NULL; pio = &(*pio)->next) {
+    if (*pio == io) { *pio = io->next; break; }
+  }
+  pthread_mutex_unlock(&mp_io_all_lock);
+  mp_uring_done(io);
+  for (size_t i = 0; i < MP_IO_FD_CHUNKS; i++) {
+    mp_io_fd_t* chunk = mp_atomic_load_ptr(mp_io_fd_t, &io->fds[i]);
+    if (chunk != NULL) { mp_free(chunk); }
+  }
+  if (io->evfd >= 0) { close(io->evfd); }
+  if (io->epfd >= 0) { close(io->epfd); }
+}
+
+// Get the waiters entry for a file descriptor (allocating a chunk on demand)
+static mp_io_fd_t* mp_io_fd_entry(mp_io_t* io, int fd) {
+  if (fd < 0 || fd >= (MP_IO_FD_CHUNKS * MP_IO_FD_CHUNK_SIZE)) return NULL;
+  _Atomic(mp_io_fd_t*)* pchunk = &io->fds[fd / MP_IO_FD_CHUNK_SIZE];
+  mp_io_fd_t* chunk = mp_atomic_load_ptr(mp_io_fd_t, pchunk);
+  if (chunk == NULL) {
+    mp_io_fd_t* fresh = (mp_io_fd_t*)mp_zalloc_safe(MP_IO_FD_CHUNK_SIZE * sizeof(mp_io_fd_t));
+    if (mp_atomic_cas_ptr(mp_io_fd_t, pchunk, &chunk, fresh)) {
+      chunk = fresh;
+    }
+    else {
+      mp_free(fresh);  // another thread was first (and `chunk` is updated)
+    }
+  }
+  return &chunk[fd % MP_IO_FD_CHUNK_SIZE];
+}
+
+
+//-----------------------------------------------------------------------
+// Polling
+//-----------------------------------------------------------------------
+
+bool mp_io_poller_acquire(mp_io_t* io) {
+  intptr_t expected = 0;
+  return (mp_atomic_load(&io->poller) == 0 && mp_atomic_cas(&io->poller, &expected, (intptr_t)1));
+}
+
+void mp_io_poller_release(mp_io_t* io) {
+  mp_atomic_store(&io->poller, (intptr_t)0);
+}
+
+// Wake up the poller if it is blocked in `epoll_wait`
+void mp_io_notify(mp_io_t* io) {
+  if (mp_atomic_load(&io->blocked) != 0) {
+    intptr_t expected = 0;
+    if (mp_atomic_cas(&io->notified, &expected, (intptr_t)1)) {
+      uint64_t one = 1;
+      ssize_t n = write(io->evfd, &one, sizeof(one));
+      MP_UNUSED(n);
+    }
+  }
+}
+
+// The epoll events to wait for given the current waiters
+static uint32_t mp_io_fd_events(mp_io_fd_t* entry) {
+  uint32_t events = 0;
+  if (entry->reader != NULL) { events |= EPOLLIN | EPOLLRDHUP; }
+  if (entry->writer != NULL) { events |= EPOLLOUT; }
+  return events;
+}
+
+// (Re)arm the registration; must hold the entry lock
+static int mp_io_fd_arm(mp_io_t* io, int fd, mp_io_fd_t* entry) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = mp_io_fd_events(entry) | EPOLLONESHOT;
+  ev.data.fd = fd;
+  if (entry->registered) {
+    int err = epoll_ctl(io->epfd, EPOLL_CTL_MOD, fd, &ev);
+    if (err == 0 || errno != ENOENT) return err;
+    entry->registered = false;  // closed with a plain `close` (which removes it from the epoll set) and reused
+  }
+  int err = epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev);
+  if (err != 0 && errno == EEXIST) {  // e.g. a closed and reused fd
+    err = epoll_ctl(io->epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+  if (err == 0) { entry->registered = true; }
+  return err;
+}
+
+// Process a readiness event: wake up the waiters and re-arm for any remaining ones
+static size_t mp_io_fd_ready(mp_io_t* io, int fd, uint32_t events) {
+  mp_io_fd_t* entry = mp_io_fd_entry(io, fd);
+  if (entry == NULL) return 0;
+  mp_task_t* reader = NULL;
+  mp_task_t* writer = NULL;
+  const bool failed = ((events & (EPOLLERR | EPOLLHUP)) != 0);
+  mp_spin_lock(&entry->lock) {
+    if (entry->reader != NULL && (failed || (events & (EPOLLIN | EPOLLRDHUP)) != 0)) {
+      reader = entry->reader;
+      entry->reader = NULL;
+    }
+    if (entry->writer != NULL && (failed || (events & EPOLLOUT) != 0)) {
+      writer = entry->writer;
+      entry->writer = NULL;
+    }
+    if (entry->reader != NULL || entry->writer != NULL) {
+      mp_io_fd_arm(io, fd, entry);
+    }
+  }
+  size_t count = 0;
+  if (reader != NULL) { mp_atomic_add(&io->waiting, -1); mp_task_wake(reader, (void*)(uintptr_t)events); count++; }
+  if (writer != NULL) { mp_atomic_add(&io->waiting, -1); mp_task_wake(writer, (void*)(uintptr_t)events); count++; }
+  return count;
+}
+
+// Poll for ready file descriptors and wake up the waiting tasks (the caller must hold the poller role).
+// Returns the number of tasks that became ready.
+size_t mp_io_poll(mp_sched_t* s, int timeout_ms) {
+  mp_io_t* io = &s->io;
+  struct epoll_event events[MP_IO_EVENTS_MAX];
+  int n = epoll_wait(io->epfd, events, MP_IO_EVENTS_MAX, timeout_ms);
+  size_t count = 0;
+  for (int i = 0; i < n; i++) {
+    int fd = events[i].data.fd;
+    if (fd == io->evfd) {
+      uint64_t val;
+      ssize_t res = read(io->evfd, &val, sizeof(val));
+      MP_UNUSED(res);
+      mp_atomic_store(&io->notified, (intptr_t)0);
+    }
+    else if (mp_uring_is_fd(io, fd)) {
+      count += mp_uring_reap(io);
+    }
+    else {
+      count += mp_io_fd_ready(io, fd, events[i].events);
+    }
+  }
+  return count;
+}
+
+
+//-----------------------------------------------------------------------
+// Waiting for readiness in a task
+//-----------------------------------------------------------------------
+
+typedef struct mp_io_wait_env_s {
+  mp_io_t*     io;
+  int          fd;
+  mp_io_fd_t*  entry;
+  uint32_t     events;
+  int          err;
+} mp_io_wait_env_t;
+
+static void mp_io_wait_park(mp_task_t* t, void* arg) {
+  mp_io_wait_env_t* env = (mp_io_wait_env_t*)arg;
+  mp_sched_t* s = t->sched;          // read out as `t` and `env` may be gone once the fd is armed
+  mp_io_t* io = env->io;
+  const int fd = env->fd;
+  mp_io_fd_t* entry = env->entry;
+  bool ok = false;
+  mp_spin_lock(&entry->lock) {
+    if ((env->events & MP_IO_READ) != 0) {
+      if (entry->reader == NULL) { entry->reader = t; ok = true; }
+    }
+    else {
+      if (entry->writer == NULL) { entry->writer = t; ok = true; }
+    }
+    if (ok) {
+      mp_atomic_add(&io->waiting, 1);
+      if (mp_io_fd_arm(io, fd, entry) != 0) {
+        env->err = errno;
+        if ((env->events & MP_IO_READ) != 0) { entry->reader = NULL; } else { entry->writer = NULL; }
+        mp_atomic_add(&io->waiting, -1);
+        ok = false;
+      }
+    }
+    else {
+      env->err = EBUSY;   // another task is already waiting for the same event
+    }
+  }
+  if (ok) {
+    mp_sched_notify(s);   // make sure some worker becomes the poller
+  }
+  else {
+    mp_task_wake(t, NULL);
+  }
+}
+
+static int mp_io_wait_blocking(int fd, int events) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = (short)(((events & MP_IO_READ) != 0 ? POLLIN : 0) | ((events & MP_IO_WRITE) != 0 ? POLLOUT : 0));
+  pfd.revents = 0;
+  int n;
+  do {
+    n = poll(&pfd, 1, -1);
+  } while (n < 0 && errno == EINTR);
+  return (n < 0 ? -1 : 0);
+}
+
+int mp_io_wait(int fd, int events) {
+  mp_task_t* t = mp_task_current();
+  if (t == NULL) {
+    return mp_io_wait_blocking(fd, events);  // not in a task: just block the thread
+  }
+  if ((events & MP_IO_READ) != 0 && (events & MP_IO_WRITE) != 0) {
+    errno = EINVAL;  // wait for one direction at a time
+    return -1;
+  }
+  mp_io_wait_env_t env;
+  env.io = &t->sched->io;
+  env.fd = fd;
+  env.entry = mp_io_fd_entry(env.io, fd);
+  env.events = (uint32_t)events;
+  env.err = 0;
+  if (env.entry == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  void* res = mp_task_park(&mp_io_wait_park, &env);
+  if (res == NULL) {
+    errno = env.err;
+    return -1;
+  }
+  if (res == MP_IO_CLOSED) {
+    errno = EBADF;
+    return -1;
+  }
+  return 0;
+}
+
+
+//-----------------------------------------------------------------------
+// Operations
+//-----------------------------------------------------------------------
+
+int mp_io_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -1;
+  if ((flags & O_NONBLOCK) != 0) return 0;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Unregister a descriptor that is about to be closed and wake up its waiters with `EBADF`
+static void mp_io_fd_closing(mp_io_t* io, int fd) {
+  if (fd < 0 || fd >= (MP_IO_FD_CHUNKS * MP_IO_FD_CHUNK_SIZE)) return;
+  mp_io_fd_t* chunk = mp_atomic_load_ptr(mp_io_fd_t, &io->fds[fd / MP_IO_FD_CHUNK_SIZE]);
+  if (chunk == NULL) return;   // never waited on
+  mp_io_fd_t* entry = &chunk[fd % MP_IO_FD_CHUNK_SIZE];
+  mp_task_t* reader = NULL;
+  mp_task_t* writer = NULL;
+  mp_spin_lock(&entry->lock) {
+    if (entry->registered) {
+      epoll_ctl(io->epfd, EPOLL_CTL_DEL, fd, NULL);
+      entry->registered = false;
+    }
+    reader = entry->reader;
+    writer = entry->writer;
+    entry->reader = NULL;
+    entry->writer = NULL;
+  }
+  if (reader != NULL) { mp_atomic_add(&io->waiting, -1); mp_task_wake(reader, MP_IO_CLOSED); }
+  if (writer != NULL) { mp_atomic_add(&io->waiting, -1); mp_task_wake(writer, MP_IO_CLOSED); }
+}
+
+// Unregister and close; tasks that still wait on the descriptor are woken up with `EBADF`.
+// This works outside a task as well, so we unregister the descriptor with every poller.
+int mp_io_close(int fd) {
+  pthread_mutex_lock(&mp_io_all_lock);
+  for (mp_io_t* io = mp_io_all; io != NULL; io = io->next) {
+    mp_io_fd_closing(io, fd);
+  }
+  pthread_mutex_unlock(&mp_io_all_lock);
+  return close(fd);
+}
+
+ssize_t mp_io_read(int fd, void* buf, size_t len) {
+  for (;;) {
+    ssize_t n = read(fd, buf, len);
+    if (n >= 0) return n;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (mp_io_wait(fd, MP_IO_READ) != 0) return -1;
+  }
+}
+
+ssize_t mp_io_write(int fd, const void* buf, size_t len) {
+  for (;;) {
+    ssize_t n = write(fd, buf, len);
+    if (n >= 0) return n;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (mp_io_wait(fd, MP_IO_WRITE) != 0) return -1;
+  }
+}
+
+int mp_io_accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+  for (;;) {
+    int cfd = accept(fd, addr, addrlen);
+    if (cfd >= 0) {
+      if (mp_io_nonblock(cfd) != 0) {
+        int err = errno;
+        close(cfd);
+        errno = err;
+        return -1;
+      }
+      return cfd;
+    }
+    if (errno == EINTR || errno == ECONNABORTED) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (mp_io_wait(fd, MP_IO_READ) != 0) return -1;
+  }
+}
+
+int mp_io_connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+  int err = connect(fd, addr, addrlen);
+  if (err == 0) return 0;
+  if (errno != EINPROGRESS && errno != EINTR) return -1;
+  // wait until connected and check the result
+  if (mp_io_wait(fd, MP_IO_WRITE) != 0) return -1;
+  int soerr = 0;
+  socklen_t len = sizeof(soerr);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) != 0) return -1;
+  if (soerr != 0) {
+    errno = soerr;
+    return -1;
+  }
+  return 0;
+}
+
+// Used if io_uring is not available
+ssize_t mp_io_pread_fallback(int fd, void* buf, size_t len, off_t offset) {
+  if (offset < 0) return mp_io_read(fd, buf, len);
+  for (;;) {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n >= 0) return n;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (mp_io_wait(fd, MP_IO_READ) != 0) return -1;
+  }
+}
+
+ssize_t mp_io_pwrite_fallback(int fd, const void* buf, size_t len, off_t offset) {
+  if (offset < 0) return mp_io_write(fd, buf, len);
+  for (;;) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n >= 0) return n;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (mp_io_wait(fd, MP_IO_WRITE) != 0) return -1;
+  }
+}
@@ -0,0 +1,183 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Offloading blocking calls to a pool of threads.
+  A task that offloads a call is suspended and its job (on the stack of the
+  task) is put in the job queue of the pool. A pool thread runs the call and
+  pushes the task on a lock-free completion stack (multiple producers, and the
+  workers take all entries at once). The workers reap the completions when
+  they look for work and make the tasks ready on their own deque, so a
+  completion costs one resume and the worker threads never block on the call.
+
+  The pool threads are started on the first offload.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+#define MP_OFFLOAD_THREADS  (4)    // default pool size
+
+struct mp_offload_job_s {
+  mp_offload_job_t* next;
+  mp_offload_fun_t* fun;
+  void*             arg;
+  mp_task_t*        task;
+};
+
+void mp_offload_init(mp_offload_t* pool) {
+  memset((void*)pool, 0, sizeof(mp_offload_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->thread_max = MP_OFFLOAD_THREADS;
+  mp_atomic_store_ptr(mp_task_t, &pool->completed, NULL);
+  mp_atomic_store(&pool->pending, (intptr_t)0);
+}
+
+void mp_offload_done(mp_offload_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->thread_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  mp_free(pool->threads);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+bool mp_offload_threads(mp_sched_t* s, size_t count) {
+  mp_offload_t* pool = &s->offload;
+  bool ok = false;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->thread_count == 0) {   // not started yet
+    pool->thread_max = (count == 0 ? MP_OFFLOAD_THREADS : count);
+    ok = true;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return ok;
+}
+
+
+//-----------------------------------------------------------------------
+// Completion stack
+//-----------------------------------------------------------------------
+
+// Called from a pool thread: push a completed task and notify a worker if the stack was empty
+static void mp_offload_complete(mp_sched_t* s, mp_task_t* t) {
+  mp_offload_t* pool = &s->offload;
+  mp_task_t* top = mp_atomic_load_ptr(mp_task_t, &pool->completed);
+  do {
+    t->next = top;
+  } while (!mp_atomic_cas_ptr(mp_task_t, &pool->completed, &top, t));
+  if (top == NULL) { mp_sched_notify(s); }
+}
+
+bool mp_offload_has_completed(mp_sched_t* s) {
+  return (mp_atomic_load_ptr(mp_task_t, &s->offload.completed) != NULL);
+}
+
+// Called from a worker: make all completed tasks ready (in completion order)
+size_t mp_offload_reap(mp_sched_t* s) {
+  mp_offload_t* pool = &s->offload;
+  if (mp_atomic_load(&pool->pending) <= 0) return 0;
+  mp_task_t* top = mp_atomic_load_ptr(mp_task_t, &pool->completed);
+  if (top == NULL) return 0;
+  while (!mp_atomic_cas_ptr(mp_task_t, &pool->completed, &top, NULL)) { }
+  // reverse
+  mp_task_t* first = NULL;
+  while (top != NULL) {
+    mp_task_t* next = top->next;
+    top->next = first;
+    first = top;
+    top = next;
+  }
+  size_t count = 0;
+  while (first != NULL) {
+    mp_task_t* t = first;
+    first = t->next;
+    mp_task_wake(t, t->resume_arg);
+    count++;
+  }
+  mp_atomic_add(&pool->pending, -(intptr_t)count);
+  return count;
+}
+
+
+//-----------------------------------------------------------------------
+// Pool threads
+//-----------------------------------------------------------------------
+
+static void* mp_offload_thread(void* arg) {
+  mp_sched_t* s = (mp_sched_t*)arg;
+  mp_offload_t* pool = &s->offload;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    mp_offload_job_t* job = pool->first;
+    if (job == NULL) {
+      if (pool->stop) break;
+      pthread_cond_wait(&pool->cond, &pool->lock);
+      continue;
+    }
+    pool->first = job->next;
+    if (pool->first == NULL) { pool->last = NULL; }
+    pthread_mutex_unlock(&pool->lock);
+    // run the call; after the completion the task (and `job`) may be running again
+    mp_task_t* t = job->task;
+    t->resume_arg = (job->fun)(job->arg);
+    mp_offload_complete(s, t);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Start the pool threads; must hold the pool lock
+static void mp_offload_start(mp_sched_t* s) {
+  mp_offload_t* pool = &s->offload;
+  pool->threads = (pthread_t*)mp_malloc_safe(pool->thread_max * sizeof(pthread_t));
+  for (size_t i = 0; i < pool->thread_max; i++) {
+    if (pthread_create(&pool->threads[i], NULL, &mp_offload_thread, s) != 0) {
+      if (i == 0) { mp_fatal_message(EAGAIN, "unable to create an offload thread\n"); }
+      break;
+    }
+    pool->thread_count++;
+  }
+}
+
+static void mp_offload_park(mp_task_t* t, void* arg) {
+  mp_offload_job_t* job = (mp_offload_job_t*)arg;
+  mp_sched_t* s = t->sched;
+  mp_offload_t* pool = &s->offload;
+  job->task = t;
+  job->next = NULL;
+  mp_atomic_add(&pool->pending, 1);
+  pthread_mutex_lock(&pool->lock);
+  if (pool->thread_count == 0) { mp_offload_start(s); }
+  if (pool->last == NULL) { pool->first = job; } else { pool->last->next = job; }
+  pool->last = job;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void* mp_offload(mp_offload_fun_t* fun, void* arg) {
+  if (mp_task_current() == NULL) {
+    return fun(arg);  // just block the calling thread
+  }
+  mp_offload_job_t job;
+  job.fun = fun;
+  job.arg = arg;
+  return mp_task_park(&mp_offload_park, &job);
+}
@@ -0,0 +1,131 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Cooperative preemption.
+  With a time slice set, every worker thread has a timer on its own CPU-time
+  clock that sends a signal to just that thread (`SIGEV_THREAD_ID`) at every
+  time slice. The handler sets a thread-local flag if the same task run is
+  still going since the previous tick, and `mp_maybe_yield` yields the task
+  if the flag is set. A task is thus asked to yield after running between one
+  and two time slices without suspending. Since the clock only advances while
+  the thread is on the CPU, idle workers are never interrupted.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+// set by the signal handler when the current task should yield (and cleared on every task switch)
+static mp_decl_thread volatile sig_atomic_t _mp_preempt_requested;
+
+void mp_maybe_yield(void) {
+  if (mp_likely(_mp_preempt_requested == 0)) return;
+  _mp_preempt_requested = 0;
+  if (mp_task_current() != NULL) { mp_task_yield(); }
+}
+
+bool mp_sched_timeslice(mp_sched_t* s, int64_t nsecs) {
+  #if defined(__linux__)
+  s->timeslice = (nsecs <= 0 ? 0 : nsecs);
+  return true;
+  #else
+  MP_UNUSED(s); MP_UNUSED(nsecs);
+  return false;
+  #endif
+}
+
+// Called by a worker when it starts running a task
+void mp_preempt_clear(void) {
+  _mp_preempt_requested = 0;
+}
+
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id  _sigev_un._tid
+#endif
+
+#define MP_PREEMPT_SIGNAL  SIGURG   // ignored by default so a stray signal is harmless
+
+static void mp_preempt_handler(int signum, siginfo_t* info, void* arg) {
+  MP_UNUSED(signum); MP_UNUSED(info); MP_UNUSED(arg);
+  mp_worker_t* w = _mp_worker;
+  if (w == NULL) return;
+  const size_t runs = w->runs;
+  if (w->current != NULL && runs == w->preempt_runs) {
+    _mp_preempt_requested = 1;
+  }
+  w->preempt_runs = runs;
+}
+
+static pthread_once_t mp_preempt_once = PTHREAD_ONCE_INIT;
+
+static void mp_preempt_install(void) {
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_sigaction = &mp_preempt_handler;
+  act.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+  sigemptyset(&act.sa_mask);
+  if (sigaction(MP_PREEMPT_SIGNAL, &act, NULL) != 0) {
+    mp_system_error_message(errno, "unable to install the preemption signal handler\n");
+  }
+}
+
+// Start the time slice timer of the current worker thread
+void mp_preempt_start(mp_worker_t* w) {
+  const int64_t slice = w->sched->timeslice;
+  if (slice <= 0) return;
+  pthread_once(&mp_preempt_once, &mp_preempt_install);
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = MP_PREEMPT_SIGNAL;
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &w->preempt_timer) != 0) {
+    mp_system_error_message(errno, "unable to create the preemption timer\n");
+    return;
+  }
+  struct itimerspec its;
+  its.it_interval.tv_sec = (time_t)(slice / 1000000000LL);
+  its.it_interval.tv_nsec = (long)(slice % 1000000000LL);
+  its.it_value = its.it_interval;
+  if (timer_settime(w->preempt_timer, 0, &its, NULL) != 0) {
+    mp_system_error_message(errno, "unable to start the preemption timer\n");
+    timer_delete(w->preempt_timer);
+    return;
+  }
+  w->preempt_active = true;
+}
+
+void mp_preempt_stop(mp_worker_t* w) {
+  if (!w->preempt_active) return;
+  timer_delete(w->preempt_timer);
+  w->preempt_active = false;
+  _mp_preempt_requested = 0;
+}
+
+#else
+
+void mp_preempt_start(mp_worker_t* w) {
+  MP_UNUSED(w);
+}
+
+void mp_preempt_stop(mp_worker_t* w) {
+  MP_UNUSED(w);
+}
+
+#endif
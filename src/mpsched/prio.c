@@ -0,0 +1,172 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Priority and deadline classes.
+  Ready entries are kept in a binary heap ordered by strict priority (higher
+  first), then earliest deadline first (no deadline is latest), and then in
+  FIFO order (by a sequence number) so entries of the same class take turns.
+  Both push and pop are O(log n).
+
+  The scheduler keeps tasks that have a class in such a heap (protected by a
+  spin lock) that workers check before their own deque; tasks without a class
+  (the default) never touch it. The same heap is also available for plain
+  resumptions as a (single threaded) `mp_readyq_t`.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+//-----------------------------------------------------------------------
+// Binary heap
+//-----------------------------------------------------------------------
+
+static bool mp_pheap_before(const mp_pheap_entry_t* x, const mp_pheap_entry_t* y) {
+  if (x->priority != y->priority) return (x->priority > y->priority);
+  if (x->deadline != y->deadline) return ((uint64_t)(x->deadline - 1) < (uint64_t)(y->deadline - 1));  // 0 (no deadline) sorts last
+  return (x->seq < y->seq);
+}
+
+void mp_pheap_done(mp_pheap_t* h) {
+  mp_free(h->entries);
+  memset(h, 0, sizeof(mp_pheap_t));
+}
+
+void mp_pheap_push(mp_pheap_t* h, void* item, void* arg, int priority, int64_t deadline) {
+  if (h->count >= h->capacity) {
+    size_t capacity = (h->capacity == 0 ? 64 : 2 * h->capacity);
+    mp_pheap_entry_t* entries = (mp_pheap_entry_t*)mp_malloc_safe(capacity * sizeof(mp_pheap_entry_t));
+    if (h->count > 0) { memcpy(entries, h->entries, h->count * sizeof(mp_pheap_entry_t)); }
+    mp_free(h->entries);
+    h->entries = entries;
+    h->capacity = capacity;
+  }
+  mp_pheap_entry_t e;
+  e.item = item;
+  e.arg = arg;
+  e.priority = priority;
+  e.deadline = deadline;
+  e.seq = h->seq++;
+  // sift up
+  size_t i = h->count++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!mp_pheap_before(&e, &h->entries[parent])) break;
+    h->entries[i] = h->entries[parent];
+    i = parent;
+  }
+  h->entries[i] = e;
+}
+
+bool mp_pheap_pop(mp_pheap_t* h, void** item, void** arg) {
+  if (h->count == 0) return false;
+  if (item != NULL) { *item = h->entries[0].item; }
+  if (arg != NULL)  { *arg = h->entries[0].arg; }
+  const mp_pheap_entry_t last = h->entries[--h->count];
+  // sift down
+  const size_t n = h->count;
+  size_t i = 0;
+  while (true) {
+    size_t child = 2*i + 1;
+    if (child >= n) break;
+    if (child + 1 < n && mp_pheap_before(&h->entries[child+1], &h->entries[child])) { child++; }
+    if (!mp_pheap_before(&h->entries[child], &last)) break;
+    h->entries[i] = h->entries[child];
+    i = child;
+  }
+  if (n > 0) { h->entries[i] = last; }
+  return true;
+}
+
+
+//-----------------------------------------------------------------------
+// Task classes
+//-----------------------------------------------------------------------
+
+static int64_t mp_prio_deadline(int64_t deadline) {
+  if (deadline <= 0) return 0;
+  const int64_t at = mp_timers_clock() + deadline;
+  return (at == 0 ? 1 : at);
+}
+
+void mp_sched_prio_push(mp_sched_t* s, mp_task_t* t) {
+  mp_spin_lock(&s->prio_lock) {
+    mp_pheap_push(&s->prio, t, NULL, t->priority, t->deadline);
+  }
+  mp_atomic_add(&s->prio_count, 1);
+}
+
+mp_task_t* mp_sched_prio_pop(mp_sched_t* s) {
+  void* item = NULL;
+  mp_spin_lock(&s->prio_lock) {
+    if (mp_pheap_pop(&s->prio, &item, NULL)) { mp_atomic_add(&s->prio_count, -1); }
+  }
+  return (mp_task_t*)item;
+}
+
+void mp_sched_spawn_prio(mp_sched_t* s, mp_task_fun_t* fun, void* arg, int priority, int64_t deadline) {
+  mp_task_t* t = mp_task_create(s, fun, arg);
+  t->priority = priority;
+  t->deadline = mp_prio_deadline(deadline);
+  mp_sched_ready(t);
+}
+
+void mp_task_set_priority(int priority, int64_t deadline) {
+  mp_task_t* t = mp_task_current();
+  if (t == NULL) {
+    mp_error_message(EINVAL, "can only use 'mp_task_set_priority' from within a task\n");
+    return;
+  }
+  t->priority = priority;
+  t->deadline = mp_prio_deadline(deadline);
+}
+
+
+//-----------------------------------------------------------------------
+// Ready queue of resumptions
+//-----------------------------------------------------------------------
+
+struct mp_readyq_s {
+  mp_pheap_t heap;
+};
+
+mp_readyq_t* mp_readyq_create(void) {
+  return mp_zalloc_safe_tp(mp_readyq_t);
+}
+
+void mp_readyq_free(mp_readyq_t* q) {
+  if (q == NULL) return;
+  void* r;
+  while (mp_pheap_pop(&q->heap, &r, NULL)) {
+    mp_resume_drop((mp_resume_t*)r);
+  }
+  mp_pheap_done(&q->heap);
+  mp_free(q);
+}
+
+size_t mp_readyq_count(mp_readyq_t* q) {
+  return q->heap.count;
+}
+
+void mp_readyq_push(mp_readyq_t* q, mp_resume_t* r, void* arg, int priority, int64_t deadline) {
+  mp_pheap_push(&q->heap, r, arg, priority, mp_prio_deadline(deadline));
+}
+
+bool mp_readyq_resume_next(mp_readyq_t* q, void** result) {
+  void* r;
+  void* arg;
+  if (!mp_pheap_pop(&q->heap, &r, &arg)) return false;
+  void* res = mp_resume((mp_resume_t*)r, arg);
+  if (result != NULL) { *result = res; }
+  return true;
+}
@@ -0,0 +1,545 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>   // sysconf
+#include <pthread.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/longjmp.h"
+#include "internal/gstack.h"
+#include "internal/sched.h"
+
+#ifdef __cplusplus
+#include <exception>
+#endif
+
+// Every `MP_SCHED_FAIR_TICKS` scheduling decisions we first look at the injection
+// and yield queues so these cannot be starved by tasks that keep waking each other.
+#define MP_SCHED_FAIR_TICKS     (61)
+
+// Steal attempts before an idle worker goes to sleep, and the maximal sleep time
+// (as a safety net; normally sleepers are signaled when new work arrives)
+#define MP_SCHED_IDLE_SPINS     (64)
+#define MP_SCHED_IDLE_NSECS     (10*1000*1000)
+
+#define MP_DEQUE_INIT_CAPACITY  (256)
+
+// Pending io_uring entries before a worker with other work submits them
+// (a worker without local work submits right away)
+#define MP_SCHED_URING_BATCH    (32)
+
+
+//-----------------------------------------------------------------------
+// Work-stealing deque
+// Following "Correct and Efficient Work-Stealing for Weak Memory Models",
+// Nhat Minh Lê et al., PPoPP'13; (but using sequentially consistent atomics)
+//-----------------------------------------------------------------------
+
+static mp_deque_array_t* mp_deque_array_alloc(ssize_t capacity) {
+  mp_deque_array_t* a = (mp_deque_array_t*)mp_zalloc_safe(sizeof(mp_deque_array_t) + (size_t)(capacity-1)*sizeof(_Atomic(mp_task_t*)));
+  a->capacity = capacity;
+  a->retired = NULL;
+  return a;
+}
+
+static void mp_deque_init(mp_deque_t* dq) {
+  mp_atomic_store(&dq->top, (ssize_t)0);
+  mp_atomic_store(&dq->bottom, (ssize_t)0);
+  mp_atomic_store_ptr(mp_deque_array_t, &dq->array, mp_deque_array_alloc(MP_DEQUE_INIT_CAPACITY));
+}
+
+static void mp_deque_done(mp_deque_t* dq) {
+  mp_deque_array_t* a = mp_atomic_load_ptr(mp_deque_array_t, &dq->array);
+  while (a != NULL) {
+    mp_deque_array_t* prev = a->retired;
+    mp_free(a);
+    a = prev;
+  }
+  mp_atomic_store_ptr(mp_deque_array_t, &dq->array, NULL);
+}
+
+// Grow the array; the old array is retired (but not freed as thieves may still read from it)
+static mp_deque_array_t* mp_deque_grow(mp_deque_t* dq, mp_deque_array_t* a, ssize_t top, ssize_t bottom) {
+  mp_deque_array_t* b = mp_deque_array_alloc(2*a->capacity);
+  for (ssize_t i = top; i < bottom; i++) {
+    mp_atomic_store(&b->items[i & (b->capacity-1)], mp_atomic_load(&a->items[i & (a->capacity-1)]));
+  }
+  b->retired = a;
+  mp_atomic_store_ptr(mp_deque_array_t, &dq->array, b);
+  return b;
+}
+
+// Push at the bottom (owner only)
+static void mp_deque_push(mp_deque_t* dq, mp_task_t* t) {
+  ssize_t b = mp_atomic_load(&dq->bottom);
+  ssize_t top = mp_atomic_load(&dq->top);
+  mp_deque_array_t* a = mp_atomic_load_ptr(mp_deque_array_t, &dq->array);
+  if (b - top > a->capacity - 1) {
+    a = mp_deque_grow(dq, a, top, b);
+  }
+  mp_atomic_store(&a->items[b & (a->capacity-1)], t);
+  mp_atomic_store(&dq->bottom, b + 1);
+}
+
+// Take from the bottom (owner only)
+static mp_task_t* mp_deque_take(mp_deque_t* dq) {
+  ssize_t b = mp_atomic_load(&dq->bottom) - 1;
+  mp_deque_array_t* a = mp_atomic_load_ptr(mp_deque_array_t, &dq->array);
+  mp_atomic_store(&dq->bottom, b);
+  ssize_t top = mp_atomic_load(&dq->top);
+  mp_task_t* t = NULL;
+  if (top <= b) {
+    t = mp_atomic_load(&a->items[b & (a->capacity-1)]);
+    if (top == b) {
+      // last element: race with thieves
+      if (!mp_atomic_cas(&dq->top, &top, top + 1)) { t = NULL; }
+      mp_atomic_store(&dq->bottom, b + 1);
+    }
+  }
+  else {
+    mp_atomic_store(&dq->bottom, b + 1);  // empty
+  }
+  return t;
+}
+
+// Steal from the top (any thread)
+static mp_task_t* mp_deque_steal(mp_deque_t* dq) {
+  ssize_t top = mp_atomic_load(&dq->top);
+  ssize_t b = mp_atomic_load(&dq->bottom);
+  if (top >= b) return NULL;  // empty
+  mp_deque_array_t* a = mp_atomic_load_ptr(mp_deque_array_t, &dq->array);
+  mp_task_t* t = mp_atomic_load(&a->items[top & (a->capacity-1)]);
+  if (!mp_atomic_cas(&dq->top, &top, top + 1)) return NULL;  // lost the race
+  return t;
+}
+
+static bool mp_deque_is_empty(mp_deque_t* dq) {
+  return (mp_atomic_load(&dq->top) >= mp_atomic_load(&dq->bottom));
+}
+
+
+//-----------------------------------------------------------------------
+// Scheduler
+//-----------------------------------------------------------------------
+
+static mp_decl_thread mp_worker_t* _mp_worker;
+
+mp_decl_noinline mp_worker_t* mp_worker_current(void) {
+  return _mp_worker;
+}
+
+mp_sched_t* mp_sched_create(size_t worker_count) {
+  if (worker_count == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = (n <= 0 ? 1 : (size_t)n);
+  }
+  mp_sched_t* s = mp_zalloc_safe_tp(mp_sched_t);
+  s->worker_count = worker_count;
+  s->workers = (mp_worker_t*)mp_malloc_aligned(worker_count * sizeof(mp_worker_t), MP_CACHE_LINE);
+  if (s->workers == NULL) { mp_fatal_message(ENOMEM, "unable to allocate workers\n"); }
+  memset((void*)s->workers, 0, worker_count * sizeof(mp_worker_t));
+  for (size_t i = 0; i < worker_count; i++) {
+    mp_worker_t* w = &s->workers[i];
+    mp_deque_init(&w->deque);
+    w->sched = s;
+    w->index = i;
+    w->rnd = 0x9E3779B97F4A7C15ULL * (i + 1);
+  }
+  mp_atomic_store(&s->task_count, (intptr_t)0);
+  mp_atomic_store(&s->done, (intptr_t)0);
+  mp_atomic_store(&s->inject_count, (intptr_t)0);
+  mp_atomic_store(&s->sleepers, (intptr_t)0);
+  mp_atomic_store(&s->idle, (intptr_t)0);
+  pthread_mutex_init(&s->inject_lock, NULL);
+  pthread_mutex_init(&s->idle_lock, NULL);
+  pthread_cond_init(&s->idle_cond, NULL);
+  if (!mp_io_init(&s->io)) { mp_fatal_message(errno, "unable to initialize the I/O poller\n"); }
+  mp_timers_init(&s->timers);
+  mp_offload_init(&s->offload);
+  mp_atomic_store(&s->prio_lock, mp_spin_lock_create());
+  mp_atomic_store(&s->prio_count, (intptr_t)0);
+  return s;
+}
+
+void mp_sched_free(mp_sched_t* s) {
+  if (s == NULL) return;
+  if (mp_atomic_load(&s->task_count) != 0) {
+    mp_error_message(EINVAL, "freeing a scheduler with %zd tasks that have not finished\n", (ssize_t)mp_atomic_load(&s->task_count));
+  }
+  for (size_t i = 0; i < s->worker_count; i++) {
+    mp_deque_done(&s->workers[i].deque);
+  }
+  mp_offload_done(&s->offload);
+  mp_pheap_done(&s->prio);
+  mp_io_done(&s->io);
+  pthread_cond_destroy(&s->idle_cond);
+  pthread_mutex_destroy(&s->idle_lock);
+  pthread_mutex_destroy(&s->inject_lock);
+  mp_free_aligned(s->workers);
+  mp_free(s);
+}
+
+size_t mp_sched_worker_count(mp_sched_t* s) {
+  return s->worker_count;
+}
+
+
+//-----------------------------------------------------------------------
+// Ready queues
+//-----------------------------------------------------------------------
+
+// Wake up a sleeping worker if there is one (or the poller if it is blocked).
+void mp_sched_notify(mp_sched_t* s) {
+  if (mp_atomic_load(&s->sleepers) > 0) {
+    pthread_mutex_lock(&s->idle_lock);
+    pthread_cond_signal(&s->idle_cond);
+    pthread_mutex_unlock(&s->idle_lock);
+  }
+  else {
+    mp_io_notify(&s->io);
+  }
+}
+
+static void mp_sched_inject(mp_sched_t* s, mp_task_t* t) {
+  pthread_mutex_lock(&s->inject_lock);
+  mp_taskq_push(&s->inject, t);
+  mp_atomic_add(&s->inject_count, 1);
+  pthread_mutex_unlock(&s->inject_lock);
+}
+
+static mp_task_t* mp_sched_inject_pop(mp_sched_t* s) {
+  if (mp_atomic_load(&s->inject_count) <= 0) return NULL;
+  pthread_mutex_lock(&s->inject_lock);
+  mp_task_t* t = mp_taskq_pop(&s->inject);
+  if (t != NULL) { mp_atomic_add(&s->inject_count, -1); }
+  pthread_mutex_unlock(&s->inject_lock);
+  return t;
+}
+
+// Make a task ready: on a worker of the same scheduler we push on our own deque, and otherwise in the injection queue.
+void mp_sched_ready(mp_task_t* t) {
+  mp_sched_t* s = t->sched;
+  mp_worker_t* w = mp_worker_current();
+  if (mp_task_has_class(t)) {
+    mp_sched_prio_push(s, t);
+  }
+  else if (w != NULL && w->sched == s) {
+    mp_deque_push(&w->deque, t);
+  }
+  else {
+    mp_sched_inject(s, t);
+  }
+  mp_sched_notify(s);
+}
+
+// Yielded tasks go to the back of our private queue, unless there are idle workers that can run it.
+static void mp_sched_ready_yielded(mp_worker_t* w, mp_task_t* t) {
+  mp_sched_t* s = w->sched;
+  if (mp_task_has_class(t)) {
+    mp_sched_prio_push(s, t);
+    mp_sched_notify(s);
+  }
+  else if (mp_atomic_load(&s->idle) > 0) {
+    mp_sched_inject(s, t);
+    mp_sched_notify(s);
+  }
+  else {
+    mp_taskq_push(&w->yielded, t);
+  }
+}
+
+static uint64_t mp_worker_random(mp_worker_t* w) {
+  uint64_t x = w->rnd;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  w->rnd = x;
+  return x;
+}
+
+static mp_task_t* mp_worker_steal(mp_worker_t* w) {
+  mp_sched_t* s = w->sched;
+  const size_t n = s->worker_count;
+  if (n <= 1) return NULL;
+  size_t start = (size_t)(mp_worker_random(w) % n);
+  for (size_t i = 0; i < n; i++) {
+    mp_worker_t* victim = &s->workers[(start + i) % n];
+    if (victim == w) continue;
+    mp_task_t* t = mp_deque_steal(&victim->deque);
+    if (t != NULL) return t;
+  }
+  return NULL;
+}
+
+// Expire due timers, and poll for I/O without blocking if there are waiting tasks and no other worker is polling.
+static void mp_worker_poll(mp_worker_t* w) {
+  mp_timers_advance(&w->sched->timers);
+  mp_offload_reap(w->sched);
+  mp_io_t* io = &w->sched->io;
+  if (mp_atomic_load(&io->waiting) > 0 && mp_io_poller_acquire(io)) {
+    mp_io_poll(w->sched, 0);
+    mp_io_poller_release(io);
+  }
+}
+
+// Find the next task to run
+static mp_task_t* mp_worker_next(mp_worker_t* w) {
+  mp_task_t* t;
+  w->tick++;
+  mp_io_t* io = &w->sched->io;
+  const bool fair_tick = (w->tick % MP_SCHED_FAIR_TICKS == 0);
+  if (mp_unlikely(fair_tick)) {
+    mp_uring_flush(io, 1);
+    mp_worker_poll(w);
+  }
+  // tasks with a priority or deadline class go first
+  if (mp_atomic_load(&w->sched->prio_count) > 0 && (t = mp_sched_prio_pop(w->sched)) != NULL) return t;
+  if (mp_unlikely(fair_tick)) {
+    if ((t = mp_sched_inject_pop(w->sched)) != NULL) return t;
+    if ((t = mp_taskq_pop(&w->yielded)) != NULL) return t;
+  }
+  if ((t = mp_deque_take(&w->deque)) != NULL) {
+    mp_uring_flush(io, MP_SCHED_URING_BATCH);
+    return t;
+  }
+  if (mp_uring_flush(io, 1) > 0 && (t = mp_deque_take(&w->deque)) != NULL) return t;
+  if ((t = mp_sched_inject_pop(w->sched)) != NULL) return t;
+  if ((t = mp_taskq_pop(&w->yielded)) != NULL) return t;   // after all other ready tasks
+  if (mp_offload_reap(w->sched) > 0 && (t = mp_deque_take(&w->deque)) != NULL) return t;
+  return mp_worker_steal(w);
+}
+
+// Is there any work that an idle worker could pick up?
+static bool mp_sched_has_work(mp_sched_t* s) {
+  if (mp_atomic_load(&s->inject_count) > 0) return true;
+  if (mp_atomic_load(&s->prio_count) > 0) return true;
+  if (mp_offload_has_completed(s)) return true;
+  for (size_t i = 0; i < s->worker_count; i++) {
+    if (!mp_deque_is_empty(&s->workers[i].deque)) return true;
+  }
+  return false;
+}
+
+
+//-----------------------------------------------------------------------
+// Tasks
+//-----------------------------------------------------------------------
+
+#define MP_TASK_DONE    ((void*)1)  // returned to the worker when a task finished
+#define MP_TASK_PARKED  ((void*)2)  // returned to the worker when a task is suspended
+
+mp_task_t* mp_task_create(mp_sched_t* s, mp_task_fun_t* fun, void* arg) {
+  mp_prompt_t* p = mp_prompt_create_ex(sizeof(mp_task_t));
+  mp_prompt_set_stack_key(p, (void*)(uintptr_t)fun);   // profile the stack per task function
+  mp_task_t* t = (mp_task_t*)mp_prompt_user_data(p);
+  t->sched = s;
+  t->prompt = p;
+  t->fun = fun;
+  t->arg = arg;
+  mp_atomic_add(&s->task_count, 1);
+  return t;
+}
+
+static void* mp_task_start(mp_prompt_t* p, void* arg) {
+  MP_UNUSED(p);
+  mp_task_t* t = (mp_task_t*)arg;
+  #ifdef __cplusplus
+  try {
+    (t->fun)(t->arg);
+  }
+  catch (...) {
+    mp_error_message(EINVAL, "uncaught exception in task %p\n", t);
+  }
+  #else
+  (t->fun)(t->arg);
+  #endif
+  return MP_TASK_DONE;   // and the task is freed with its prompt
+}
+
+static void mp_sched_stop(mp_sched_t* s) {
+  pthread_mutex_lock(&s->idle_lock);
+  mp_atomic_store(&s->done, (intptr_t)1);
+  pthread_cond_broadcast(&s->idle_cond);
+  pthread_mutex_unlock(&s->idle_lock);
+  mp_io_notify(&s->io);
+}
+
+// Run a task until it suspends or finishes
+static void mp_worker_run(mp_worker_t* w, mp_task_t* t) {
+  mp_sched_t* s = w->sched;
+  w->current = t;
+  w->runs++;
+  mp_preempt_clear();
+  void* res;
+  if (t->resume == NULL) {
+    res = mp_prompt_enter(t->prompt, &mp_task_start, t);
+  }
+  else {
+    mp_resume_t* r = t->resume;
+    t->resume = NULL;
+    res = mp_resume(r, t->resume_arg);
+  }
+  // note: `t` may be freed or running on another worker at this point
+  w->current = NULL;
+  if (res == MP_TASK_DONE) {
+    if (mp_atomic_add(&s->task_count, -1) == 1) { mp_sched_stop(s); }
+  }
+}
+
+static void mp_worker_idle(mp_worker_t* w) {
+  mp_sched_t* s = w->sched;
+  mp_atomic_add(&s->idle, 1);
+  for (int i = 0; i < MP_SCHED_IDLE_SPINS; i++) {
+    if (mp_atomic_load(&s->done) != 0 || mp_sched_has_work(s)) {
+      mp_atomic_add(&s->idle, -1);
+      return;
+    }
+    mp_atomic_yield();
+  }
+  // block in `epoll_wait` if there are tasks waiting for I/O or timers, and nobody else is polling
+  mp_io_t* io = &s->io;
+  if ((mp_atomic_load(&io->waiting) > 0 || mp_atomic_load(&s->timers.count) > 0) && mp_io_poller_acquire(io)) {
+    mp_atomic_store(&io->blocked, (intptr_t)1);
+    if (mp_atomic_load(&s->done) == 0 && !mp_sched_has_work(s)) {
+      mp_io_poll(s, mp_timers_wait_ms(&s->timers, MP_SCHED_IDLE_NSECS / 1000000));
+    }
+    mp_atomic_store(&io->blocked, (intptr_t)0);
+    mp_io_poller_release(io);
+    mp_timers_advance(&s->timers);
+    mp_atomic_add(&s->idle, -1);
+    return;
+  }
+  pthread_mutex_lock(&s->idle_lock);
+  mp_atomic_add(&s->sleepers, 1);
+  if (mp_atomic_load(&s->done) == 0 && !mp_sched_has_work(s)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += MP_SCHED_IDLE_NSECS;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_cond_timedwait(&s->idle_cond, &s->idle_lock, &ts);
+  }
+  mp_atomic_add(&s->sleepers, -1);
+  pthread_mutex_unlock(&s->idle_lock);
+  mp_atomic_add(&s->idle, -1);
+}
+
+static void mp_worker_loop(mp_worker_t* w) {
+  mp_sched_t* s = w->sched;
+  mp_preempt_start(w);
+  while (mp_atomic_load(&s->done) == 0) {
+    mp_task_t* t = mp_worker_next(w);
+    if (t != NULL) {
+      mp_worker_run(w, t);
+    }
+    else {
+      mp_worker_idle(w);
+    }
+  }
+  mp_preempt_stop(w);
+}
+
+static void* mp_worker_thread(void* arg) {
+  mp_worker_t* w = (mp_worker_t*)arg;
+  mp_gstack_init(NULL);   // initialize thread local state (like the signal stack for on-demand paging)
+  _mp_worker = w;
+  mp_worker_loop(w);
+  _mp_worker = NULL;
+  return NULL;
+}
+
+void mp_sched_run(mp_sched_t* s) {
+  if (mp_atomic_load(&s->task_count) == 0) return;
+  mp_atomic_store(&s->done, (intptr_t)0);
+  for (size_t i = 1; i < s->worker_count; i++) {
+    if (pthread_create(&s->workers[i].thread, NULL, &mp_worker_thread, &s->workers[i]) != 0) {
+      mp_fatal_message(EAGAIN, "unable to create worker thread %zu\n", i);
+    }
+  }
+  mp_worker_t* prev = _mp_worker;
+  _mp_worker = &s->workers[0];
+  mp_worker_loop(&s->workers[0]);
+  _mp_worker = prev;
+  for (size_t i = 1; i < s->worker_count; i++) {
+    pthread_join(s->workers[i].thread, NULL);
+  }
+}
+
+void mp_sched_spawn(mp_sched_t* s, mp_task_fun_t* fun, void* arg) {
+  mp_sched_ready(mp_task_create(s, fun, arg));
+}
+
+
+//-----------------------------------------------------------------------
+// Task operations
+//-----------------------------------------------------------------------
+
+mp_task_t* mp_task_current(void) {
+  mp_worker_t* w = mp_worker_current();
+  return (w == NULL ? NULL : w->current);
+}
+
+size_t mp_task_worker(void) {
+  mp_worker_t* w = mp_worker_current();
+  return (w == NULL ? 0 : w->index);
+}
+
+void mp_task_spawn(mp_task_fun_t* fun, void* arg) {
+  mp_task_t* t = mp_task_current();
+  if (t == NULL) {
+    mp_error_message(EINVAL, "can only use 'mp_task_spawn' from within a task\n");
+    return;
+  }
+  mp_sched_spawn(t->sched, fun, arg);
+}
+
+typedef struct mp_park_env_s {
+  mp_task_t*          task;
+  mp_task_park_fun_t* park;
+  void*               arg;
+} mp_park_env_t;
+
+// Runs on the worker stack once the task is suspended
+static void* mp_task_park_yield(mp_resume_t* r, void* envarg) {
+  mp_park_env_t* env = (mp_park_env_t*)envarg;   // on the (suspended) task stack
+  mp_task_t* t = env->task;
+  t->resume = r;
+  (env->park)(t, env->arg);    // after this `t` (and `env`) may be resumed on another worker
+  return MP_TASK_PARKED;
+}
+
+void* mp_task_park(mp_task_park_fun_t* park, void* arg) {
+  mp_task_t* t = mp_task_current();
+  if (t == NULL) {
+    mp_error_message(EINVAL, "can only use 'mp_task_park' from within a task\n");
+    return NULL;
+  }
+  mp_park_env_t env = { t, park, arg };
+  return mp_yield(t->prompt, &mp_task_park_yield, &env);
+}
+
+void mp_task_wake(mp_task_t* t, void* result) {
+  if (t->timer != NULL && mp_timeout_wake(t, result)) return;
+  t->resume_arg = result;
+  mp_sched_ready(t);
+}
+
+static void mp_task_yield_park(mp_task_t* t, void* arg) {
+  MP_UNUSED(arg);
+  t->resume_arg = NULL;
+  mp_sched_ready_yielded(mp_worker_current(), t);
+}
+
+void mp_task_yield(void) {
+  mp_task_park(&mp_task_yield_park, NULL);
+}
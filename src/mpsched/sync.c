@@ -0,0 +1,343 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Task synchronization: mutexes, condition variables, semaphores, and wait groups.
+  These suspend just the calling task (and not the worker thread). A blocked task
+  is put in an intrusive FIFO queue (through its `next` field, as a parked task
+  is in no other queue) that is protected by a spin lock; the lock is only taken
+  on contention. The uncontended paths are a single atomic operation: since tasks
+  migrate between workers we cannot avoid atomics altogether.
+
+  Blocking happens in a park function that runs once the task is suspended, and
+  re-checks the state under the queue lock so no wake up can be lost.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+static bool mp_sync_check_task(const char* op) {
+  if (mp_task_current() == NULL) {
+    mp_error_message(EINVAL, "can only block in '%s' from within a task\n", op);
+    return false;
+  }
+  return true;
+}
+
+
+//-----------------------------------------------------------------------
+// Mutex
+// The state is 0 (unlocked), 1 (locked), or 2 (locked and there may be
+// waiters). On unlock with waiters the lock is handed directly to the
+// first waiter (FIFO) so it stays locked and a waiter can never starve.
+//-----------------------------------------------------------------------
+
+#define MP_MUTEX_UNLOCKED   (0)
+#define MP_MUTEX_LOCKED     (1)
+#define MP_MUTEX_CONTENDED  (2)
+
+struct mp_mutex_s {
+  _Atomic(intptr_t) state;
+  mp_spin_lock_t    lock;     // protects `waiters`
+  mp_taskq_t        waiters;
+};
+
+mp_mutex_t* mp_mutex_create(void) {
+  mp_mutex_t* m = mp_zalloc_safe_tp(mp_mutex_t);
+  mp_atomic_store(&m->state, (intptr_t)MP_MUTEX_UNLOCKED);
+  mp_atomic_store(&m->lock, mp_spin_lock_create());
+  return m;
+}
+
+void mp_mutex_free(mp_mutex_t* m) {
+  if (m == NULL) return;
+  if (mp_atomic_load(&m->state) != MP_MUTEX_UNLOCKED) {
+    mp_error_message(EINVAL, "freeing a locked mutex\n");
+  }
+  mp_free(m);
+}
+
+bool mp_mutex_try_lock(mp_mutex_t* m) {
+  intptr_t expected = MP_MUTEX_UNLOCKED;
+  return mp_atomic_cas(&m->state, &expected, (intptr_t)MP_MUTEX_LOCKED);
+}
+
+static void mp_mutex_park(mp_task_t* t, void* arg) {
+  mp_mutex_t* m = (mp_mutex_t*)arg;
+  bool acquired = false;
+  mp_spin_lock(&m->lock) {
+    // mark as contended; if it was unlocked in the mean time we own it now
+    intptr_t state = mp_atomic_load(&m->state);
+    while (!mp_atomic_cas(&m->state, &state, (intptr_t)MP_MUTEX_CONTENDED)) { }
+    if (state == MP_MUTEX_UNLOCKED) {
+      acquired = true;
+    }
+    else {
+      mp_taskq_push(&m->waiters, t);
+    }
+  }
+  if (acquired) { mp_task_wake(t, NULL); }
+}
+
+void mp_mutex_lock(mp_mutex_t* m) {
+  if (mp_likely(mp_mutex_try_lock(m))) return;
+  if (!mp_sync_check_task("mp_mutex_lock")) return;
+  mp_task_park(&mp_mutex_park, m);
+  // resumed: we own the lock
+}
+
+void mp_mutex_unlock(mp_mutex_t* m) {
+  intptr_t expected = MP_MUTEX_LOCKED;
+  if (mp_likely(mp_atomic_cas(&m->state, &expected, (intptr_t)MP_MUTEX_UNLOCKED))) return;
+  if (expected == MP_MUTEX_UNLOCKED) {
+    mp_error_message(EINVAL, "unlocking a mutex that is not locked\n");
+    return;
+  }
+  // contended: hand the lock to the first waiter
+  mp_task_t* t = NULL;
+  mp_spin_lock(&m->lock) {
+    t = mp_taskq_pop(&m->waiters);
+    if (t == NULL) {
+      mp_atomic_store(&m->state, (intptr_t)MP_MUTEX_UNLOCKED);
+    }
+    else if (mp_taskq_is_empty(&m->waiters)) {
+      mp_atomic_store(&m->state, (intptr_t)MP_MUTEX_LOCKED);
+    }
+  }
+  if (t != NULL) { mp_task_wake(t, NULL); }
+}
+
+
+//-----------------------------------------------------------------------
+// Condition variable
+//-----------------------------------------------------------------------
+
+struct mp_cond_s {
+  _Atomic(intptr_t) waiting;  // count of waiters so signals without waiters need no lock
+  mp_spin_lock_t    lock;     // protects `waiters`
+  mp_taskq_t        waiters;
+};
+
+mp_cond_t* mp_cond_create(void) {
+  mp_cond_t* c = mp_zalloc_safe_tp(mp_cond_t);
+  mp_atomic_store(&c->waiting, (intptr_t)0);
+  mp_atomic_store(&c->lock, mp_spin_lock_create());
+  return c;
+}
+
+void mp_cond_free(mp_cond_t* c) {
+  if (c == NULL) return;
+  if (mp_atomic_load(&c->waiting) != 0) {
+    mp_error_message(EINVAL, "freeing a condition variable with waiting tasks\n");
+  }
+  mp_free(c);
+}
+
+typedef struct mp_cond_park_env_s {
+  mp_cond_t*  cond;
+  mp_mutex_t* mutex;
+} mp_cond_park_env_t;
+
+static void mp_cond_park(mp_task_t* t, void* arg) {
+  mp_cond_park_env_t* env = (mp_cond_park_env_t*)arg;
+  mp_mutex_t* m = env->mutex;
+  mp_cond_t*  c = env->cond;
+  mp_spin_lock(&c->lock) {
+    mp_taskq_push(&c->waiters, t);
+    mp_atomic_add(&c->waiting, 1);
+  }
+  // only release the mutex once we are in the queue: a signal after this will find us
+  // (and note that `env` may be gone after this)
+  mp_mutex_unlock(m);
+}
+
+void mp_cond_wait(mp_cond_t* c, mp_mutex_t* m) {
+  if (!mp_sync_check_task("mp_cond_wait")) return;
+  mp_cond_park_env_t env = { c, m };
+  mp_task_park(&mp_cond_park, &env);
+  mp_mutex_lock(m);
+}
+
+void mp_cond_signal(mp_cond_t* c) {
+  if (mp_atomic_load(&c->waiting) == 0) return;
+  mp_task_t* t = NULL;
+  mp_spin_lock(&c->lock) {
+    t = mp_taskq_pop(&c->waiters);
+    if (t != NULL) { mp_atomic_add(&c->waiting, -1); }
+  }
+  if (t != NULL) { mp_task_wake(t, NULL); }
+}
+
+void mp_cond_broadcast(mp_cond_t* c) {
+  if (mp_atomic_load(&c->waiting) == 0) return;
+  mp_taskq_t wake;
+  mp_spin_lock(&c->lock) {
+    wake = c->waiters;
+    c->waiters.first = c->waiters.last = NULL;
+    mp_atomic_store(&c->waiting, (intptr_t)0);
+  }
+  mp_task_t* t;
+  while ((t = mp_taskq_pop(&wake)) != NULL) {
+    mp_task_wake(t, NULL);
+  }
+}
+
+
+//-----------------------------------------------------------------------
+// Semaphore
+// An acquiring task first increments `waiting` and then checks the count
+// (under the lock), while a release first increments the count and then
+// checks `waiting`. As both are sequentially consistent, either the
+// acquire sees the new count, or the release sees the waiter.
+// Released units are handed to waiters in FIFO order.
+//-----------------------------------------------------------------------
+
+struct mp_sem_s {
+  _Atomic(intptr_t) count;
+  _Atomic(intptr_t) waiting;
+  mp_spin_lock_t    lock;     // protects `waiters`
+  mp_taskq_t        waiters;
+};
+
+mp_sem_t* mp_sem_create(size_t count) {
+  mp_sem_t* s = mp_zalloc_safe_tp(mp_sem_t);
+  mp_atomic_store(&s->count, (intptr_t)count);
+  mp_atomic_store(&s->waiting, (intptr_t)0);
+  mp_atomic_store(&s->lock, mp_spin_lock_create());
+  return s;
+}
+
+void mp_sem_free(mp_sem_t* s) {
+  if (s == NULL) return;
+  if (mp_atomic_load(&s->waiting) != 0) {
+    mp_error_message(EINVAL, "freeing a semaphore with waiting tasks\n");
+  }
+  mp_free(s);
+}
+
+bool mp_sem_try_acquire(mp_sem_t* s) {
+  intptr_t count = mp_atomic_load(&s->count);
+  while (count > 0) {
+    if (mp_atomic_cas(&s->count, &count, count - 1)) return true;
+  }
+  return false;
+}
+
+static void mp_sem_park(mp_task_t* t, void* arg) {
+  mp_sem_t* s = (mp_sem_t*)arg;
+  bool acquired = false;
+  mp_spin_lock(&s->lock) {
+    mp_atomic_add(&s->waiting, 1);
+    if (mp_taskq_is_empty(&s->waiters) && mp_sem_try_acquire(s)) {
+      mp_atomic_add(&s->waiting, -1);
+      acquired = true;
+    }
+    else {
+      mp_taskq_push(&s->waiters, t);
+    }
+  }
+  if (acquired) { mp_task_wake(t, NULL); }
+}
+
+void mp_sem_acquire(mp_sem_t* s) {
+  if (mp_likely(mp_sem_try_acquire(s))) return;
+  if (!mp_sync_check_task("mp_sem_acquire")) return;
+  mp_task_park(&mp_sem_park, s);
+  // resumed: a unit was handed to us
+}
+
+void mp_sem_release(mp_sem_t* s) {
+  mp_atomic_add(&s->count, 1);
+  if (mp_likely(mp_atomic_load(&s->waiting) == 0)) return;
+  // hand out units to waiters
+  mp_taskq_t wake = { NULL, NULL };
+  mp_spin_lock(&s->lock) {
+    while (!mp_taskq_is_empty(&s->waiters) && mp_sem_try_acquire(s)) {
+      mp_taskq_push(&wake, mp_taskq_pop(&s->waiters));
+      mp_atomic_add(&s->waiting, -1);
+    }
+  }
+  mp_task_t* t;
+  while ((t = mp_taskq_pop(&wake)) != NULL) {
+    mp_task_wake(t, NULL);
+  }
+}
+
+
+//-----------------------------------------------------------------------
+// Wait group
+// The waiters are released by the `mp_waitgroup_add` that brings the
+// count to zero; `mp_waitgroup_wait` checks the count again under the lock.
+//-----------------------------------------------------------------------
+
+struct mp_waitgroup_s {
+  _Atomic(intptr_t) count;
+  mp_spin_lock_t    lock;     // protects `waiters`
+  mp_taskq_t        waiters;
+};
+
+mp_waitgroup_t* mp_waitgroup_create(void) {
+  mp_waitgroup_t* wg = mp_zalloc_safe_tp(mp_waitgroup_t);
+  mp_atomic_store(&wg->count, (intptr_t)0);
+  mp_atomic_store(&wg->lock, mp_spin_lock_create());
+  return wg;
+}
+
+void mp_waitgroup_free(mp_waitgroup_t* wg) {
+  if (wg == NULL) return;
+  if (!mp_taskq_is_empty(&wg->waiters)) {
+    mp_error_message(EINVAL, "freeing a wait group with waiting tasks\n");
+  }
+  mp_free(wg);
+}
+
+void mp_waitgroup_add(mp_waitgroup_t* wg, ssize_t n) {
+  const intptr_t count = mp_atomic_add(&wg->count, (intptr_t)n) + (intptr_t)n;
+  if (mp_likely(count > 0)) return;
+  if (count < 0) {
+    mp_error_message(EINVAL, "negative wait group count\n");
+    return;
+  }
+  mp_taskq_t wake;
+  mp_spin_lock(&wg->lock) {
+    wake = wg->waiters;
+    wg->waiters.first = wg->waiters.last = NULL;
+  }
+  mp_task_t* t;
+  while ((t = mp_taskq_pop(&wake)) != NULL) {
+    mp_task_wake(t, NULL);
+  }
+}
+
+void mp_waitgroup_done(mp_waitgroup_t* wg) {
+  mp_waitgroup_add(wg, -1);
+}
+
+static void mp_waitgroup_park(mp_task_t* t, void* arg) {
+  mp_waitgroup_t* wg = (mp_waitgroup_t*)arg;
+  bool done = false;
+  mp_spin_lock(&wg->lock) {
+    if (mp_atomic_load(&wg->count) <= 0) {
+      done = true;
+    }
+    else {
+      mp_taskq_push(&wg->waiters, t);
+    }
+  }
+  if (done) { mp_task_wake(t, NULL); }
+}
+
+void mp_waitgroup_wait(mp_waitgroup_t* wg) {
+  if (mp_likely(mp_atomic_load(&wg->count) <= 0)) return;
+  if (!mp_sync_check_task("mp_waitgroup_wait")) return;
+  mp_task_park(&mp_waitgroup_park, wg);
+}
@@ -0,0 +1,356 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  Timers in a hierarchical timing wheel
+  (as in "Hashed and Hierarchical Timing Wheels", Varghese and Lauck, SOSP'87)
+
+  There are `MP_TIMER_LEVELS` levels of `MP_TIMER_SLOTS` slots where each slot
+  in level `l` spans `MP_TIMER_SLOTS^l` ticks. A timer is inserted in the
+  slot of its expiration tick at the lowest level that can contain it, and
+  timers in a higher level are cascaded down once the wheel reaches their slot.
+  Both insertion and cancelation are O(1) (a timer is in an intrusive doubly
+  linked slot list). The wheel is advanced by the workers from the monotonic
+  clock and all timers in a due slot are expired as a batch.
+
+  Timer entries are not allocated but live on the stack of the suspended task.
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+#define MP_TIMER_SLOT_MASK  (MP_TIMER_SLOTS - 1)
+#define MP_TIMER_MAX_TICKS  (((uint64_t)1 << (MP_TIMER_SLOT_BITS * MP_TIMER_LEVELS)) - 1)
+
+// timer states
+#define MP_TIMER_IDLE       (0)
+#define MP_TIMER_PENDING    (1)   // in the wheel
+#define MP_TIMER_FIRING     (2)   // removed from the wheel and its function is running
+
+int64_t mp_timers_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec);
+}
+
+void mp_timers_init(mp_timers_t* timers) {
+  memset((void*)timers, 0, sizeof(mp_timers_t));
+  timers->start = mp_timers_clock();
+  timers->next = 1;
+  mp_atomic_store(&timers->lock, mp_spin_lock_create());
+  mp_atomic_store(&timers->count, (intptr_t)0);
+}
+
+// The first tick that is at or after the given clock time
+static uint64_t mp_timers_tick_at(mp_timers_t* timers, int64_t clock) {
+  int64_t elapsed = clock - timers->start;
+  if (elapsed <= 0) return 0;
+  return (uint64_t)((elapsed + MP_TIMER_TICK_NSECS - 1) / MP_TIMER_TICK_NSECS);
+}
+
+// The last tick that is due at the given clock time
+static uint64_t mp_timers_tick_due(mp_timers_t* timers, int64_t clock) {
+  int64_t elapsed = clock - timers->start;
+  if (elapsed <= 0) return 0;
+  return (uint64_t)(elapsed / MP_TIMER_TICK_NSECS);
+}
+
+// Link a timer in its slot; must hold the lock
+static void mp_timers_link(mp_timers_t* timers, mp_timer_t* timer) {
+  uint64_t expires = timer->expires;
+  if (expires < timers->next) { expires = timers->next; }
+  uint64_t delta = expires - timers->next;
+  if (delta > MP_TIMER_MAX_TICKS) {
+    delta = MP_TIMER_MAX_TICKS;
+    expires = timers->next + delta;
+  }
+  size_t level = 0;
+  while (level < MP_TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (MP_TIMER_SLOT_BITS * (level + 1)))) {
+    level++;
+  }
+  mp_timer_t** slot = &timers->wheel[level][(expires >> (MP_TIMER_SLOT_BITS * level)) & MP_TIMER_SLOT_MASK];
+  timer->next = *slot;
+  timer->pprev = slot;
+  if (*slot != NULL) { (*slot)->pprev = &timer->next; }
+  *slot = timer;
+}
+
+static void mp_timers_unlink(mp_timer_t* timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) { timer->next->pprev = timer->pprev; }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+// Insert a timer that expires at the given clock time
+void mp_timer_start(mp_timers_t* timers, mp_timer_t* timer, int64_t clock, mp_timer_fun_t* fun, void* arg) {
+  timer->fun = fun;
+  timer->arg = arg;
+  mp_spin_lock(&timers->lock) {
+    timer->expires = mp_timers_tick_at(timers, clock);
+    mp_atomic_store(&timer->state, (intptr_t)MP_TIMER_PENDING);
+    mp_timers_link(timers, timer);
+    mp_atomic_add(&timers->count, 1);   // under the lock so it is exact while advancing
+  }
+}
+
+// Cancel a timer: returns `true` if it was pending. If the timer is firing
+// concurrently, we wait until its function calls `mp_timer_fired` (and return `false`).
+bool mp_timer_cancel(mp_timers_t* timers, mp_timer_t* timer) {
+  bool canceled = false;
+  mp_spin_lock(&timers->lock) {
+    if (mp_atomic_load(&timer->state) == MP_TIMER_PENDING) {
+      mp_timers_unlink(timer);
+      mp_atomic_store(&timer->state, (intptr_t)MP_TIMER_IDLE);
+      mp_atomic_add(&timers->count, -1);
+      canceled = true;
+    }
+  }
+  if (!canceled) {
+    while (mp_atomic_load(&timer->state) == MP_TIMER_FIRING) { mp_atomic_yield(); }
+  }
+  return canceled;
+}
+
+// Called by a timer function once it no longer accesses the timer (which may be deallocated after this)
+void mp_timer_fired(mp_timer_t* timer) {
+  mp_atomic_store(&timer->state, (intptr_t)MP_TIMER_IDLE);
+}
+
+// Advance the wheel up to the current time and run the functions of all expired timers.
+// Returns the number of expired timers.
+size_t mp_timers_advance(mp_timers_t* timers) {
+  if (mp_atomic_load(&timers->count) == 0) return 0;
+  if (!mp_spin_lock_try_acquire(&timers->lock)) return 0;   // another worker is advancing (or inserting)
+  const uint64_t now = mp_timers_tick_due(timers, mp_timers_clock());
+  mp_timer_t* expired = NULL;
+  intptr_t pending = mp_atomic_load(&timers->count);
+  size_t count = 0;
+  while (timers->next <= now && (intptr_t)count < pending) {
+    const uint64_t tick = timers->next;
+    // cascade higher levels when the lower level wraps around
+    for (size_t level = 1; level < MP_TIMER_LEVELS; level++) {
+      if ((tick & (((uint64_t)1 << (MP_TIMER_SLOT_BITS * level)) - 1)) != 0) break;
+      mp_timer_t** slot = &timers->wheel[level][(tick >> (MP_TIMER_SLOT_BITS * level)) & MP_TIMER_SLOT_MASK];
+      mp_timer_t* timer = *slot;
+      *slot = NULL;
+      while (timer != NULL) {
+        mp_timer_t* next = timer->next;
+        mp_timers_link(timers, timer);
+        timer = next;
+      }
+    }
+    // expire the current slot
+    mp_timer_t** slot = &timers->wheel[0][tick & MP_TIMER_SLOT_MASK];
+    mp_timer_t* timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+      mp_timer_t* next = timer->next;
+      mp_atomic_store(&timer->state, (intptr_t)MP_TIMER_FIRING);
+      timer->pprev = NULL;
+      timer->next = expired;
+      expired = timer;
+      count++;
+      timer = next;
+    }
+    timers->next = tick + 1;
+  }
+  if (timers->next <= now) {
+    timers->next = now + 1;   // all pending timers expired so we can skip the remaining ticks
+  }
+  mp_atomic_add(&timers->count, -(intptr_t)count);
+  mp_spin_lock_release(&timers->lock);
+  if (count > 0) {
+    while (expired != NULL) {
+      mp_timer_t* next = expired->next;   // read before `fun` as it may deallocate the timer
+      (expired->fun)(expired, expired->arg);
+      expired = next;
+    }
+  }
+  return count;
+}
+
+// The first tick at which a pending timer may expire; must hold the lock.
+// This is exact for timers in level 0; for a higher level it is the tick at which its
+// earliest occupied slot is cascaded down (as its timers expire at or after that tick).
+static uint64_t mp_timers_next_expiry(mp_timers_t* timers) {
+  uint64_t earliest = UINT64_MAX;
+  for (size_t level = 0; level < MP_TIMER_LEVELS; level++) {
+    const size_t   shift = MP_TIMER_SLOT_BITS * level;
+    const uint64_t span  = (uint64_t)1 << shift;
+    uint64_t tick = (timers->next + span - 1) & ~(span - 1);   // first slot boundary at or after `next`
+    for (size_t i = 0; i < MP_TIMER_SLOTS && tick < earliest; i++, tick += span) {
+      if (timers->wheel[level][(tick >> shift) & MP_TIMER_SLOT_MASK] != NULL) {
+        earliest = tick;
+        break;
+      }
+    }
+  }
+  return earliest;
+}
+
+// Milli-seconds until the earliest pending timer may expire, at most `max_ms`.
+int mp_timers_wait_ms(mp_timers_t* timers, int max_ms) {
+  if (mp_atomic_load(&timers->count) == 0) return max_ms;
+  uint64_t next_tick;
+  uint64_t tick;
+  if (mp_spin_lock_try_acquire(&timers->lock)) {
+    next_tick = timers->next;
+    tick = mp_timers_next_expiry(timers);
+    mp_spin_lock_release(&timers->lock);
+  }
+  else {
+    next_tick = tick = timers->next;   // another worker is advancing (or inserting); racy read is fine
+  }
+  if (tick - next_tick > (uint64_t)max_ms * 1000000 / MP_TIMER_TICK_NSECS) return max_ms;   // (also if none was found)
+  int64_t next = timers->start + (int64_t)tick * MP_TIMER_TICK_NSECS;
+  int64_t wait = next - mp_timers_clock();
+  if (wait <= 0) return 0;
+  int64_t ms = (wait + 999999) / 1000000;
+  return (ms > max_ms ? max_ms : (int)ms);
+}
+
+
+//-----------------------------------------------------------------------
+// Sleeping and parking with a timeout
+//-----------------------------------------------------------------------
+
+static void mp_sleep_fire(mp_timer_t* timer, void* arg) {
+  mp_task_t* t = (mp_task_t*)arg;
+  mp_timer_fired(timer);
+  t->resume_arg = NULL;
+  mp_sched_ready(t);
+}
+
+typedef struct mp_sleep_env_s {
+  mp_timer_t  timer;
+  int64_t     deadline;
+} mp_sleep_env_t;
+
+static void mp_sleep_park(mp_task_t* t, void* arg) {
+  mp_sleep_env_t* env = (mp_sleep_env_t*)arg;
+  mp_sched_t* s = t->sched;   // read out as `t` may run once the timer is started
+  mp_timer_start(&s->timers, &env->timer, env->deadline, &mp_sleep_fire, t);
+  mp_sched_notify(s);         // so a blocked poller recomputes its timeout
+}
+
+void mp_sleep(int64_t nsecs) {
+  if (mp_task_current() == NULL) {
+    // not in a task: block the thread
+    if (nsecs <= 0) return;
+    struct timespec ts = { (time_t)(nsecs / 1000000000LL), (long)(nsecs % 1000000000LL) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) { }
+    return;
+  }
+  mp_sleep_env_t env = { 0 };
+  env.deadline = mp_timers_clock() + (nsecs < 0 ? 0 : nsecs);
+  mp_task_park(&mp_sleep_park, &env);
+}
+
+
+// A park with a timeout races the timer with a call to `mp_task_wake`; the
+// task becomes ready once the winner is decided _and_ the park function is
+// done (as `env` is on the task stack and used to start the timer).
+// `t->timer_gate` counts these two conditions.
+// When the timer fires first, it claims `t->timer` and is done with the timer
+// _before_ calling the user `cancel` function: a concurrent wake then does not
+// wait for the timer (so `cancel` may take locks that a waker holds) and just
+// delivers its result if `cancel` returns `false`.
+#define MP_TIMER_CLAIMED  ((mp_timer_t*)(uintptr_t)1)
+typedef struct mp_timeout_env_s {
+  mp_timer_t            timer;
+  int64_t               deadline;
+  mp_task_park_fun_t*   park;
+  mp_task_cancel_fun_t* cancel;
+  void*                 arg;
+} mp_timeout_env_t;
+
+static void mp_timeout_release(mp_task_t* t) {
+  if (mp_atomic_add(&t->timer_gate, -1) == 1) {
+    mp_sched_ready(t);
+  }
+}
+
+static void mp_timeout_fire(mp_timer_t* timer, void* arg) {
+  mp_task_t* t = (mp_task_t*)arg;
+  mp_timeout_env_t* env = (mp_timeout_env_t*)timer;
+  mp_task_cancel_fun_t* cancel = env->cancel;   // read out as `env` may be gone once the timer is fired
+  void* cancel_arg = env->arg;
+  bool claimed = false;
+  mp_spin_lock(&t->timer_lock) {
+    if (t->timer != NULL) {
+      t->timer = MP_TIMER_CLAIMED;
+      claimed = true;
+    }
+  }
+  mp_timer_fired(timer);
+  if (!claimed) return;           // a wake came first (and waited for us to be fired)
+  if (cancel(t, cancel_arg)) {
+    // timed out: no wake will come
+    t->resume_arg = MP_TIMEOUT;
+    mp_timeout_release(t);
+  }
+  // otherwise a wake is already on its way and delivers its result
+}
+
+static void mp_timeout_park(mp_task_t* t, void* arg) {
+  mp_timeout_env_t* env = (mp_timeout_env_t*)arg;
+  mp_sched_t* s = t->sched;
+  mp_atomic_store(&t->timer_gate, (intptr_t)2);
+  t->timer = &env->timer;
+  (env->park)(t, env->arg);
+  // only start the timer if there was no wake yet (`mp_task_wake` sets `t->timer` to NULL)
+  bool started = false;
+  mp_spin_lock(&t->timer_lock) {
+    if (t->timer != NULL) {
+      mp_timer_start(&s->timers, &env->timer, env->deadline, &mp_timeout_fire, t);
+      started = true;
+    }
+  }
+  if (started) { mp_sched_notify(s); }
+  mp_timeout_release(t);
+}
+
+void* mp_timeout(int64_t nsecs, mp_task_park_fun_t* park, mp_task_cancel_fun_t* cancel, void* arg) {
+  mp_task_t* t = mp_task_current();
+  if (t == NULL) {
+    mp_error_message(EINVAL, "can only use 'mp_timeout' from within a task\n");
+    return NULL;
+  }
+  mp_timeout_env_t env = { 0 };
+  env.deadline = mp_timers_clock() + (nsecs < 0 ? 0 : nsecs);
+  env.park = park;
+  env.cancel = cancel;
+  env.arg = arg;
+  void* res = mp_task_park(&mp_timeout_park, &env);
+  t = mp_task_current();   // we may be on a different worker now
+  t->timer = NULL;
+  return res;
+}
+
+// Called from `mp_task_wake` when the task is parked with a timeout
+bool mp_timeout_wake(mp_task_t* t, void* result) {
+  mp_timer_t* timer = NULL;
+  mp_spin_lock(&t->timer_lock) {
+    timer = t->timer;
+    t->timer = NULL;   // prevents the timer from being started if the park function is still running
+  }
+  if (timer == NULL) return false;   // already woken (should not happen)
+  if (timer != MP_TIMER_CLAIMED) {
+    mp_timer_cancel(&t->sched->timers, timer);   // waits if the timer is firing (which is brief as it sees `t->timer == NULL`)
+  }
+  t->resume_arg = result;
+  mp_timeout_release(t);
+  return true;
+}
@@ -0,0 +1,426 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+-----------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------------------------
+  I/O completions with io_uring.
+  Instead of waiting for readiness and then doing the system call, a task
+  submits a read or write as an SQE right after it is suspended and is woken
+  up with the result when the CQE arrives. The ring file descriptor is part of
+  the epoll set of the scheduler (see `io.c`) so the poller reaps completions
+  in batches together with the other events.
+
+  We use the raw system calls (and no liburing). If io_uring is not
+  available (older kernels, seccomp filters in containers, etc.) we fall back
+  to the readiness based operations.
+------------------------------------------------------------------------------*/
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MP_HAS_IO_URING  1
+#endif
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "mpsched.h"
+#include "internal/util.h"
+#include "internal/atomic.h"
+#include "internal/sched.h"
+
+#if MP_HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define MP_URING_ENTRIES  (256)
+
+struct mp_uring_s {
+  int               fd;
+  unsigned          features;
+  mp_spin_lock_t    sq_lock;      // submissions can come from any worker
+  mp_spin_lock_t    cq_lock;      // held while reaping
+  // submission queue
+  unsigned          sq_entries;
+  unsigned          sq_pending;   // entries not yet submitted to the kernel
+  unsigned*         sq_tail;
+  unsigned          sq_mask;
+  unsigned*         sq_array;
+  struct io_uring_sqe* sqes;
+  // completion queue
+  unsigned*         cq_head;
+  unsigned*         cq_tail;
+  unsigned          cq_mask;
+  struct io_uring_cqe* cqes;
+  // mappings
+  void*             sq_map;
+  size_t            sq_map_size;
+  void*             cq_map;       // NULL if the same as `sq_map`
+  size_t            cq_map_size;
+  size_t            sqes_size;
+};
+
+// A submitted operation (lives on the stack of the suspended task)
+typedef struct mp_uring_op_s {
+  mp_uring_t*   ring;
+  mp_sched_t*   sched;
+  mp_task_t*    task;
+  uint8_t       opcode;
+  int           fd;
+  void*         buf;
+  size_t        len;
+  off_t         offset;
+  int           res;
+  bool          queued;       // false if the submission queue stayed full
+} mp_uring_op_t;
+
+static int mp_uring_setup(unsigned entries, struct io_uring_params* params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int mp_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int mp_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void mp_uring_free(mp_uring_t* ring) {
+  if (ring->sqes != NULL) { munmap(ring->sqes, ring->sqes_size); }
+  if (ring->cq_map != NULL) { munmap(ring->cq_map, ring->cq_map_size); }
+  if (ring->sq_map != NULL) { munmap(ring->sq_map, ring->sq_map_size); }
+  if (ring->fd >= 0) { close(ring->fd); }
+  mp_free(ring);
+}
+
+// Are reads and writes supported? (`IORING_OP_READ`/`WRITE` need Linux 5.6)
+static bool mp_uring_probe(mp_uring_t* ring) {
+  const size_t n = 256;
+  struct io_uring_probe* probe = (struct io_uring_probe*)mp_zalloc_safe(sizeof(struct io_uring_probe) + n*sizeof(struct io_uring_probe_op));
+  bool ok = false;
+  if (mp_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, (unsigned)n) == 0) {
+    ok = (probe->last_op >= IORING_OP_WRITE &&
+          (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0 &&
+          (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0);
+  }
+  mp_free(probe);
+  return ok;
+}
+
+static mp_uring_t* mp_uring_create(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = mp_uring_setup(MP_URING_ENTRIES, &params);
+  if (fd < 0) return NULL;
+  mp_uring_t* ring = mp_zalloc_safe_tp(mp_uring_t);
+  ring->fd = fd;
+  ring->features = params.features;
+  if ((params.features & IORING_FEAT_NODROP) == 0 || !mp_uring_probe(ring)) {
+    mp_uring_free(ring);
+    return NULL;
+  }
+  // map the rings
+  ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single = ((params.features & IORING_FEAT_SINGLE_MMAP) != 0);
+  if (single && ring->cq_map_size > ring->sq_map_size) { ring->sq_map_size = ring->cq_map_size; }
+  void* sq = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) { mp_uring_free(ring); return NULL; }
+  ring->sq_map = sq;
+  void* cq = sq;
+  if (!single) {
+    cq = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) { mp_uring_free(ring); return NULL; }
+    ring->cq_map = cq;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) { mp_uring_free(ring); return NULL; }
+  ring->sqes = (struct io_uring_sqe*)sqes;
+  uint8_t* sqp = (uint8_t*)sq;
+  ring->sq_entries = params.sq_entries;
+  ring->sq_tail  = (unsigned*)(sqp + params.sq_off.tail);
+  ring->sq_mask  = *((unsigned*)(sqp + params.sq_off.ring_mask));
+  ring->sq_array = (unsigned*)(sqp + params.sq_off.array);
+  uint8_t* cqp = (uint8_t*)cq;
+  ring->cq_head  = (unsigned*)(cqp + params.cq_off.head);
+  ring->cq_tail  = (unsigned*)(cqp + params.cq_off.tail);
+  ring->cq_mask  = *((unsigned*)(cqp + params.cq_off.ring_mask));
+  ring->cqes     = (struct io_uring_cqe*)(cqp + params.cq_off.cqes);
+  return ring;
+}
+
+
+//-----------------------------------------------------------------------
+// Initialization
+//-----------------------------------------------------------------------
+
+void mp_uring_init(mp_io_t* io) {
+  io->uring = NULL;
+  const char* env = getenv("MP_IO_URING");
+  if (env != NULL && strcmp(env, "0") == 0) return;   // disabled
+  mp_uring_t* ring = mp_uring_create();
+  if (ring == NULL) return;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;   // level triggered: readable while there are completions
+  ev.data.fd = ring->fd;
+  if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, ring->fd, &ev) != 0) {
+    mp_uring_free(ring);
+    return;
+  }
+  io->uring = ring;
+}
+
+void mp_uring_done(mp_io_t* io) {
+  mp_uring_t* ring = io->uring;
+  if (ring == NULL) return;
+  epoll_ctl(io->epfd, EPOLL_CTL_DEL, ring->fd, NULL);
+  mp_uring_free(ring);
+  io->uring = NULL;
+}
+
+bool mp_io_uring_enable(mp_sched_t* s, bool enable) {
+  mp_io_t* io = &s->io;
+  if (mp_atomic_load(&io->waiting) != 0) {
+    mp_error_message(EINVAL, "cannot change the I/O backend while there are pending operations\n");
+  }
+  else if (enable && io->uring == NULL) {
+    mp_uring_init(io);
+  }
+  else if (!enable && io->uring != NULL) {
+    mp_uring_done(io);
+  }
+  return (io->uring != NULL);
+}
+
+
+//-----------------------------------------------------------------------
+// Completions
+//-----------------------------------------------------------------------
+
+bool mp_uring_is_fd(mp_io_t* io, int fd) {
+  return (io->uring != NULL && io->uring->fd == fd);
+}
+
+// Reap all available completions (if no other worker is reaping already).
+// The queue head is advanced before waking up the tasks so the slots are freed up early.
+size_t mp_uring_reap(mp_io_t* io) {
+  mp_uring_t* ring = io->uring;
+  if (ring == NULL) return 0;
+  size_t count = 0;
+  while (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != __atomic_load_n(ring->cq_head, __ATOMIC_ACQUIRE) &&
+         mp_spin_lock_try_acquire(&ring->cq_lock)) {
+    unsigned head = __atomic_load_n(ring->cq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    mp_uring_op_t* ops[MP_URING_ENTRIES];
+    size_t n = 0;
+    while (head != tail && n < MP_URING_ENTRIES) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+      mp_uring_op_t* op = (mp_uring_op_t*)(uintptr_t)cqe->user_data;
+      op->res = cqe->res;
+      ops[n++] = op;
+      head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    mp_spin_lock_release(&ring->cq_lock);
+    mp_atomic_add(&io->waiting, -(intptr_t)n);
+    for (size_t i = 0; i < n; i++) {
+      mp_task_wake(ops[i]->task, ops[i]);   // note: `ops[i]` is gone once its task runs
+    }
+    count += n;
+  }
+  return count;
+}
+
+
+//-----------------------------------------------------------------------
+// Submission
+// Entries are not submitted right away but batched: workers submit all
+// pending entries with a single `io_uring_enter` once there are at least
+// `min_pending` (or when they run out of local work, see `mp_worker_next`).
+// Since operations on cached files often complete during the submission, we
+// reap directly afterwards (without going through `epoll_wait`).
+//-----------------------------------------------------------------------
+
+// Submit the pending entries; must hold the `sq_lock`
+static void mp_uring_submit_pending(mp_io_t* io, mp_uring_t* ring) {
+  const unsigned pending = ring->sq_pending;
+  if (pending == 0) return;
+  int res;
+  do {
+    res = mp_uring_enter(ring->fd, pending, 0, 0);
+  } while (res < 0 && errno == EINTR);
+  if (res > 0) {   // on failure (e.g. `EBUSY`) we try again on the next flush
+    ring->sq_pending -= (unsigned)res;
+    mp_atomic_add(&io->uring_pending, -(intptr_t)res);
+  }
+}
+
+size_t mp_uring_flush(mp_io_t* io, intptr_t min_pending) {
+  mp_uring_t* ring = io->uring;
+  if (ring == NULL || mp_atomic_load(&io->uring_pending) < min_pending) return 0;
+  if (mp_spin_lock_try_acquire(&ring->sq_lock)) {  // or another worker is submitting already
+    mp_uring_submit_pending(io, ring);
+    mp_spin_lock_release(&ring->sq_lock);
+  }
+  return mp_uring_reap(io);
+}
+
+// Add an entry to the submission queue; must hold the `sq_lock` and the queue must not be full
+static void mp_uring_queue(mp_io_t* io, mp_uring_t* ring, mp_uring_op_t* op) {
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op->opcode;
+  sqe->fd = op->fd;
+  sqe->addr = (uint64_t)(uintptr_t)op->buf;
+  sqe->len = (uint32_t)op->len;
+  sqe->off = (uint64_t)op->offset;   // -1 for the current position
+  sqe->user_data = (uint64_t)(uintptr_t)op;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->sq_pending++;
+  mp_atomic_add(&io->uring_pending, 1);
+}
+
+// If the submission queue is full (and stays full after submitting, for example with
+// `EBUSY` as the completion queue is backed up) we reap completions and try once more;
+// if it is still full the task is woken up right away to use the fallback instead
+// (spinning here could wait forever on completions that only this worker would reap).
+static void mp_uring_submit_park(mp_task_t* t, void* arg) {
+  mp_uring_op_t* op = (mp_uring_op_t*)arg;
+  mp_uring_t* ring = op->ring;
+  mp_io_t* io = &op->sched->io;
+  op->task = t;
+  mp_atomic_add(&io->waiting, 1);
+  bool queued = false;
+  mp_spin_lock(&ring->sq_lock) {
+    if (ring->sq_pending >= ring->sq_entries) {  // full
+      mp_uring_submit_pending(io, ring);
+      if (ring->sq_pending >= ring->sq_entries) {
+        mp_uring_reap(io);
+        mp_uring_submit_pending(io, ring);
+      }
+    }
+    if (ring->sq_pending < ring->sq_entries) {
+      op->queued = true;
+      queued = true;
+      mp_uring_queue(io, ring, op);
+    }
+  }
+  // note: if queued, `op` may be gone from here on (but is only submitted by a later flush)
+  if (!queued) {
+    mp_atomic_add(&io->waiting, -1);
+    mp_task_wake(t, NULL);
+  }
+}
+
+// Submit an operation and suspend until it completes; returns false if io_uring cannot be used (right now).
+static bool mp_uring_submit(uint8_t opcode, int fd, void* buf, size_t len, off_t offset, ssize_t* result) {
+  mp_task_t* t = mp_task_current();
+  if (t == NULL) return false;
+  mp_uring_t* ring = t->sched->io.uring;
+  if (ring == NULL) return false;
+  if (offset < 0 && (ring->features & IORING_FEAT_RW_CUR_POS) == 0) return false;
+  if (len > UINT32_MAX) { len = UINT32_MAX; }
+  mp_uring_op_t op;
+  op.ring = ring;
+  op.sched = t->sched;
+  op.task = t;
+  op.opcode = opcode;
+  op.fd = fd;
+  op.buf = buf;
+  op.len = len;
+  op.offset = (offset < 0 ? (off_t)-1 : offset);
+  op.res = 0;
+  op.queued = false;
+  mp_task_park(&mp_uring_submit_park, &op);
+  if (!op.queued) return false;   // the submission queue is full
+  *result = op.res;
+  return true;
+}
+
+ssize_t mp_io_pread(int fd, void* buf, size_t len, off_t offset) {
+  ssize_t res;
+  while (mp_uring_submit(IORING_OP_READ, fd, buf, len, offset, &res)) {
+    if (res >= 0) return res;
+    if (res == -EAGAIN) {   // a non-blocking descriptor that is not ready
+      if (mp_io_wait(fd, MP_IO_READ) != 0) return -1;
+    }
+    else if (res != -EINTR) {
+      errno = (int)(-res);
+      return -1;
+    }
+  }
+  return mp_io_pread_fallback(fd, buf, len, offset);
+}
+
+ssize_t mp_io_pwrite(int fd, const void* buf, size_t len, off_t offset) {
+  ssize_t res;
+  while (mp_uring_submit(IORING_OP_WRITE, fd, (void*)buf, len, offset, &res)) {
+    if (res >= 0) return res;
+    if (res == -EAGAIN) {
+      if (mp_io_wait(fd, MP_IO_WRITE) != 0) return -1;
+    }
+    else if (res != -EINTR) {
+      errno = (int)(-res);
+      return -1;
+    }
+  }
+  return mp_io_pwrite_fallback(fd, buf, len, offset);
+}
+
+#else
+
+//-----------------------------------------------------------------------
+// No io_uring
+//-----------------------------------------------------------------------
+
+void mp_uring_init(mp_io_t* io) {
+  io->uring = NULL;
+}
+
+void mp_uring_done(mp_io_t* io) {
+  MP_UNUSED(io);
+}
+
+bool mp_io_uring_enable(mp_sched_t* s, bool enable) {
+  MP_UNUSED(s); MP_UNUSED(enable);
+  return false;
+}
+
+bool mp_uring_is_fd(mp_io_t* io, int fd) {
+  MP_UNUSED(io); MP_UNUSED(fd);
+  return false;
+}
+
+size_t mp_uring_reap(mp_io_t* io) {
+  MP_UNUSED(io);
+  return 0;
+}
+
+size_t mp_uring_flush(mp_io_t* io, intptr_t min_pending) {
+  MP_UNUSED(io); MP_UNUSED(min_pending);
+  return 0;
+}
+
+ssize_t mp_io_pread(int fd, void* buf, size_t len, off_t offset) {
+  return mp_io_pread_fallback(fd, buf, len, offset);
+}
+
+ssize_t mp_io_pwrite(int fd, const void* buf, size_t len, off_t offset) {
+  return mp_io_pwrite_fallback(fd, buf, len, offset);
+}
+
+#endif
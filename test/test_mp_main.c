@@ -0,0 +1,639 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Tests for the low-level mprompt interface
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <mprompt.h>
+#include "test.h"
+
+static void test_switch_hooks(void);
+static void test_noyield(void);
+static void test_reenter(void);
+static void test_user_data(void);
+static void test_stack_profile(void);
+static void test_event_trace(void);
+static void test_registry(void);
+static void test_accounting(void);
+static void test_profiler(void);
+static void test_usdt(void);
+
+int main(void) {
+  mpt_printf("testing mprompt..\n");
+  mp_config_t config = mp_config_default();
+  config.prompt_registry = true;
+  config.prompt_accounting = true;
+  mp_init(&config);
+
+  test_switch_hooks();
+  test_noyield();
+  test_reenter();
+  test_user_data();
+  test_stack_profile();
+  test_event_trace();
+  test_registry();
+  test_accounting();
+  test_profiler();
+  test_usdt();
+
+  mpt_printf("done.\n");
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------
+  Context switch hooks: simulate swapping a thread-local variable
+-----------------------------------------------------------------*/
+
+static long hook_tls;       // simulates "external" thread-local state
+static long hook_switch_in;
+static long hook_switch_out;
+
+static void hook_in(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  hook_switch_in++;
+  hook_tls += 1000;
+}
+
+static void hook_out(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  hook_switch_out++;
+  hook_tls -= 1000;
+}
+
+static void* hook_yield(mp_resume_t* r, void* arg) {
+  mpt_assert(hook_tls == 0, "switched out");
+  return mp_resume_tail(r, arg);
+}
+
+static void* hook_gen(mp_prompt_t* p, void* arg) {
+  intptr_t n = (intptr_t)arg;
+  for (intptr_t i = 0; i < n; i++) {
+    mpt_assert(hook_tls == 1000, "switched in");
+    mp_yield(p, &hook_yield, NULL);
+  }
+  return NULL;
+}
+
+static void test_switch_hooks(void) {
+  mpt_assert(mp_switch_hook_register(&hook_in, &hook_out, NULL), "register hook");
+  mp_prompt(&hook_gen, (void*)10);
+  mpt_printf("switch hooks: in %ld, out %ld\n", hook_switch_in, hook_switch_out);
+  mpt_assert(hook_switch_in == 11 && hook_switch_out == 11, "switch hook count");
+  mpt_assert(hook_tls == 0, "balanced switch hooks");
+}
+
+
+/*-----------------------------------------------------------------
+  Prompts that never yield: yields to outer prompts pass through
+-----------------------------------------------------------------*/
+
+static void* noyield_add(mp_resume_t* r, void* arg) {
+  return mp_resume_tail(r, (void*)((intptr_t)arg + 1));
+}
+
+static void* noyield_body(mp_prompt_t* p, void* arg) {
+  mpt_assert(mp_prompt_top() != p, "noyield prompt is not in the chain");
+  mp_prompt_t* outer = (mp_prompt_t*)arg;
+  intptr_t total = 0;
+  for (intptr_t i = 0; i < 100; i++) {
+    total += (intptr_t)mp_yield(outer, &noyield_add, (void*)i);  // captures our in-place frame as well
+  }
+  return (void*)total;
+}
+
+static void* noyield_outer(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  return mp_prompt_noyield(&noyield_body, p);
+}
+
+static void test_noyield(void) {
+  intptr_t total = (intptr_t)mp_prompt(&noyield_outer, NULL);
+  mpt_printf("noyield: %zd\n", total);
+  mpt_assert(total == 5050, "noyield");
+}
+
+
+/*-----------------------------------------------------------------
+  Recyclable prompts: re-enter the same prompt for many tasks
+-----------------------------------------------------------------*/
+
+static void* reenter_resume(mp_resume_t* r, void* arg) {
+  return mp_resume_tail(r, arg);
+}
+
+static void* reenter_task(mp_prompt_t* p, void* arg) {
+  intptr_t i = (intptr_t)arg;
+  if (i % 2 == 0) {
+    i = (intptr_t)mp_yield(p, &reenter_resume, (void*)(i + 1)) - 1;  // suspend in the middle of a task
+  }
+  return (void*)(2*i);
+}
+
+#ifdef __cplusplus
+static void* reenter_throw(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  throw "reenter exception";
+}
+#endif
+
+static void* reenter_suspend(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;
+}
+
+static void* reenter_suspended_task(mp_prompt_t* p, void* arg) {
+  return mp_yield(p, &reenter_suspend, arg);
+}
+
+static int  reenter_error;
+static bool reenter_output;
+
+static void reenter_on_output(const char* msg, void* arg) {
+  UNUSED(msg); UNUSED(arg);
+  reenter_output = true;
+}
+
+static void reenter_on_error(int err, void* arg) {
+  UNUSED(arg);
+  reenter_error = err;
+}
+
+static void test_reenter(void) {
+  mp_prompt_t* p = mp_prompt_create();
+  // a task that is suspended (instead of returned) cannot be re-entered
+  mp_resume_t* r = (mp_resume_t*)mp_prompt_reenter(p, &reenter_suspended_task, NULL);
+  mp_output_handler_register(&reenter_on_output, NULL);
+  mp_error_handler_register(&reenter_on_error, NULL);
+  void* res = mp_prompt_reenter(p, &reenter_task, (void*)1);
+  mp_output_handler_register(NULL, NULL);
+  mp_error_handler_register(NULL, NULL);
+  mpt_assert(res == NULL && reenter_error == EINVAL && reenter_output, "reenter a suspended task");
+  mpt_assert(mp_resume(r, NULL) == NULL, "resume the suspended task");
+  intptr_t total = 0;
+  for (intptr_t i = 0; i < 1000; i++) {
+    total += (intptr_t)mp_prompt_reenter(p, &reenter_task, (void*)i);
+    #ifdef __cplusplus
+    if (i == 500) {
+      bool caught = false;
+      try {
+        mp_prompt_reenter(p, &reenter_throw, NULL);
+      }
+      catch (const char*) {
+        caught = true;
+      }
+      mpt_assert(caught, "reenter exception propagates");
+    }
+    #endif
+  }
+  mp_prompt_release(p);
+  mp_prompt_release(mp_prompt_create());  // never entered
+  mpt_printf("reenter: %zd\n", total);
+  mpt_assert(total == 999000, "reenter");
+}
+
+
+/*-----------------------------------------------------------------
+  User data allocated together with the prompt
+-----------------------------------------------------------------*/
+
+typedef struct user_task_s {
+  intptr_t count;
+  uint8_t  data[200];
+} user_task_t;
+
+static void* user_body(mp_prompt_t* p, void* arg) {
+  user_task_t* t = (user_task_t*)mp_prompt_user_data(p);
+  for (size_t i = 0; i < sizeof(t->data); i++) {
+    mpt_assert(t->data[i] == 0, "zero initialized user data");
+    t->data[i] = (uint8_t)i;
+  }
+  t->count += (intptr_t)arg;
+  return (void*)t->count;
+}
+
+static void test_user_data(void) {
+  mp_prompt(&reenter_task, (void*)1);   // ensure there is a cached gstack with a small header
+  intptr_t total = 0;
+  for (intptr_t i = 1; i <= 100; i++) {
+    mp_prompt_t* p = mp_prompt_create_ex(sizeof(user_task_t) + (size_t)i);
+    mpt_assert(mp_prompt_user_size(p) == sizeof(user_task_t) + (size_t)i, "user data size");
+    mpt_assert((uintptr_t)mp_prompt_user_data(p) % 16 == 0, "aligned user data");
+    total += (intptr_t)mp_prompt_enter(p, &user_body, (void*)i);
+  }
+  mp_prompt_t* p = mp_prompt_create();
+  mpt_assert(mp_prompt_user_data(p) == NULL, "no user data");
+  mp_prompt_release(p);
+  mpt_printf("user data: %zd\n", total);
+  mpt_assert(total == 5050, "user data");
+}
+
+
+/*-----------------------------------------------------------------
+  Stack profiles: a deep start function is recorded, saved, and loaded
+-----------------------------------------------------------------*/
+
+#define PROFILE_DEPTH  (96*1024)
+
+static void* profile_deep(mp_prompt_t* p, void* arg) {
+  UNUSED(p);
+  volatile uint8_t buf[PROFILE_DEPTH];
+  memset((void*)buf, 1, sizeof(buf));
+  return (void*)(intptr_t)buf[(intptr_t)arg];
+}
+
+typedef struct profile_find_s {
+  void*  key;
+  size_t commit;
+  size_t count;
+} profile_find_t;
+
+static void profile_visit(void* key, size_t commit, void* arg) {
+  profile_find_t* find = (profile_find_t*)arg;
+  if (key == find->key) { find->commit = commit; }
+  find->count++;
+}
+
+static void test_stack_profile(void) {
+  profile_find_t find = { (void*)(uintptr_t)&profile_deep, 0, 0 };
+  intptr_t total = 0;
+  for (int i = 0; i < 10; i++) {
+    total += (intptr_t)mp_prompt(&profile_deep, (void*)(intptr_t)i);   // pre-committed after the first
+  }
+  mpt_assert(total == 10, "profile run");
+  mp_stack_profile_foreach(&profile_visit, &find);
+  mpt_printf("stack profile: %zu entries, deep function: %zu KiB\n", find.count, find.commit / 1024);
+  mpt_assert(find.commit >= PROFILE_DEPTH, "profiled depth");
+  // save and load again: every entry maps back to an existing key
+  char fname[] = "/tmp/mp_stack_profile_XXXXXX";
+  int fd = mkstemp(fname);
+  mpt_assert(fd >= 0, "profile file");
+  close(fd);
+  mpt_assert(mp_stack_profile_save(fname), "profile save");
+  mpt_assert(mp_stack_profile_load(fname), "profile load");
+  remove(fname);
+  size_t count = find.count;
+  find.count = 0;
+  mp_stack_profile_foreach(&profile_visit, &find);
+  mpt_assert(find.count == count, "profile load keys");
+}
+
+
+/*-----------------------------------------------------------------
+  Event trace: begin and end events are balanced per prompt
+-----------------------------------------------------------------*/
+
+static size_t count_occurrences(const char* s, const char* pat) {
+  size_t n = 0;
+  while ((s = strstr(s, pat)) != NULL) { n++; s++; }
+  return n;
+}
+
+// every prompt alternates between begin and end, and ends closed
+static bool trace_intervals_ok(const char* s) {
+  static bool running[4096];
+  while ((s = strstr(s, "\"ph\":\"")) != NULL) {
+    char ph;
+    unsigned id;
+    if (sscanf(s, "\"ph\":\"%c\",\"cat\":\"prompt\",\"id\":%u", &ph, &id) == 2 && id < 4096) {
+      if (running[id] == (ph == 'b')) return false;
+      running[id] = (ph == 'b');
+    }
+    s++;
+  }
+  for (size_t i = 0; i < 4096; i++) {
+    if (running[i]) return false;
+  }
+  return true;
+}
+
+static void* trace_yield(mp_resume_t* r, void* arg) {
+  return mp_resume_tail(r, arg);
+}
+
+static void* trace_inner(mp_prompt_t* q, void* arg) {
+  UNUSED(q);
+  mp_yield((mp_prompt_t*)arg, &trace_yield, NULL);   // yield to the parent (suspending this prompt too)
+  return NULL;
+}
+
+static void* trace_outer(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  return mp_prompt(&trace_inner, p);
+}
+
+static void test_event_trace(void) {
+  mp_prompt(&hook_gen, (void*)10);
+  mp_prompt(&trace_outer, NULL);
+  char fname[] = "/tmp/mp_event_trace_XXXXXX";
+  int fd = mkstemp(fname);
+  mpt_assert(fd >= 0, "trace file");
+  close(fd);
+  bool ok = mp_event_trace_dump(fname);
+  #if MP_EVENT_TRACE
+  mpt_assert(ok, "trace dump");
+  FILE* f = fopen(fname, "r");
+  static char buf[8*1024*1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  buf[len] = 0;
+  fclose(f);
+  size_t begins = count_occurrences(buf, "\"ph\":\"b\"");
+  size_t ends = count_occurrences(buf, "\"ph\":\"e\"");
+  size_t nested = count_occurrences(buf, "\"nested\":1");
+  mpt_printf("event trace: %zu bytes, %zu begin, %zu end, %zu nested\n", len, begins, ends, nested);
+  mpt_assert(len < sizeof(buf) - 1 && begins > 10 && begins == ends, "trace balanced");
+  mpt_assert(nested == 2 && trace_intervals_ok(buf), "trace intervals per prompt");
+  #else
+  mpt_assert(!ok, "trace not compiled in");
+  #endif
+  remove(fname);
+}
+
+
+/*-----------------------------------------------------------------
+  Registry: enumerate suspended prompts without resuming them
+-----------------------------------------------------------------*/
+
+#define REGISTRY_N  8
+
+static mp_resume_t* registry_resumes[REGISTRY_N];
+
+static void* registry_park(mp_resume_t* r, void* arg) {
+  registry_resumes[(intptr_t)arg] = r;
+  return NULL;
+}
+
+static void* registry_fun(mp_prompt_t* p, void* arg) {
+  mp_yield(p, &registry_park, arg);
+  return NULL;
+}
+
+typedef struct registry_count_s {
+  size_t total;
+  size_t suspended;
+  size_t with_backtrace;
+} registry_count_t;
+
+static bool registry_visit(const mp_prompt_info_t* info, void* arg) {
+  registry_count_t* count = (registry_count_t*)arg;
+  if (info->start != (void*)(uintptr_t)&registry_fun) return true;
+  count->total++;
+  if (info->suspended && info->suspended_nsecs >= 0) count->suspended++;
+  if (info->backtrace_len >= 1 && info->backtrace[0] != NULL) count->with_backtrace++;
+  return true;
+}
+
+#define REGISTRY_SWITCHES  (200000)
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool            registry_done;
+
+static bool registry_switching(void) {
+  pthread_mutex_lock(&registry_lock);
+  const bool done = registry_done;
+  pthread_mutex_unlock(&registry_lock);
+  return !done;
+}
+
+static void* registry_busy_park(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;
+}
+
+static void* registry_busy_fun(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  while (mp_yield(p, &registry_busy_park, NULL) != NULL) { }
+  return NULL;
+}
+
+static void* registry_switcher(void* arg) {
+  UNUSED(arg);
+  mp_resume_t* r = (mp_resume_t*)mp_prompt(&registry_busy_fun, NULL);
+  for (int i = 0; i < REGISTRY_SWITCHES; i++) {
+    r = (mp_resume_t*)mp_resume(r, r);
+  }
+  mp_resume(r, NULL);
+  pthread_mutex_lock(&registry_lock);
+  registry_done = true;
+  pthread_mutex_unlock(&registry_lock);
+  return NULL;
+}
+
+static bool registry_busy_visit(const mp_prompt_info_t* info, void* arg) {
+  registry_count_t* count = (registry_count_t*)arg;
+  if (info->start != (void*)(uintptr_t)&registry_busy_fun) return true;
+  count->total++;
+  if (info->suspended) count->suspended++;
+  if (info->backtrace_len >= 1 && info->backtrace[0] != NULL) count->with_backtrace++;
+  return true;
+}
+
+static void test_registry(void) {
+  for (intptr_t i = 0; i < REGISTRY_N; i++) {
+    mp_prompt(&registry_fun, (void*)i);
+  }
+  registry_count_t count = { 0, 0, 0 };
+  mp_prompt_foreach(&registry_visit, &count);
+  mpt_printf("registry: %zu prompts, %zu suspended, %zu with a backtrace\n", count.total, count.suspended, count.with_backtrace);
+  mpt_assert(count.total == REGISTRY_N && count.suspended == REGISTRY_N && count.with_backtrace == REGISTRY_N, "registry suspended");
+  for (intptr_t i = 0; i < REGISTRY_N; i++) {
+    mp_resume(registry_resumes[i], NULL);
+  }
+  registry_count_t after = { 0, 0, 0 };
+  mp_prompt_foreach(&registry_visit, &after);
+  mpt_assert(after.total == 0, "registry empty");
+  // enumerate while another thread keeps switching its prompt
+  pthread_t switcher;
+  pthread_create(&switcher, NULL, &registry_switcher, NULL);
+  size_t rounds = 0;
+  registry_count_t busy = { 0, 0, 0 };
+  while (registry_switching()) {
+    mp_prompt_foreach(&registry_busy_visit, &busy);
+    rounds++;
+  }
+  pthread_join(switcher, NULL);
+  mpt_printf("registry: seen suspended %zu times in %zu rounds while switching\n", busy.suspended, rounds);
+  mpt_assert(busy.total == busy.suspended && busy.with_backtrace == busy.suspended, "registry while switching");
+}
+
+
+/*-----------------------------------------------------------------
+  Accounting: time slices between switches
+-----------------------------------------------------------------*/
+
+static mp_resume_t* accounting_resume;
+static size_t       accounting_long_slices;
+
+static void accounting_spin(long usecs) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 < usecs);
+}
+
+static void* accounting_park(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  accounting_resume = r;
+  return NULL;
+}
+
+static void* accounting_fun(mp_prompt_t* p, void* arg) {
+  UNUSED(arg);
+  for (int i = 0; i < 5; i++) {
+    accounting_spin(i == 2 ? 20000 : 2000);   // one long slice
+    mp_yield(p, &accounting_park, NULL);
+  }
+  return NULL;
+}
+
+static void accounting_slice(mp_prompt_t* p, uint64_t slice_nsecs, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  if (slice_nsecs >= 10000000) accounting_long_slices++;
+}
+
+static void test_accounting(void) {
+  mp_slice_hook_register(10000000, &accounting_slice, NULL);  // 10ms
+  mp_prompt_t* p = mp_prompt_create();
+  mp_prompt_enter(p, &accounting_fun, NULL);
+  for (int i = 1; i < 5; i++) {
+    mp_resume(accounting_resume, NULL);
+  }
+  mp_prompt_stats_t stats;
+  mpt_assert(mp_prompt_stats(p, &stats), "accounting enabled");
+  mpt_printf("accounting: %zu switches, run %.1fms, longest slice %.1fms, %zu long slices\n",
+             stats.switches, (double)stats.run_nsecs / 1e6, (double)stats.max_slice_nsecs / 1e6, accounting_long_slices);
+  mpt_assert(stats.switches == 5, "accounting switches");
+  // the cycle counter is calibrated over a millisecond, so allow for a 5% error
+  mpt_assert(stats.run_nsecs >= 28000000/100*95 && stats.max_slice_nsecs >= 20000000/100*95, "accounting time");
+  mpt_assert(accounting_long_slices >= 1, "accounting slice hook");
+  mp_resume(accounting_resume, NULL);   // and return
+  mp_slice_hook_register(0, NULL, NULL);
+}
+
+
+/*-----------------------------------------------------------------
+  Profiler: samples attributed to the running prompt
+-----------------------------------------------------------------*/
+
+static void* profiler_inner(mp_prompt_t* p, void* arg) {
+  UNUSED(p);
+  accounting_spin((long)(intptr_t)arg);
+  return NULL;
+}
+
+static void* profiler_outer(mp_prompt_t* p, void* arg) {
+  UNUSED(p);
+  for (int i = 0; i < 10; i++) {
+    mp_prompt(&profiler_inner, arg);
+  }
+  return NULL;
+}
+
+static void test_profiler(void) {
+  bool ok = mp_profiler_start(1000);
+  #if defined(__linux__)
+  mpt_assert(ok, "profiler start");
+  mp_prompt(&profiler_outer, (void*)10000);  // 100ms
+  mp_profiler_stop();
+  char fname[] = "/tmp/mp_profile_XXXXXX";
+  int fd = mkstemp(fname);
+  mpt_assert(fd >= 0, "profile file");
+  close(fd);
+  mpt_assert(mp_profiler_dump(fname), "profile dump");
+  FILE* f = fopen(fname, "r");
+  char line[4096];
+  size_t samples = 0, in_prompt = 0, max_depth = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    const char* count = strrchr(line, ' ');
+    mpt_assert(count != NULL, "folded line");
+    size_t n = (size_t)strtoul(count + 1, NULL, 10);
+    samples += n;
+    if (strncmp(line, "[prompt ", 8) == 0) in_prompt += n;
+    size_t depth = count_occurrences(line, ";");
+    if (depth > max_depth) max_depth = depth;
+  }
+  fclose(f);
+  remove(fname);
+  mpt_printf("profiler: %zu samples, %zu in a prompt, max depth %zu\n", samples, in_prompt, max_depth);
+  mpt_assert(samples >= 5 && in_prompt > samples / 2, "profile samples");  // timers on the CPU clock are limited to the kernel tick rate
+  #else
+  mpt_assert(!ok, "profiler not supported");
+  #endif
+}
+
+
+/*-----------------------------------------------------------------
+  USDT probes: check the stapsdt notes in our own executable
+-----------------------------------------------------------------*/
+
+#if MP_USDT && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#include <elf.h>
+
+static bool usdt_has_probe(const char* notes, size_t size, const char* probe) {
+  size_t ofs = 0;
+  while (ofs + sizeof(Elf64_Nhdr) <= size) {
+    const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*)(notes + ofs);
+    const char* name = notes + ofs + sizeof(Elf64_Nhdr);
+    const char* desc = name + ((nhdr->n_namesz + 3) & ~3u);
+    if (nhdr->n_type == 3 && strcmp(name, "stapsdt") == 0) {
+      const char* provider = desc + 3*8;   // after the pc, base, and semaphore addresses
+      const char* pname = provider + strlen(provider) + 1;
+      if (strcmp(provider, "mprompt") == 0 && strcmp(pname, probe) == 0) return true;
+    }
+    ofs = (size_t)(desc - notes) + ((nhdr->n_descsz + 3) & ~3u);
+  }
+  return false;
+}
+
+static void test_usdt(void) {
+  FILE* f = fopen("/proc/self/exe", "rb");
+  mpt_assert(f != NULL, "open executable");
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* elf = (char*)malloc((size_t)len);
+  mpt_assert(elf != NULL && fread(elf, 1, (size_t)len, f) == (size_t)len, "read executable");
+  fclose(f);
+  const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)elf;
+  const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(elf + ehdr->e_shoff);
+  const char* shstrtab = elf + shdrs[ehdr->e_shstrndx].sh_offset;
+  const char* notes = NULL;
+  size_t notes_size = 0;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (strcmp(shstrtab + shdrs[i].sh_name, ".note.stapsdt") == 0) {
+      notes = elf + shdrs[i].sh_offset;
+      notes_size = (size_t)shdrs[i].sh_size;
+    }
+  }
+  mpt_assert(notes != NULL, "stapsdt notes");
+  const char* probes[] = { "prompt_create", "prompt_enter", "prompt_yield", "prompt_resume", "prompt_return", "prompt_drop",
+                           "gstack_alloc", "gstack_free", "gstack_cache_hit", "gstack_cache_miss", "gpool_create", "commit_on_demand" };
+  size_t found = 0;
+  for (size_t i = 0; i < sizeof(probes)/sizeof(probes[0]); i++) {
+    if (usdt_has_probe(notes, notes_size, probes[i])) { found++; }
+                                                 else { mpt_printf("missing probe: %s\n", probes[i]); }
+  }
+  free(elf);
+  mpt_printf("usdt: %zu of %zu probes\n", found, sizeof(probes)/sizeof(probes[0]));
+  mpt_assert(found == sizeof(probes)/sizeof(probes[0]), "usdt probes");
+}
+
+#else
+
+static void test_usdt(void) {
+  mpt_printf("usdt: not enabled\n");
+}
+
+#endif
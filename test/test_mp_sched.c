@@ -0,0 +1,1241 @@
+/* ----------------------------------------------------------------------------
+  Copyright (c) 2021, Microsoft Research, Daan Leijen
+  This is free software; you can redistribute it and/or modify it
+  under the terms of the MIT License. A copy of the license can be
+  found in the "LICENSE" file at the root of this distribution.
+
+  Tests for the M:N task scheduler
+-----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mpsched.h>
+#include "test.h"
+
+#define WORKERS  (4)
+
+static void test_sched_yield(void);
+static void test_sched_spawn_tree(void);
+static void test_sched_wake_foreign(void);
+static void test_sched_migrate(void);
+static void test_io_echo(void);
+static void test_io_tcp(void);
+static void test_io_close(void);
+static void test_io_reuse(void);
+static void test_io_files(bool use_uring);
+static void test_sleep(void);
+static void test_timeout(void);
+static void test_chan_pipeline(size_t capacity);
+static void test_chan_select(void);
+static void test_sync_mutex(void);
+static void test_sync_cond(void);
+static void test_offload(void);
+static void test_preempt(void);
+static void test_readyq(void);
+static void test_sched_prio(void);
+static void test_inbox(void);
+static void test_group(bool unwind);
+
+int main(void) {
+  mpt_printf("testing mpsched..\n");
+  mp_init(NULL);
+
+  test_sched_yield();
+  test_sched_spawn_tree();
+  test_sched_wake_foreign();
+  test_sched_migrate();
+  test_io_echo();
+  test_io_tcp();
+  test_io_close();
+  test_io_reuse();
+  test_io_files(true);
+  test_io_files(false);
+  test_sleep();
+  test_timeout();
+  test_chan_pipeline(0);
+  test_chan_pipeline(8);
+  test_chan_pipeline(MP_CHAN_UNBOUNDED);
+  test_chan_select();
+  test_sync_mutex();
+  test_sync_cond();
+  test_offload();
+  test_preempt();
+  test_readyq();
+  test_sched_prio();
+  test_inbox();
+  test_group(true);
+  test_group(false);
+
+  mpt_printf("done.\n");
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------
+  Tasks that yield often (and may migrate between workers)
+-----------------------------------------------------------------*/
+
+#define YIELD_TASKS   (1000)
+#define YIELD_COUNT   (100)
+
+typedef struct yield_slot_s {
+  intptr_t sum;
+  intptr_t migrations;
+} yield_slot_t;
+
+static yield_slot_t yield_slots[YIELD_TASKS];
+
+static void yield_task(void* arg) {
+  yield_slot_t* slot = (yield_slot_t*)arg;
+  size_t worker = mp_task_worker();
+  for (intptr_t i = 0; i < YIELD_COUNT; i++) {
+    volatile intptr_t work = 0;
+    for (int j = 0; j < 100; j++) { work += j; }
+    slot->sum += i;
+    mp_task_yield();
+    if (mp_task_worker() != worker) {
+      slot->migrations++;
+      worker = mp_task_worker();
+    }
+  }
+}
+
+static void test_sched_yield(void) {
+  memset(yield_slots, 0, sizeof(yield_slots));
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  for (size_t i = 0; i < YIELD_TASKS; i++) {
+    mp_sched_spawn(s, &yield_task, &yield_slots[i]);
+  }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  intptr_t total = 0;
+  intptr_t migrations = 0;
+  for (size_t i = 0; i < YIELD_TASKS; i++) {
+    total += yield_slots[i].sum;
+    migrations += yield_slots[i].migrations;
+  }
+  mpt_printf("sched yield: total %zd, migrations: %zd\n", total, migrations);
+  mpt_assert(total == (intptr_t)YIELD_TASKS * (YIELD_COUNT * (YIELD_COUNT - 1) / 2), "sched yield");
+}
+
+
+/*-----------------------------------------------------------------
+  Spawn a binary tree of tasks from within tasks
+-----------------------------------------------------------------*/
+
+#define TREE_DEPTH  (12)
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static intptr_t tree_leaves;
+
+static void tree_task(void* arg) {
+  intptr_t depth = (intptr_t)arg;
+  if (depth == 0) {
+    pthread_mutex_lock(&tree_lock);
+    tree_leaves++;
+    pthread_mutex_unlock(&tree_lock);
+  }
+  else {
+    mp_task_spawn(&tree_task, (void*)(depth - 1));
+    mp_task_yield();
+    mp_task_spawn(&tree_task, (void*)(depth - 1));
+  }
+}
+
+static void test_sched_spawn_tree(void) {
+  tree_leaves = 0;
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &tree_task, (void*)TREE_DEPTH);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("sched spawn tree: leaves %zd\n", tree_leaves);
+  mpt_assert(tree_leaves == ((intptr_t)1 << TREE_DEPTH), "sched spawn tree");
+}
+
+
+/*-----------------------------------------------------------------
+  Park tasks and wake them up from a thread outside the scheduler
+-----------------------------------------------------------------*/
+
+#define PARK_TASKS  (100)
+
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static mp_task_t*      park_waiting[PARK_TASKS];
+static size_t          park_count;
+static intptr_t        park_results[PARK_TASKS];
+
+static void park_publish(mp_task_t* t, void* arg) {
+  UNUSED(arg);
+  pthread_mutex_lock(&park_lock);
+  park_waiting[park_count++] = t;
+  pthread_mutex_unlock(&park_lock);
+}
+
+static void park_task(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  intptr_t res = (intptr_t)mp_task_park(&park_publish, NULL);
+  park_results[i] = res;
+}
+
+static void* park_waker(void* arg) {
+  UNUSED(arg);
+  size_t woken = 0;
+  while (woken < PARK_TASKS) {
+    mp_task_t* t = NULL;
+    pthread_mutex_lock(&park_lock);
+    if (woken < park_count) { t = park_waiting[woken++]; }
+    pthread_mutex_unlock(&park_lock);
+    if (t != NULL) {
+      mp_task_wake(t, (void*)(intptr_t)42);
+    }
+  }
+  return NULL;
+}
+
+static void test_sched_wake_foreign(void) {
+  park_count = 0;
+  memset(park_results, 0, sizeof(park_results));
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  for (intptr_t i = 0; i < PARK_TASKS; i++) {
+    mp_sched_spawn(s, &park_task, (void*)i);
+  }
+  pthread_t waker;
+  pthread_create(&waker, NULL, &park_waker, NULL);
+  mp_sched_run(s);
+  pthread_join(waker, NULL);
+  mp_sched_free(s);
+  intptr_t total = 0;
+  for (size_t i = 0; i < PARK_TASKS; i++) { total += park_results[i]; }
+  mpt_printf("sched wake foreign: %zd\n", total);
+  mpt_assert(total == 42 * PARK_TASKS, "sched wake foreign");
+}
+
+
+/*-----------------------------------------------------------------
+  A suspended task is resumed on another worker
+  (an idle worker will eventually steal it or pick it up after a yield)
+-----------------------------------------------------------------*/
+
+static intptr_t migrate_tries;
+
+static void migrate_wake_self(mp_task_t* t, void* arg) {
+  UNUSED(arg);
+  mp_task_wake(t, t);  // push on the deque of this worker (so others can steal it)
+}
+
+static void migrate_task(void* arg) {
+  UNUSED(arg);
+  size_t worker = mp_task_worker();
+  mp_task_t* self = mp_task_current();
+  for (migrate_tries = 1; migrate_tries < 10000000; migrate_tries++) {
+    void* res = (migrate_tries % 2 == 0 ? mp_task_park(&migrate_wake_self, NULL) : (mp_task_yield(), self));
+    mpt_assert(res == self, "park result");
+    mpt_assert(mp_task_current() == self, "current task");
+    if (mp_task_worker() != worker) break;   // migrated
+  }
+}
+
+static void test_sched_migrate(void) {
+  mp_sched_t* s = mp_sched_create(2);
+  mp_sched_spawn(s, &migrate_task, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("sched migrate: after %zd suspensions\n", migrate_tries);
+  mpt_assert(migrate_tries < 10000000, "sched migrate");
+}
+
+
+/*-----------------------------------------------------------------
+  Echo over socket pairs: the server task waits for reads while
+  the client task waits for the reply
+-----------------------------------------------------------------*/
+
+#define ECHO_PAIRS     (50)
+#define ECHO_MESSAGES  (100)
+
+static intptr_t echo_sums[ECHO_PAIRS];
+
+static void echo_server(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  intptr_t msg;
+  ssize_t n;
+  while ((n = mp_io_read(fd, &msg, sizeof(msg))) == sizeof(msg)) {
+    mpt_assert(mp_io_write(fd, &msg, sizeof(msg)) == sizeof(msg), "echo write");
+  }
+  mpt_assert(n == 0, "echo eof");
+  mp_io_close(fd);
+}
+
+static void echo_client(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  int fds[2];
+  mpt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  mp_io_nonblock(fds[0]);
+  mp_io_nonblock(fds[1]);
+  mp_task_spawn(&echo_server, (void*)(intptr_t)fds[1]);
+  for (intptr_t m = 0; m < ECHO_MESSAGES; m++) {
+    intptr_t msg = m;
+    mpt_assert(mp_io_write(fds[0], &msg, sizeof(msg)) == sizeof(msg), "client write");
+    msg = -1;
+    mpt_assert(mp_io_read(fds[0], &msg, sizeof(msg)) == sizeof(msg), "client read");
+    echo_sums[i] += msg;
+  }
+  mp_io_close(fds[0]);
+}
+
+static void test_io_echo(void) {
+  memset(echo_sums, 0, sizeof(echo_sums));
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  for (intptr_t i = 0; i < ECHO_PAIRS; i++) {
+    mp_sched_spawn(s, &echo_client, (void*)i);
+  }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  intptr_t total = 0;
+  for (size_t i = 0; i < ECHO_PAIRS; i++) { total += echo_sums[i]; }
+  mpt_printf("io echo: %zd\n", total);
+  mpt_assert(total == (intptr_t)ECHO_PAIRS * (ECHO_MESSAGES * (ECHO_MESSAGES - 1) / 2), "io echo");
+}
+
+
+/*-----------------------------------------------------------------
+  Closing a descriptor wakes up the task waiting on it
+-----------------------------------------------------------------*/
+
+static int close_errno;
+
+static void close_reader(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[16];
+  ssize_t n = mp_io_read(fd, buf, sizeof(buf));   // nothing is ever written
+  mpt_assert(n < 0, "read on a closed descriptor");
+  close_errno = errno;
+}
+
+static void close_closer(void* arg) {
+  UNUSED(arg);
+  int fds[2];
+  mpt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  mp_io_nonblock(fds[0]);
+  mp_io_nonblock(fds[1]);
+  mp_task_spawn(&close_reader, (void*)(intptr_t)fds[1]);
+  mp_sleep(10000000);   // let the reader wait first
+  mp_io_close(fds[1]);
+  mp_io_close(fds[0]);
+}
+
+// close from a thread outside the scheduler
+static int close_fds[2];
+
+static void* close_foreign(void* arg) {
+  UNUSED(arg);
+  struct timespec ts = { 0, 10000000 };   // let the reader wait first
+  nanosleep(&ts, NULL);
+  mp_io_close(close_fds[1]);
+  mp_io_close(close_fds[0]);
+  return NULL;
+}
+
+static void test_io_close(void) {
+  close_errno = 0;
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &close_closer, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("io close: errno %d\n", close_errno);
+  mpt_assert(close_errno == EBADF, "io close");
+
+  close_errno = 0;
+  mpt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, close_fds) == 0, "socketpair");
+  mp_io_nonblock(close_fds[0]);
+  mp_io_nonblock(close_fds[1]);
+  s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &close_reader, (void*)(intptr_t)close_fds[1]);
+  pthread_t closer;
+  pthread_create(&closer, NULL, &close_foreign, NULL);
+  mp_sched_run(s);
+  pthread_join(closer, NULL);
+  mp_sched_free(s);
+  mpt_printf("io close outside a task: errno %d\n", close_errno);
+  mpt_assert(close_errno == EBADF, "io close outside a task");
+}
+
+
+// wait on a descriptor, close it with a plain `close`, and wait on the reused descriptor number
+static int reuse_result;
+
+static void reuse_task(void* arg) {
+  UNUSED(arg);
+  int fds[2];
+  mpt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  mpt_assert(write(fds[1], "x", 1) == 1, "reuse write");
+  mpt_assert(mp_io_wait(fds[0], MP_IO_READ) == 0, "reuse first wait");
+  const int fd = fds[0];
+  close(fds[0]);
+  close(fds[1]);
+  mpt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  mpt_assert(fds[0] == fd, "reuse descriptor number");
+  mpt_assert(write(fds[1], "x", 1) == 1, "reuse write");
+  reuse_result = mp_io_wait(fds[0], MP_IO_READ);
+  mp_io_close(fds[0]);
+  mp_io_close(fds[1]);
+}
+
+static void test_io_reuse(void) {
+  reuse_result = -1;
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &reuse_task, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("io reuse: wait %d\n", reuse_result);
+  mpt_assert(reuse_result == 0, "io reuse");
+}
+
+
+/*-----------------------------------------------------------------
+  Accept and connect over TCP loopback
+-----------------------------------------------------------------*/
+
+#define TCP_CLIENTS  (20)
+
+static struct sockaddr_in tcp_addr;
+static pthread_mutex_t tcp_lock = PTHREAD_MUTEX_INITIALIZER;
+static intptr_t tcp_replies;
+
+static void tcp_connection(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[16];
+  ssize_t n = mp_io_read(fd, buf, sizeof(buf));
+  mpt_assert(n > 0, "tcp server read");
+  mpt_assert(mp_io_write(fd, buf, (size_t)n) == n, "tcp server write");
+  mp_io_close(fd);
+}
+
+static void tcp_listener(void* arg) {
+  int lfd = (int)(intptr_t)arg;
+  for (int i = 0; i < TCP_CLIENTS; i++) {
+    int cfd = mp_io_accept(lfd, NULL, NULL);
+    mpt_assert(cfd >= 0, "tcp accept");
+    mp_task_spawn(&tcp_connection, (void*)(intptr_t)cfd);
+  }
+  mp_io_close(lfd);
+}
+
+static void tcp_client(void* arg) {
+  UNUSED(arg);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  mpt_assert(fd >= 0, "tcp socket");
+  mp_io_nonblock(fd);
+  mpt_assert(mp_io_connect(fd, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) == 0, "tcp connect");
+  mpt_assert(mp_io_write(fd, "ping", 4) == 4, "tcp client write");
+  char buf[16];
+  ssize_t n = mp_io_read(fd, buf, sizeof(buf));
+  if (n == 4 && memcmp(buf, "ping", 4) == 0) {
+    pthread_mutex_lock(&tcp_lock);
+    tcp_replies++;
+    pthread_mutex_unlock(&tcp_lock);
+  }
+  mp_io_close(fd);
+}
+
+static void test_io_tcp(void) {
+  tcp_replies = 0;
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  mpt_assert(lfd >= 0, "tcp listen socket");
+  memset(&tcp_addr, 0, sizeof(tcp_addr));
+  tcp_addr.sin_family = AF_INET;
+  tcp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  tcp_addr.sin_port = 0;
+  socklen_t len = sizeof(tcp_addr);
+  if (bind(lfd, (struct sockaddr*)&tcp_addr, sizeof(tcp_addr)) != 0 ||
+      getsockname(lfd, (struct sockaddr*)&tcp_addr, &len) != 0 ||
+      listen(lfd, TCP_CLIENTS) != 0) {
+    mpt_printf("io tcp: skipped (no loopback networking)\n");
+    close(lfd);
+    return;
+  }
+  mp_io_nonblock(lfd);
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &tcp_listener, (void*)(intptr_t)lfd);
+  for (int i = 0; i < TCP_CLIENTS; i++) {
+    mp_sched_spawn(s, &tcp_client, NULL);
+  }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("io tcp: %zd replies\n", tcp_replies);
+  mpt_assert(tcp_replies == TCP_CLIENTS, "io tcp");
+}
+
+
+/*-----------------------------------------------------------------
+  Files and pipes with `mp_io_pread`/`mp_io_pwrite`
+  (using io_uring if available, or the fallback)
+-----------------------------------------------------------------*/
+
+#define FILE_TASKS   (16)
+#define FILE_BLOCKS  (32)
+#define BLOCK_SIZE   (512)
+
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int      file_fd;
+static intptr_t file_ok;
+static intptr_t pipe_sums[FILE_TASKS];
+
+static void file_task(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  char buf[BLOCK_SIZE];
+  for (intptr_t b = 0; b < FILE_BLOCKS; b++) {
+    off_t offset = (off_t)((i*FILE_BLOCKS + b) * BLOCK_SIZE);
+    memset(buf, (int)(i + b), sizeof(buf));
+    mpt_assert(mp_io_pwrite(file_fd, buf, sizeof(buf), offset) == BLOCK_SIZE, "file write");
+  }
+  for (intptr_t b = FILE_BLOCKS - 1; b >= 0; b--) {
+    off_t offset = (off_t)((i*FILE_BLOCKS + b) * BLOCK_SIZE);
+    memset(buf, 0, sizeof(buf));
+    mpt_assert(mp_io_pread(file_fd, buf, sizeof(buf), offset) == BLOCK_SIZE, "file read");
+    if (buf[0] == (char)(i + b) && buf[BLOCK_SIZE-1] == (char)(i + b)) {
+      pthread_mutex_lock(&file_lock);
+      file_ok++;
+      pthread_mutex_unlock(&file_lock);
+    }
+  }
+}
+
+static void pipe_reader(void* arg) {
+  int* fds = (int*)arg;
+  intptr_t i = fds[2];
+  intptr_t msg;
+  while (mp_io_pread(fds[0], &msg, sizeof(msg), -1) == sizeof(msg)) {
+    pipe_sums[i] += msg;
+  }
+  mp_io_close(fds[0]);
+  free(fds);
+}
+
+static void pipe_writer(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  int* fds = (int*)malloc(3*sizeof(int));
+  mpt_assert(pipe(fds) == 0, "pipe");
+  fds[2] = (int)i;
+  mp_io_nonblock(fds[0]);
+  mp_io_nonblock(fds[1]);
+  int wfd = fds[1];
+  mp_task_spawn(&pipe_reader, fds);
+  for (intptr_t m = 0; m < ECHO_MESSAGES; m++) {
+    mpt_assert(mp_io_pwrite(wfd, &m, sizeof(m), -1) == sizeof(m), "pipe write");
+  }
+  mp_io_close(wfd);
+}
+
+static void test_io_files(bool use_uring) {
+  char path[] = "/tmp/mpsched-test-XXXXXX";
+  file_fd = mkstemp(path);
+  mpt_assert(file_fd >= 0, "temporary file");
+  unlink(path);
+  file_ok = 0;
+  memset(pipe_sums, 0, sizeof(pipe_sums));
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  bool uring = mp_io_uring_enable(s, use_uring);
+  for (intptr_t i = 0; i < FILE_TASKS; i++) {
+    mp_sched_spawn(s, &file_task, (void*)i);
+    mp_sched_spawn(s, &pipe_writer, (void*)i);
+  }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  close(file_fd);
+  intptr_t total = 0;
+  for (size_t i = 0; i < FILE_TASKS; i++) { total += pipe_sums[i]; }
+  mpt_printf("io files (%s): %zd blocks, pipes: %zd\n", (uring ? "io_uring" : "fallback"), file_ok, total);
+  mpt_assert(file_ok == FILE_TASKS * FILE_BLOCKS, "io file blocks");
+  mpt_assert(total == (intptr_t)FILE_TASKS * (ECHO_MESSAGES * (ECHO_MESSAGES - 1) / 2), "io pipes");
+}
+
+
+/*-----------------------------------------------------------------
+  Sleeping tasks
+-----------------------------------------------------------------*/
+
+#define SLEEP_TASKS  (2000)
+#define MSECS        (1000000LL)
+
+static pthread_mutex_t sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static intptr_t sleep_ok;
+static int64_t  sleep_max_late;
+
+static int64_t clock_nsecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static void sleep_task(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  int64_t nsecs = (int64_t)(i % 20 + 1) * MSECS + (i % 7) * 100000;   // 1 to 21ms (and not on a tick)
+  for (int j = 0; j < 2; j++) {
+    int64_t start = clock_nsecs();
+    mp_sleep(nsecs);
+    int64_t elapsed = clock_nsecs() - start;
+    pthread_mutex_lock(&sleep_lock);
+    if (elapsed >= nsecs) { sleep_ok++; }
+    if (elapsed - nsecs > sleep_max_late) { sleep_max_late = elapsed - nsecs; }
+    pthread_mutex_unlock(&sleep_lock);
+  }
+}
+
+static void test_sleep(void) {
+  sleep_ok = 0;
+  sleep_max_late = 0;
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  for (intptr_t i = 0; i < SLEEP_TASKS; i++) {
+    mp_sched_spawn(s, &sleep_task, (void*)i);
+  }
+  int64_t start = clock_nsecs();
+  mp_sched_run(s);
+  int64_t elapsed = clock_nsecs() - start;
+  mp_sched_free(s);
+  mpt_printf("sleep: %zd on time, max late: %.1fms, total: %.1fms\n", sleep_ok, (double)sleep_max_late / MSECS, (double)elapsed / MSECS);
+  mpt_assert(sleep_ok == 2*SLEEP_TASKS, "sleep at least the requested time");
+}
+
+
+/*-----------------------------------------------------------------
+  Parking with a timeout: half of the tasks are woken up in time
+-----------------------------------------------------------------*/
+
+#define TIMEOUT_TASKS  (200)
+
+static pthread_mutex_t timeout_lock = PTHREAD_MUTEX_INITIALIZER;
+static mp_task_t*      timeout_parked[TIMEOUT_TASKS];
+static intptr_t        timeout_woken;
+static intptr_t        timeout_expired;
+
+static void timeout_publish(mp_task_t* t, void* arg) {
+  intptr_t i = (intptr_t)arg;
+  pthread_mutex_lock(&timeout_lock);
+  timeout_parked[i] = t;
+  pthread_mutex_unlock(&timeout_lock);
+}
+
+static bool timeout_cancel(mp_task_t* t, void* arg) {
+  intptr_t i = (intptr_t)arg;
+  bool removed = false;
+  pthread_mutex_lock(&timeout_lock);
+  if (timeout_parked[i] == t) {
+    timeout_parked[i] = NULL;
+    removed = true;
+  }
+  pthread_mutex_unlock(&timeout_lock);
+  return removed;
+}
+
+static void timeout_task(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  int64_t nsecs = (i % 2 == 0 ? 1000 : 5) * MSECS;  // even ones are woken before the timeout
+  void* res = mp_timeout(nsecs, &timeout_publish, &timeout_cancel, arg);
+  pthread_mutex_lock(&timeout_lock);
+  if (res == MP_TIMEOUT) { timeout_expired++; }
+  else if (res == arg) { timeout_woken++; }
+  pthread_mutex_unlock(&timeout_lock);
+}
+
+static void timeout_waker(void* arg) {
+  UNUSED(arg);
+  mp_sleep(20 * MSECS);
+  for (intptr_t i = 0; i < TIMEOUT_TASKS; i += 2) {
+    pthread_mutex_lock(&timeout_lock);
+    mp_task_t* t = timeout_parked[i];
+    timeout_parked[i] = NULL;
+    pthread_mutex_unlock(&timeout_lock);
+    if (t != NULL) { mp_task_wake(t, (void*)i); }
+  }
+}
+
+static void test_timeout(void) {
+  memset(timeout_parked, 0, sizeof(timeout_parked));
+  timeout_woken = 0;
+  timeout_expired = 0;
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  for (intptr_t i = 0; i < TIMEOUT_TASKS; i++) {
+    mp_sched_spawn(s, &timeout_task, (void*)i);
+  }
+  mp_sched_spawn(s, &timeout_waker, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("timeout: %zd woken, %zd expired\n", timeout_woken, timeout_expired);
+  mpt_assert(timeout_woken == TIMEOUT_TASKS/2 && timeout_expired == TIMEOUT_TASKS/2, "timeout");
+}
+
+
+/*-----------------------------------------------------------------
+  Channels: a pipeline of producer -> stages -> consumer
+-----------------------------------------------------------------*/
+
+#define CHAN_MSGS    (10000)
+#define CHAN_STAGES  (4)
+
+static mp_chan_t* chans[CHAN_STAGES + 1];
+static intptr_t   chan_sum;
+
+static void chan_producer(void* arg) {
+  UNUSED(arg);
+  for (intptr_t i = 1; i <= CHAN_MSGS; i++) {
+    mpt_assert(mp_chan_send(chans[0], (void*)i), "chan send");
+  }
+  mp_chan_close(chans[0]);
+}
+
+static void chan_stage(void* arg) {
+  intptr_t stage = (intptr_t)arg;
+  void* value;
+  while (mp_chan_recv(chans[stage], &value)) {
+    mp_chan_send(chans[stage + 1], (void*)((intptr_t)value + 1));
+  }
+  mp_chan_close(chans[stage + 1]);
+}
+
+static void chan_consumer(void* arg) {
+  UNUSED(arg);
+  void* value;
+  while (mp_chan_recv(chans[CHAN_STAGES], &value)) {
+    chan_sum += (intptr_t)value;
+  }
+  mpt_assert(!mp_chan_send(chans[CHAN_STAGES], NULL), "send on a closed channel");
+}
+
+static void test_chan_pipeline(size_t capacity) {
+  chan_sum = 0;
+  for (size_t i = 0; i <= CHAN_STAGES; i++) { chans[i] = mp_chan_create(capacity); }
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &chan_consumer, NULL);
+  for (intptr_t i = CHAN_STAGES - 1; i >= 0; i--) { mp_sched_spawn(s, &chan_stage, (void*)i); }
+  mp_sched_spawn(s, &chan_producer, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  for (size_t i = 0; i <= CHAN_STAGES; i++) { mp_chan_free(chans[i]); }
+  mpt_printf("chan pipeline (capacity %zd): %zd\n", (capacity == MP_CHAN_UNBOUNDED ? (ssize_t)-1 : (ssize_t)capacity), chan_sum);
+  mpt_assert(chan_sum == (intptr_t)CHAN_MSGS * (CHAN_MSGS + 1) / 2 + (intptr_t)CHAN_STAGES * CHAN_MSGS, "chan pipeline");
+}
+
+
+/*-----------------------------------------------------------------
+  Channels: select over several channels until they are all closed
+-----------------------------------------------------------------*/
+
+#define SELECT_SOURCES  (3)
+
+static mp_chan_t* select_chans[SELECT_SOURCES];
+static mp_chan_t* select_done;
+static intptr_t   select_counts[SELECT_SOURCES];
+
+static void select_source(void* arg) {
+  intptr_t i = (intptr_t)arg;
+  for (intptr_t m = 0; m < CHAN_MSGS; m++) {
+    if (m % 100 == 0) { mp_task_yield(); }
+    mp_chan_send(select_chans[i], (void*)i);
+  }
+  mp_chan_close(select_chans[i]);
+}
+
+static void select_sink(void* arg) {
+  UNUSED(arg);
+  mp_chan_op_t ops[SELECT_SOURCES];
+  size_t open = SELECT_SOURCES;
+  for (size_t i = 0; i < SELECT_SOURCES; i++) {
+    ops[i].chan = select_chans[i];
+    ops[i].kind = MP_CHAN_RECV;
+  }
+  while (open > 0) {
+    ssize_t i = mp_chan_select(ops, open);
+    mpt_assert(i >= 0, "chan select index");
+    if (!ops[i].ok) {
+      // closed: remove it from the select
+      ops[i] = ops[open - 1];
+      open--;
+    }
+    else {
+      select_counts[(intptr_t)ops[i].value]++;
+    }
+  }
+  mp_chan_send(select_done, (void*)1);
+}
+
+static void select_waiter(void* arg) {
+  UNUSED(arg);
+  void* value = NULL;
+  mpt_assert(mp_chan_recv(select_done, &value) && value == (void*)1, "select done");
+}
+
+static int select_errors;
+
+static void select_on_output(const char* msg, void* arg) {
+  UNUSED(msg); UNUSED(arg);
+}
+
+static void select_on_error(int err, void* arg) {
+  UNUSED(arg);
+  if (err == EINVAL) { select_errors++; }
+}
+
+// invalid operation counts, and blocking outside a task, fail with -1
+static void test_chan_select_invalid(void) {
+  mp_chan_t* c = mp_chan_create(1);
+  mp_chan_op_t ops[65];
+  for (size_t i = 0; i < 65; i++) {
+    ops[i].chan = c;
+    ops[i].kind = MP_CHAN_RECV;
+  }
+  mp_output_handler_register(&select_on_output, NULL);
+  mp_error_handler_register(&select_on_error, NULL);
+  const ssize_t none = mp_chan_select(ops, 0);
+  const ssize_t many = mp_chan_select(ops, 65);
+  const ssize_t block = mp_chan_select(ops, 1);   // empty, and not in a task
+  mp_output_handler_register(NULL, NULL);
+  mp_error_handler_register(NULL, NULL);
+  mpt_assert(none == -1 && many == -1 && block == -1 && select_errors == 3, "chan select invalid");
+  // a ready operation completes outside a task as well
+  mpt_assert(mp_chan_try_send(c, (void*)1), "chan select send");
+  mpt_assert(mp_chan_select(ops, 1) == 0 && ops[0].ok && ops[0].value == (void*)1, "chan select ready");
+  mp_chan_free(c);
+}
+
+static void test_chan_select(void) {
+  test_chan_select_invalid();
+  memset(select_counts, 0, sizeof(select_counts));
+  for (size_t i = 0; i < SELECT_SOURCES; i++) { select_chans[i] = mp_chan_create(i); }  // unbuffered, 1, and 2
+  select_done = mp_chan_create(0);
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &select_waiter, NULL);
+  mp_sched_spawn(s, &select_sink, NULL);
+  for (intptr_t i = 0; i < SELECT_SOURCES; i++) { mp_sched_spawn(s, &select_source, (void*)i); }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  for (size_t i = 0; i < SELECT_SOURCES; i++) { mp_chan_free(select_chans[i]); }
+  mp_chan_free(select_done);
+  mpt_printf("chan select: %zd, %zd, %zd\n", select_counts[0], select_counts[1], select_counts[2]);
+  for (size_t i = 0; i < SELECT_SOURCES; i++) {
+    mpt_assert(select_counts[i] == CHAN_MSGS, "chan select");
+  }
+}
+
+
+/*-----------------------------------------------------------------
+  Synchronization: contended mutex, and a semaphore that limits the
+  concurrency, with a wait group to wait for all tasks
+-----------------------------------------------------------------*/
+
+#define SYNC_TASKS   (1000)
+#define SYNC_COUNT   (100)
+#define SYNC_LIMIT   (4)
+
+static mp_mutex_t*     sync_mutex;
+static mp_sem_t*       sync_sem;
+static mp_waitgroup_t* sync_wg;
+static intptr_t        sync_counter;
+static intptr_t        sync_active;
+static intptr_t        sync_max_active;
+
+static void sync_task(void* arg) {
+  UNUSED(arg);
+  for (int i = 0; i < SYNC_COUNT; i++) {
+    mp_mutex_lock(sync_mutex);
+    intptr_t n = sync_counter;
+    if (i % 8 == 0) mp_task_yield();   // suspend while holding the lock
+    sync_counter = n + 1;
+    mp_mutex_unlock(sync_mutex);
+  }
+  mp_sem_acquire(sync_sem);
+  mp_mutex_lock(sync_mutex);
+  sync_active++;
+  if (sync_active > sync_max_active) { sync_max_active = sync_active; }
+  mp_mutex_unlock(sync_mutex);
+  mp_task_yield();
+  mp_mutex_lock(sync_mutex);
+  sync_active--;
+  mp_mutex_unlock(sync_mutex);
+  mp_sem_release(sync_sem);
+  mp_waitgroup_done(sync_wg);
+}
+
+static void sync_main(void* arg) {
+  UNUSED(arg);
+  mp_waitgroup_add(sync_wg, SYNC_TASKS);
+  for (int i = 0; i < SYNC_TASKS; i++) {
+    mp_task_spawn(&sync_task, NULL);
+  }
+  mp_waitgroup_wait(sync_wg);
+  mp_mutex_lock(sync_mutex);
+  mpt_assert(sync_counter == (intptr_t)SYNC_TASKS * SYNC_COUNT, "sync waitgroup");
+  mp_mutex_unlock(sync_mutex);
+}
+
+static void test_sync_mutex(void) {
+  sync_counter = sync_active = sync_max_active = 0;
+  sync_mutex = mp_mutex_create();
+  sync_sem = mp_sem_create(SYNC_LIMIT);
+  sync_wg = mp_waitgroup_create();
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  mp_sched_spawn(s, &sync_main, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mp_waitgroup_free(sync_wg);
+  mp_sem_free(sync_sem);
+  mp_mutex_free(sync_mutex);
+  mpt_printf("sync mutex: %zd, max active: %zd\n", sync_counter, sync_max_active);
+  mpt_assert(sync_counter == (intptr_t)SYNC_TASKS * SYNC_COUNT, "sync mutex");
+  mpt_assert(sync_max_active >= 1 && sync_max_active <= SYNC_LIMIT, "sync semaphore");
+}
+
+
+/*-----------------------------------------------------------------
+  Synchronization: a bounded queue with a mutex and two condition
+  variables
+-----------------------------------------------------------------*/
+
+#define COND_PRODUCERS  (8)
+#define COND_CONSUMERS  (8)
+#define COND_ITEMS      (2000)   // per producer
+#define COND_SIZE       (4)
+
+static mp_mutex_t* cond_mutex;
+static mp_cond_t*  cond_not_full;
+static mp_cond_t*  cond_not_empty;
+static intptr_t    cond_queue[COND_SIZE];
+static size_t      cond_count;
+static size_t      cond_head;
+static size_t      cond_producers_done;
+static intptr_t    cond_sum;
+
+static void cond_producer(void* arg) {
+  UNUSED(arg);
+  for (intptr_t i = 1; i <= COND_ITEMS; i++) {
+    mp_mutex_lock(cond_mutex);
+    while (cond_count == COND_SIZE) { mp_cond_wait(cond_not_full, cond_mutex); }
+    cond_queue[(cond_head + cond_count) % COND_SIZE] = i;
+    cond_count++;
+    mp_cond_signal(cond_not_empty);
+    mp_mutex_unlock(cond_mutex);
+  }
+  mp_mutex_lock(cond_mutex);
+  cond_producers_done++;
+  mp_cond_broadcast(cond_not_empty);
+  mp_mutex_unlock(cond_mutex);
+}
+
+static void cond_consumer(void* arg) {
+  UNUSED(arg);
+  intptr_t sum = 0;
+  mp_mutex_lock(cond_mutex);
+  while (true) {
+    while (cond_count == 0 && cond_producers_done < COND_PRODUCERS) { mp_cond_wait(cond_not_empty, cond_mutex); }
+    if (cond_count == 0) break;
+    sum += cond_queue[cond_head];
+    cond_head = (cond_head + 1) % COND_SIZE;
+    cond_count--;
+    mp_cond_signal(cond_not_full);
+  }
+  cond_sum += sum;
+  mp_mutex_unlock(cond_mutex);
+}
+
+static void test_sync_cond(void) {
+  cond_count = cond_head = cond_producers_done = 0;
+  cond_sum = 0;
+  cond_mutex = mp_mutex_create();
+  cond_not_full = mp_cond_create();
+  cond_not_empty = mp_cond_create();
+  mp_sched_t* s = mp_sched_create(WORKERS);
+  for (int i = 0; i < COND_CONSUMERS; i++) { mp_sched_spawn(s, &cond_consumer, NULL); }
+  for (int i = 0; i < COND_PRODUCERS; i++) { mp_sched_spawn(s, &cond_producer, NULL); }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mp_cond_free(cond_not_empty);
+  mp_cond_free(cond_not_full);
+  mp_mutex_free(cond_mutex);
+  mpt_printf("sync cond: %zd\n", cond_sum);
+  mpt_assert(cond_sum == (intptr_t)COND_PRODUCERS * COND_ITEMS * (COND_ITEMS + 1) / 2, "sync cond");
+}
+
+
+/*-----------------------------------------------------------------
+  Offload: blocking calls on the offload pool while a single worker
+  keeps running other tasks
+-----------------------------------------------------------------*/
+
+#define OFFLOAD_TASKS  (100)
+
+static intptr_t offload_sum;        // only accessed by tasks on the single worker
+static intptr_t offload_finished;
+static intptr_t offload_ticks;
+
+static void* offload_blocking(void* arg) {
+  usleep(1000);
+  return (void*)((intptr_t)arg + 1);
+}
+
+static void offload_task(void* arg) {
+  void* res = mp_offload(&offload_blocking, arg);
+  offload_sum += (intptr_t)res;
+  offload_finished++;
+}
+
+static void offload_ticker(void* arg) {
+  UNUSED(arg);
+  while (offload_finished < OFFLOAD_TASKS) {
+    offload_ticks++;
+    mp_task_yield();
+  }
+}
+
+static void test_offload(void) {
+  offload_sum = offload_finished = offload_ticks = 0;
+  mp_sched_t* s = mp_sched_create(1);
+  mp_offload_threads(s, 4);
+  mp_sched_spawn(s, &offload_ticker, NULL);
+  for (intptr_t i = 0; i < OFFLOAD_TASKS; i++) { mp_sched_spawn(s, &offload_task, (void*)i); }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("offload: %zd, ticks while blocked: %zd\n", offload_sum, offload_ticks);
+  mpt_assert(offload_sum == (intptr_t)OFFLOAD_TASKS * (OFFLOAD_TASKS + 1) / 2, "offload");
+  mpt_assert(offload_ticks > OFFLOAD_TASKS, "offload does not block the worker");
+}
+
+
+/*-----------------------------------------------------------------
+  Preemption: on a single worker, a task that spins without
+  suspending (but calls `mp_maybe_yield`) should let another task
+  run and stop it
+-----------------------------------------------------------------*/
+
+static volatile bool preempt_stop;
+static int64_t       preempt_start;
+static int64_t       preempt_elapsed;
+
+static void preempt_spinner(void* arg) {
+  UNUSED(arg);
+  preempt_start = clock_nsecs();
+  while (!preempt_stop) {
+    mp_maybe_yield();
+  }
+}
+
+static void preempt_stopper(void* arg) {
+  UNUSED(arg);
+  preempt_elapsed = clock_nsecs() - preempt_start;
+  preempt_stop = true;
+}
+
+static void test_preempt(void) {
+  preempt_stop = false;
+  mp_sched_t* s = mp_sched_create(1);
+  if (!mp_sched_timeslice(s, 2000000)) {  // 2ms
+    mp_sched_free(s);
+    mpt_printf("preempt: not supported\n");
+    return;
+  }
+  mp_sched_spawn(s, &preempt_spinner, NULL);
+  mp_sched_spawn(s, &preempt_stopper, NULL);
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("preempt: stopped after %.1fms\n", (double)preempt_elapsed / 1e6);
+  mpt_assert(preempt_stop, "preempt");
+}
+
+
+/*-----------------------------------------------------------------
+  Priority classes: a ready queue of plain resumptions, and tasks
+  with a class that run before the default ones
+-----------------------------------------------------------------*/
+
+#define PRIO_COUNT  (6)
+
+static int    prio_order[2*PRIO_COUNT];
+static size_t prio_ran;
+
+static void* prio_yield_fun(mp_resume_t* r, void* arg) {
+  UNUSED(arg);
+  return r;   // return the resumption from `mp_prompt_enter`
+}
+
+static void* prio_start(mp_prompt_t* p, void* arg) {
+  intptr_t id = (intptr_t)mp_yield(p, &prio_yield_fun, NULL);
+  prio_order[prio_ran++] = (int)id;
+  return arg;
+}
+
+static void test_readyq(void) {
+  // (priority, deadline in ms) for each entry, and the expected order
+  static const int prio[PRIO_COUNT]     = { 0, 1, 0, 2, 1, 0 };
+  static const int deadline[PRIO_COUNT] = { 0, 5, 3, 0, 2, 0 };
+  static const int expected[PRIO_COUNT] = { 3, 4, 1, 2, 0, 5 };
+  prio_ran = 0;
+  mp_readyq_t* q = mp_readyq_create();
+  for (intptr_t i = 0; i < PRIO_COUNT; i++) {
+    mp_resume_t* r = (mp_resume_t*)mp_prompt_enter(mp_prompt_create(), &prio_start, NULL);
+    mp_readyq_push(q, r, (void*)i, prio[i], (int64_t)deadline[i] * 1000000);
+  }
+  mpt_assert(mp_readyq_count(q) == PRIO_COUNT, "readyq count");
+  while (mp_readyq_resume_next(q, NULL)) { }
+  mp_readyq_free(q);
+  mpt_printf("readyq: %d %d %d %d %d %d\n", prio_order[0], prio_order[1], prio_order[2], prio_order[3], prio_order[4], prio_order[5]);
+  for (size_t i = 0; i < PRIO_COUNT; i++) {
+    mpt_assert(prio_order[i] == expected[i], "readyq order");
+  }
+}
+
+static void prio_task(void* arg) {
+  mp_task_yield();   // yielding keeps the class
+  prio_order[prio_ran++] = (int)(intptr_t)arg;
+}
+
+static void test_sched_prio(void) {
+  prio_ran = 0;
+  mp_sched_t* s = mp_sched_create(1);
+  for (intptr_t i = 0; i < PRIO_COUNT; i++) {
+    mp_sched_spawn(s, &prio_task, (void*)(100 + i));
+    mp_sched_spawn_prio(s, &prio_task, (void*)i, (int)(i % 3), (i % 3 == 0 ? 1000000000 - i*1000000 : 0));
+  }
+  mp_sched_run(s);
+  mp_sched_free(s);
+  mpt_printf("sched prio: %d %d %d %d %d %d, then %d ..\n", prio_order[0], prio_order[1], prio_order[2], prio_order[3], prio_order[4], prio_order[5], prio_order[6]);
+  // priority 2 (FIFO), then priority 1 (FIFO), then priority 0 with the latest spawned deadline first, and then the default tasks
+  static const int expected[PRIO_COUNT] = { 2, 5, 1, 4, 3, 0 };
+  for (size_t i = 0; i < PRIO_COUNT; i++) {
+    mpt_assert(prio_order[i] == expected[i], "sched prio order");
+  }
+  for (size_t i = PRIO_COUNT; i < 2*PRIO_COUNT; i++) {
+    mpt_assert(prio_order[i] >= 100, "sched prio before default");
+  }
+}
+
+
+/*-----------------------------------------------------------------
+  Inbox: threads post resumptions back to the owner thread
+-----------------------------------------------------------------*/
+
+#define INBOX_THREADS  (4)
+#define INBOX_PER      (100)
+
+static mp_inbox_t*  inbox;
+static mp_resume_t* inbox_resumes[INBOX_THREADS][INBOX_PER];
+static intptr_t     inbox_seen[INBOX_THREADS];    // last resumed index per thread
+static intptr_t     inbox_ordered;
+static intptr_t     inbox_done;
+
+static void* inbox_start(mp_prompt_t* p, void* arg) {
+  intptr_t id = (intptr_t)arg;
+  intptr_t value = (intptr_t)mp_yield(p, &prio_yield_fun, NULL);
+  // entries posted by one thread are resumed in posting order
+  const intptr_t thread = id / INBOX_PER;
+  if (value == 2*id && id % INBOX_PER == inbox_seen[thread] + 1) { inbox_ordered++; }
+  inbox_seen[thread] = id % INBOX_PER;
+  inbox_done++;
+  return NULL;
+}
+
+static void* inbox_poster(void* arg) {
+  intptr_t thread = (intptr_t)arg;
+  for (intptr_t i = 0; i < INBOX_PER; i++) {
+    intptr_t id = thread*INBOX_PER + i;
+    mp_resume_post(inbox, inbox_resumes[thread][i], (void*)(2*id));
+    if (i % 16 == 0) { usleep(100); }
+  }
+  return NULL;
+}
+
+static void test_inbox(void) {
+  inbox = mp_inbox_create();
+  mpt_assert(inbox != NULL && mp_inbox_fd(inbox) >= 0, "inbox create");
+  inbox_ordered = 0;
+  inbox_done = 0;
+  for (intptr_t t = 0; t < INBOX_THREADS; t++) {
+    inbox_seen[t] = -1;
+    for (intptr_t i = 0; i < INBOX_PER; i++) {
+      inbox_resumes[t][i] = (mp_resume_t*)mp_prompt_enter(mp_prompt_create(), &inbox_start, (void*)(t*INBOX_PER + i));
+    }
+  }
+  pthread_t threads[INBOX_THREADS];
+  for (intptr_t t = 0; t < INBOX_THREADS; t++) {
+    pthread_create(&threads[t], NULL, &inbox_poster, (void*)t);
+  }
+  size_t batches = 0;
+  while (inbox_done < INBOX_THREADS*INBOX_PER) {
+    if (mp_inbox_wait(inbox, 1000) > 0) { batches++; }
+  }
+  for (size_t t = 0; t < INBOX_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  mpt_assert(mp_inbox_drain(inbox) == 0, "inbox empty");
+  mp_inbox_free(inbox);
+  mpt_printf("inbox: %zd resumed in order (in %zu batches)\n", inbox_ordered, batches);
+  mpt_assert(inbox_ordered == INBOX_THREADS*INBOX_PER, "inbox order");
+}
+
+
+/*-----------------------------------------------------------------
+  Groups: cancel all suspended members at once
+-----------------------------------------------------------------*/
+
+#define GROUP_MEMBERS  (50)
+
+static mp_member_t* group_waiting[GROUP_MEMBERS];
+static intptr_t     group_resumed;
+static intptr_t     group_cleanups;
+
+static void group_park(mp_member_t* m, void* arg) {
+  group_waiting[(intptr_t)arg] = m;
+}
+
+static void* group_member(mp_prompt_t* p, void* arg) {
+  void* value;
+  while (mp_member_suspend(p, &group_park, arg, &value)) {
+    group_resumed += (intptr_t)value;
+  }
+  group_cleanups++;   // unwinding
+  return NULL;
+}
+
+#ifdef __cplusplus
+static void* group_throw(mp_prompt_t* p, void* arg) {
+  UNUSED(p); UNUSED(arg);
+  throw "group exception";
+}
+#endif
+
+static void test_group(bool unwind) {
+  group_resumed = 0;
+  group_cleanups = 0;
+  mp_group_t* g = mp_group_create();
+  for (intptr_t i = 0; i < GROUP_MEMBERS; i++) {
+    mp_group_spawn(g, &group_member, (void*)i);
+  }
+  mpt_assert(mp_group_count(g) == GROUP_MEMBERS && mp_group_suspended_count(g) == GROUP_MEMBERS, "group spawn");
+  for (intptr_t i = 0; i < GROUP_MEMBERS; i += 2) {
+    mp_member_resume(group_waiting[i], (void*)1);   // suspends again
+  }
+  mpt_assert(group_resumed == GROUP_MEMBERS/2, "group resume");
+  #ifdef __cplusplus
+  bool thrown = false;
+  try {
+    mp_group_spawn(g, &group_throw, NULL);
+  }
+  catch (const char*) {
+    thrown = true;
+  }
+  mpt_assert(thrown && mp_group_count(g) == GROUP_MEMBERS, "group member exception");
+  #endif
+  size_t cancelled = mp_group_cancel(g, unwind);
+  mpt_printf("group %s: cancelled %zu, ran %zd cleanups\n", (unwind ? "unwind" : "drop"), cancelled, group_cleanups);
+  mpt_assert(cancelled == GROUP_MEMBERS && mp_group_count(g) == 0 && mp_group_suspended_count(g) == 0, "group cancel");
+  mpt_assert(group_cleanups == (unwind ? GROUP_MEMBERS : 0), "group cleanups");
+  mpt_assert(mp_group_spawn(g, &group_member, (void*)0) == NULL && mp_group_count(g) == 0, "group cancelled spawn");
+  mp_group_free(g);
+}